@@ -0,0 +1,171 @@
+/**
+ * Copyright Fractal Computers, Inc. 2021
+ * @file affinity.cpp
+ * @brief CPU and NUMA placement of the worker threads
+ */
+
+#include "affinity.h"
+
+#include <errno.h>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "log.h"
+
+using namespace std;
+
+int parse_cpu_list(const char* list, vector<int>* cpus) {
+    cpus->clear();
+    const char* p = list;
+    while (*p) {
+        char* end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p || first < 0) {
+            return -1;
+        }
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1 || last < first) {
+                return -1;
+            }
+            p = end;
+        }
+        if (last >= CPU_SETSIZE) {
+            return -1;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            cpus->push_back((int)cpu);
+        }
+        if (*p == ',') {
+            p++;
+        } else if (*p != '\0' && *p != '\n') {
+            return -1;
+        } else {
+            break;
+        }
+    }
+    return cpus->empty() ? -1 : 0;
+}
+
+// Reads the first CPU an IRQ is delivered to
+static int irq_cpu(int irq) {
+    // effective_affinity_list is what the interrupt controller actually
+    // does, smp_affinity_list is the fallback for older kernels
+    const char* files[] = {"effective_affinity_list", "smp_affinity_list"};
+    for (const char* file : files) {
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/irq/%d/%s", irq, file);
+        FILE* f = fopen(path, "r");
+        if (!f) {
+            continue;
+        }
+        char list[256];
+        vector<int> cpus;
+        bool ok = fgets(list, sizeof(list), f) &&
+                  parse_cpu_list(list, &cpus) == 0;
+        fclose(f);
+        if (ok) {
+            return cpus[0];
+        }
+    }
+    return -1;
+}
+
+int irq_cpu_list(const char* ifname, vector<int>* cpus) {
+    cpus->clear();
+    FILE* f = fopen("/proc/interrupts", "r");
+    if (!f) {
+        log("Failed to open /proc/interrupts: %s\n", strerror(errno));
+        return -1;
+    }
+
+    // Queue interrupts are named after the interface, e.g. eth0-TxRx-0, and
+    // are listed in queue order
+    char line[4096];
+    size_t ifname_len = strlen(ifname);
+    while (fgets(line, sizeof(line), f)) {
+        int irq;
+        if (sscanf(line, " %d:", &irq) != 1) {
+            continue;
+        }
+        const char* name = strrchr(line, ' ');
+        if (!name || strncmp(name + 1, ifname, ifname_len) != 0 ||
+            name[1 + ifname_len] != '-') {
+            continue;
+        }
+        int cpu = irq_cpu(irq);
+        if (cpu >= 0 && find(cpus->begin(), cpus->end(), cpu) == cpus->end()) {
+            cpus->push_back(cpu);
+        }
+    }
+    fclose(f);
+
+    if (cpus->empty()) {
+        log("Found no queue interrupts for %s in /proc/interrupts\n", ifname);
+        return -1;
+    }
+    return 0;
+}
+
+int pin_thread(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (ret != 0) {
+        log("Failed to pin thread to CPU %d: %s\n", cpu, strerror(ret));
+        return -1;
+    }
+    return 0;
+}
+
+int numa_bind_local(void* mem, size_t size) {
+    // mbind(2) only takes whole pages
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = ((uintptr_t)mem + page - 1) & ~(page - 1);
+    uintptr_t end = ((uintptr_t)mem + size) & ~(page - 1);
+    unsigned int cpu, node;
+    if (end <= start || syscall(SYS_getcpu, &cpu, &node, NULL) < 0 ||
+        node >= sizeof(unsigned long) * 8) {
+        return 0;
+    }
+
+    // Prefer the local node even if the process was started with another
+    // policy (e.g. under numactl --interleave), and move the pages already
+    // faulted in elsewhere
+    unsigned long nodemask = 1UL << node;
+    if (syscall(SYS_mbind, (void*)start, end - start, MPOL_PREFERRED,
+                &nodemask, sizeof(nodemask) * 8, MPOL_MF_MOVE) < 0) {
+        log("Failed to mbind(2) to NUMA node %u: %s\n", node,
+            strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+void* numa_alloc_local(size_t size) {
+    void* mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        log("Failed to mmap(2) %zu bytes: %s\n", size, strerror(errno));
+        return NULL;
+    }
+
+    // Fault the pages in from here, so that first-touch places them on the
+    // local node too
+    numa_bind_local(mem, size);
+    memset(mem, 0, size);
+    return mem;
+}
@@ -0,0 +1,91 @@
+#ifndef STUN_SERVER_AFFINITY_H
+#define STUN_SERVER_AFFINITY_H
+/**
+ * Copyright Fractal Computers, Inc. 2021
+ * @file affinity.h
+ * @brief CPU and NUMA placement of the worker threads
+============================
+Usage
+============================
+
+Build the list of CPUs to pin workers to with parse_cpu_list() or
+irq_cpu_list(), then have every worker call pin_thread() before allocating its
+buffers with numa_alloc_local(), so that they come from the NUMA node of the
+CPU the worker runs on. Memory the worker mostly touches but that was mapped
+before it was placed, e.g. its shard of the registry, can be moved to that node
+with numa_bind_local().
+*/
+
+/*
+============================
+Includes
+============================
+*/
+
+#include <stddef.h>
+
+#include <vector>
+
+/*
+============================
+Public Functions
+============================
+*/
+
+/**
+ * @brief                          Parse a list of CPUs in the kernel's format,
+ *                                 e.g. "0-3,8,10"
+ *
+ * @param list                     The list
+ * @param cpus                     Filled with the CPUs, in order
+ *
+ * @returns                        0 on success, -1 if the list is invalid
+ */
+int parse_cpu_list(const char* list, std::vector<int>* cpus);
+
+/**
+ * @brief                          Find the CPUs that service the interrupts
+ *                                 of a network interface's queues, so that
+ *                                 workers can run where their packets arrive
+ *
+ * @param ifname                   The network interface, e.g. "eth0"
+ * @param cpus                     Filled with one CPU per queue interrupt, in
+ *                                 queue order and without duplicates
+ *
+ * @returns                        0 on success, -1 if no interrupt was found
+ */
+int irq_cpu_list(const char* ifname, std::vector<int>* cpus);
+
+/**
+ * @brief                          Pin the calling thread to a CPU
+ *
+ * @param cpu                      The CPU
+ *
+ * @returns                        0 on success, -1 on failure
+ */
+int pin_thread(int cpu);
+
+/**
+ * @brief                          Prefer the NUMA node of the CPU the calling
+ *                                 thread runs on for the whole pages of a
+ *                                 range of memory, moving those already
+ *                                 faulted in elsewhere
+ *
+ * @param mem                      Start of the range
+ * @param size                     Size of the range
+ *
+ * @returns                        0 on success, -1 on failure
+ */
+int numa_bind_local(void* mem, size_t size);
+
+/**
+ * @brief                          Allocate zeroed memory from the NUMA node of
+ *                                 the CPU the calling thread runs on
+ *
+ * @param size                     Number of bytes to allocate
+ *
+ * @returns                        The memory, or NULL on failure
+ */
+void* numa_alloc_local(size_t size);
+
+#endif  // STUN_SERVER_AFFINITY_H
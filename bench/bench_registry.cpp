@@ -0,0 +1,194 @@
+/**
+ * Copyright Fractal Computers, Inc. 2021
+ * @file bench_registry.cpp
+ * @brief Measures the memory each registration takes in the registry, the
+ *        cost of registering and looking servers up, and how lookups scale
+ *        with the threads doing them
+ */
+
+/*
+============================
+Includes
+============================
+*/
+
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "clock.h"
+#include "registry.h"
+
+/*
+============================
+Defines
+============================
+*/
+
+#define BENCH_DEFAULT_REGISTRATIONS (1 << 20)
+// Filled up to just below where IPs are held to their quota
+#define BENCH_LOAD_PERCENT 70
+// Ports registered by each IP
+#define BENCH_PORTS_PER_IP 8
+// Most threads looking servers up at once
+#define BENCH_DEFAULT_THREADS 8
+// Lookups done by each thread when measuring how they scale
+#define BENCH_LOOKUPS_PER_THREAD (1 << 20)
+
+/*
+============================
+Custom Types
+============================
+*/
+
+typedef struct {
+    pthread_t thread;
+    unsigned int first;
+    unsigned int registrations;
+    double now;
+    unsigned int hits;
+} bench_reader_t;
+
+/*
+============================
+Private Functions
+============================
+*/
+
+static size_t resident_bytes() {
+    FILE* f = fopen("/proc/self/statm", "r");
+    unsigned long size = 0, resident = 0;
+    if (f) {
+        if (fscanf(f, "%lu %lu", &size, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(f);
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+static stun_entry_t nth_entry(unsigned int i) {
+    stun_entry_t entry;
+    entry.ip = htonl(0x0a000000 + i / BENCH_PORTS_PER_IP);
+    entry.public_port = htons(1024 + i % BENCH_PORTS_PER_IP);
+    entry.private_port = entry.public_port;
+    return entry;
+}
+
+// Looks up registrations from the thread's own starting point, the way
+// workers serving ASK_INFOs would
+static void* read_registrations(void* vargp) {
+    bench_reader_t* reader = (bench_reader_t*)vargp;
+    registry_entry_t found;
+    for (unsigned int i = 0; i < BENCH_LOOKUPS_PER_THREAD; i++) {
+        stun_entry_t entry =
+            nth_entry((reader->first + i) % reader->registrations);
+        reader->hits +=
+            registry_lookup(entry.ip, entry.public_port, reader->now, &found);
+    }
+    return NULL;
+}
+
+// Returns the lookups per second of the given number of threads, or 0 if any
+// of them missed
+static double read_concurrently(int num_threads, unsigned int registrations,
+                                double now) {
+    bench_reader_t readers[BENCH_DEFAULT_THREADS * 8];
+    uint64_t start = monotonic_ns();
+    for (int i = 0; i < num_threads; i++) {
+        readers[i].first = i * (registrations / num_threads);
+        readers[i].registrations = registrations;
+        readers[i].now = now;
+        readers[i].hits = 0;
+        pthread_create(&readers[i].thread, NULL, read_registrations,
+                       &readers[i]);
+    }
+    bool all_found = true;
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(readers[i].thread, NULL);
+        all_found &= readers[i].hits == BENCH_LOOKUPS_PER_THREAD;
+    }
+    uint64_t elapsed_ns = monotonic_ns() - start;
+    return all_found ? (double)num_threads * BENCH_LOOKUPS_PER_THREAD /
+                           elapsed_ns * 1e9
+                     : 0;
+}
+
+/*
+============================
+Main
+============================
+*/
+
+int main(int argc, char* argv[]) {
+    unsigned int registrations =
+        argc > 1 ? strtoul(argv[1], NULL, 0) : BENCH_DEFAULT_REGISTRATIONS;
+    int max_threads = argc > 2 ? atoi(argv[2]) : BENCH_DEFAULT_THREADS;
+    if (registrations == 0 || max_threads < 1 ||
+        max_threads > BENCH_DEFAULT_THREADS * 8) {
+        fprintf(stderr, "Usage: %s [registrations] [threads, at most %d]\n",
+                argv[0], BENCH_DEFAULT_THREADS * 8);
+        return 1;
+    }
+    unsigned int capacity = 16;
+    while ((uint64_t)capacity * BENCH_LOAD_PERCENT / 100 < registrations) {
+        capacity *= 2;
+    }
+
+    size_t before = resident_bytes();
+    if (registry_init(NULL, capacity, capacity, 1, NULL) < 0) {
+        return 1;
+    }
+
+    double now = time();
+    uint64_t start = monotonic_ns();
+    for (unsigned int i = 0; i < registrations; i++) {
+        stun_entry_t entry = nth_entry(i);
+        if (registry_post(&entry, 0, 0, now) == REGISTRY_FULL) {
+            fprintf(stderr, "Registry full after %u registrations\n", i);
+            return 1;
+        }
+    }
+    uint64_t post_ns = monotonic_ns() - start;
+    size_t after = resident_bytes();
+
+    registry_entry_t found;
+    unsigned int hits = 0;
+    start = monotonic_ns();
+    for (unsigned int i = 0; i < registrations; i++) {
+        stun_entry_t entry = nth_entry(i);
+        hits += registry_lookup(entry.ip, entry.public_port, now, &found);
+    }
+    uint64_t hit_ns = monotonic_ns() - start;
+
+    // IPs that never registered, most of which the filter turns away
+    unsigned int misses = 0;
+    start = monotonic_ns();
+    for (unsigned int i = 0; i < registrations; i++) {
+        stun_entry_t entry = nth_entry(i);
+        entry.ip ^= htonl(0x40000000);
+        misses += !registry_lookup(entry.ip, entry.public_port, now, &found);
+    }
+    uint64_t miss_ns = monotonic_ns() - start;
+
+    printf("registrations:          %u in a registry of %u\n", registrations,
+           capacity);
+    printf("resident bytes each:    %.1f\n",
+           (double)(after - before) / registrations);
+    printf("post:                   %.1f ns\n",
+           (double)post_ns / registrations);
+    printf("lookup hit:             %.1f ns (%u found)\n",
+           (double)hit_ns / registrations, hits);
+    printf("lookup miss:            %.1f ns (%u missed)\n",
+           (double)miss_ns / registrations, misses);
+
+    bool scaled = true;
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        double rate = read_concurrently(threads, registrations, now);
+        printf("lookups, %2d threads:    %.1f M/s\n", threads, rate / 1e6);
+        scaled &= rate > 0;
+    }
+    return hits == registrations && misses == registrations && scaled ? 0 : 1;
+}
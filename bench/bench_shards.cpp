@@ -0,0 +1,236 @@
+/**
+ * Copyright Fractal Computers, Inc. 2021
+ * @file bench_shards.cpp
+ * @brief Compares the throughput of workers sharing the whole registry with
+ *        that of workers each owning a shard of it, and forwarding the
+ *        requests of the others' shards to them
+ */
+
+/*
+============================
+Includes
+============================
+*/
+
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <atomic>
+
+#include "clock.h"
+#include "filter.h"
+#include "registry.h"
+#include "shard.h"
+
+using namespace std;
+
+/*
+============================
+Defines
+============================
+*/
+
+#define BENCH_DEFAULT_THREADS 4
+#define BENCH_MAX_THREADS 64
+#define BENCH_REGISTRATIONS (1 << 18)
+#define BENCH_PORTS_PER_IP 8
+// Requests each thread receives, one in BENCH_POST_EVERY of them a POST_INFO
+// and the others ASK_INFOs, as ASK_INFOs outnumber them about 10 to 1
+#define BENCH_REQUESTS_PER_THREAD (1 << 19)
+#define BENCH_POST_EVERY 10
+// Requests received between two flushes of the rings, like a recvmmsg(2)
+#define BENCH_BATCH 16
+
+/*
+============================
+Custom Types
+============================
+*/
+
+// A request as forwarded between the threads
+typedef struct {
+    uint32_t post;
+    uint32_t registration;
+} bench_request_t;
+
+typedef struct {
+    pthread_t thread;
+    unsigned int index;
+    uint64_t seed;
+    unsigned int found;
+} bench_worker_t;
+
+static unsigned int num_threads;
+static bool sharded;
+static double now;
+static atomic<uint64_t> handled;
+
+/*
+============================
+Private Functions
+============================
+*/
+
+static stun_entry_t nth_entry(unsigned int i) {
+    stun_entry_t entry;
+    entry.ip = htonl(0x0a000000 + i / BENCH_PORTS_PER_IP);
+    entry.public_port = htons(1024 + i % BENCH_PORTS_PER_IP);
+    entry.private_port = entry.public_port;
+    return entry;
+}
+
+static uint64_t next_random(uint64_t* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static void handle(const bench_request_t* request, bench_worker_t* worker) {
+    stun_entry_t entry = nth_entry(request->registration);
+    if (request->post) {
+        registry_post(&entry, 0, 0, now);
+    } else {
+        registry_entry_t found;
+        worker->found +=
+            registry_lookup(entry.ip, entry.public_port, now, &found);
+    }
+}
+
+static void handle_forwarded(const void* data, int size,
+                             const struct sockaddr_in* client,
+                             void* context) {
+    (void)size;
+    (void)client;
+    handle((const bench_request_t*)data, (bench_worker_t*)context);
+}
+
+// The next request the thread receives. POST_INFOs come from the IPs steered
+// to the thread, ASK_INFOs are for any IP
+static bench_request_t receive(bench_worker_t* worker, unsigned int i) {
+    bench_request_t request;
+    request.post = i % BENCH_POST_EVERY == 0;
+    do {
+        request.registration =
+            next_random(&worker->seed) % BENCH_REGISTRATIONS;
+    } while (request.post &&
+             steering_worker(nth_entry(request.registration).ip,
+                             num_threads) != worker->index);
+    return request;
+}
+
+static void* run_worker(void* vargp) {
+    bench_worker_t* worker = (bench_worker_t*)vargp;
+    struct sockaddr_in client = {};
+    uint64_t total = (uint64_t)num_threads * BENCH_REQUESTS_PER_THREAD;
+    for (unsigned int i = 0; i < BENCH_REQUESTS_PER_THREAD; i++) {
+        bench_request_t request = receive(worker, i);
+        unsigned int owner = steering_worker(
+            nth_entry(request.registration).ip, num_threads);
+        if (!sharded || owner == worker->index ||
+            !shard_forward(worker->index, owner, &request, sizeof(request),
+                           &client)) {
+            handle(&request, worker);
+            handled.fetch_add(1, memory_order_relaxed);
+        }
+        if (sharded && i % BENCH_BATCH == BENCH_BATCH - 1) {
+            shard_flush(worker->index);
+            handled.fetch_add(
+                shard_drain(worker->index, handle_forwarded, worker),
+                memory_order_relaxed);
+        }
+    }
+    // Keep serving the others until every request was handled
+    while (sharded && handled.load(memory_order_relaxed) < total) {
+        shard_flush(worker->index);
+        int drained = shard_drain(worker->index, handle_forwarded, worker);
+        handled.fetch_add(drained, memory_order_relaxed);
+        if (drained == 0) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+// Runs every thread against a fresh registry, and returns the requests
+// handled per second, or 0 if some ASK_INFO found nothing
+static double run() {
+    if (registry_init(NULL, BENCH_REGISTRATIONS * 2, BENCH_REGISTRATIONS,
+                      sharded ? num_threads : 1, NULL) < 0 ||
+        (sharded && shard_init(num_threads) < 0)) {
+        return 0;
+    }
+    now = time();
+    for (unsigned int i = 0; i < BENCH_REGISTRATIONS; i++) {
+        stun_entry_t entry = nth_entry(i);
+        registry_post(&entry, 0, 0, now);
+    }
+
+    bench_worker_t workers[BENCH_MAX_THREADS];
+    uint64_t start = monotonic_ns();
+    for (unsigned int i = 0; i < num_threads; i++) {
+        workers[i].index = i;
+        workers[i].seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+        workers[i].found = 0;
+        pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+    }
+    uint64_t asks = 0;
+    for (unsigned int i = 0; i < num_threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        asks += workers[i].found;
+    }
+    uint64_t elapsed_ns = monotonic_ns() - start;
+
+    // Requests 0, BENCH_POST_EVERY, ... are POST_INFOs
+    uint64_t expected =
+        (uint64_t)num_threads *
+        (BENCH_REQUESTS_PER_THREAD -
+         (BENCH_REQUESTS_PER_THREAD + BENCH_POST_EVERY - 1) / BENCH_POST_EVERY);
+    if (asks != expected) {
+        fprintf(stderr, "%lu of %lu ASK_INFOs found their server\n",
+                (unsigned long)asks, (unsigned long)expected);
+        return 0;
+    }
+    return (double)num_threads * BENCH_REQUESTS_PER_THREAD / elapsed_ns * 1e9;
+}
+
+/*
+============================
+Main
+============================
+*/
+
+int main(int argc, char* argv[]) {
+    int threads = argc > 1 ? atoi(argv[1]) : BENCH_DEFAULT_THREADS;
+    if (threads < 1 || threads > BENCH_MAX_THREADS) {
+        fprintf(stderr, "Usage: %s [threads, at most %d]\n", argv[0],
+                BENCH_MAX_THREADS);
+        return 1;
+    }
+    num_threads = threads;
+
+    // The registry can only be set up once per process, so every mode runs
+    // in a child of its own
+    int failures = 0;
+    for (int mode = 0; mode < 2; mode++) {
+        pid_t child = fork();
+        if (child == 0) {
+            sharded = mode == 1;
+            double rate = run();
+            printf("%-8s %2u threads:    %.2f M requests/s\n",
+                   sharded ? "sharded" : "shared", num_threads, rate / 1e6);
+            exit(rate > 0 ? 0 : 1);
+        }
+        int status;
+        if (child < 0 || waitpid(child, &status, 0) < 0 ||
+            !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            failures++;
+        }
+    }
+    return failures ? 1 : 0;
+}
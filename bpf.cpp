@@ -0,0 +1,162 @@
+/**
+ * Copyright Fractal Computers, Inc. 2021
+ * @file bpf.cpp
+ * @brief Minimal helpers to assemble and load BPF programs without libbpf or
+ *        a BPF toolchain
+ */
+
+#include "bpf.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "log.h"
+
+using namespace std;
+
+static void emit(bpf_program_t* prog, uint8_t code, int dst, int src,
+                 int16_t off, int32_t imm) {
+    struct bpf_insn insn = {};
+    insn.code = code;
+    insn.dst_reg = dst;
+    insn.src_reg = src;
+    insn.off = off;
+    insn.imm = imm;
+    prog->insns.push_back(insn);
+}
+
+static long sys_bpf(int cmd, union bpf_attr* attr) {
+    return syscall(SYS_bpf, cmd, attr, sizeof(*attr));
+}
+
+void bpf_mov_imm(bpf_program_t* prog, int dst, int32_t imm) {
+    emit(prog, BPF_ALU64 | BPF_MOV | BPF_K, dst, 0, 0, imm);
+}
+
+void bpf_mov_reg(bpf_program_t* prog, int dst, int src) {
+    emit(prog, BPF_ALU64 | BPF_MOV | BPF_X, dst, src, 0, 0);
+}
+
+void bpf_alu_imm(bpf_program_t* prog, int op, int dst, int32_t imm) {
+    emit(prog, BPF_ALU64 | op | BPF_K, dst, 0, 0, imm);
+}
+
+void bpf_load(bpf_program_t* prog, int size, int dst, int src, int16_t off) {
+    emit(prog, BPF_LDX | BPF_MEM | size, dst, src, off, 0);
+}
+
+void bpf_store(bpf_program_t* prog, int size, int dst, int src, int16_t off) {
+    emit(prog, BPF_STX | BPF_MEM | size, dst, src, off, 0);
+}
+
+void bpf_load_map(bpf_program_t* prog, int dst, int map_fd) {
+    // A 64-bit immediate load spanning two instructions, whose source marks
+    // the immediate as a map file descriptor for the verifier to resolve
+    emit(prog, BPF_LD | BPF_DW | BPF_IMM, dst, BPF_PSEUDO_MAP_FD, 0, map_fd);
+    emit(prog, 0, 0, 0, 0, 0);
+}
+
+void bpf_call(bpf_program_t* prog, int32_t helper) {
+    emit(prog, BPF_JMP | BPF_CALL, 0, 0, 0, helper);
+}
+
+void bpf_exit(bpf_program_t* prog) {
+    emit(prog, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+}
+
+void bpf_jump_to(bpf_program_t* prog, int op, int dst, int32_t imm, int label) {
+    prog->pending_jumps.insert(make_pair(label, prog->insns.size()));
+    emit(prog, BPF_JMP | op | BPF_K, dst, 0, 0, imm);
+}
+
+void bpf_jump_reg_to(bpf_program_t* prog, int op, int dst, int src,
+                     int label) {
+    prog->pending_jumps.insert(make_pair(label, prog->insns.size()));
+    emit(prog, BPF_JMP | op | BPF_X, dst, src, 0, 0);
+}
+
+void bpf_label(bpf_program_t* prog, int label) {
+    auto range = prog->pending_jumps.equal_range(label);
+    for (auto it = range.first; it != range.second; ++it) {
+        struct bpf_insn* jump = &prog->insns[it->second];
+        jump->off = (int16_t)(prog->insns.size() - it->second - 1);
+    }
+    prog->pending_jumps.erase(range.first, range.second);
+}
+
+int bpf_prog_load(enum bpf_prog_type type, const bpf_program_t* prog,
+                  const char* name) {
+    if (!prog->pending_jumps.empty()) {
+        log("BPF program %s jumps to a label that was never placed\n", name);
+        return -1;
+    }
+
+    static char verifier_log[65536];
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = type;
+    attr.insns = (uint64_t)(uintptr_t)prog->insns.data();
+    attr.insn_cnt = (uint32_t)prog->insns.size();
+    attr.license = (uint64_t)(uintptr_t) "GPL";
+    attr.log_buf = (uint64_t)(uintptr_t)verifier_log;
+    attr.log_size = sizeof(verifier_log);
+    attr.log_level = 1;
+    strncpy(attr.prog_name, name, sizeof(attr.prog_name) - 1);
+
+    verifier_log[0] = '\0';
+    int fd = (int)sys_bpf(BPF_PROG_LOAD, &attr);
+    if (fd < 0) {
+        log("Failed to load BPF program %s: %s\n%s\n", name, strerror(errno),
+            verifier_log);
+    }
+    return fd;
+}
+
+int bpf_map_create(enum bpf_map_type type, uint32_t key_size,
+                   uint32_t value_size, uint32_t max_entries,
+                   const char* name) {
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = type;
+    attr.key_size = key_size;
+    attr.value_size = value_size;
+    attr.max_entries = max_entries;
+    strncpy(attr.map_name, name, sizeof(attr.map_name) - 1);
+
+    int fd = (int)sys_bpf(BPF_MAP_CREATE, &attr);
+    if (fd < 0) {
+        log("Failed to create BPF map %s: %s\n", name, strerror(errno));
+    }
+    return fd;
+}
+
+int bpf_map_update(int map_fd, const void* key, const void* value) {
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = map_fd;
+    attr.key = (uint64_t)(uintptr_t)key;
+    attr.value = (uint64_t)(uintptr_t)value;
+    attr.flags = BPF_ANY;
+    return sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0 ? -1 : 0;
+}
+
+int bpf_map_lookup(int map_fd, const void* key, void* value) {
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = map_fd;
+    attr.key = (uint64_t)(uintptr_t)key;
+    attr.value = (uint64_t)(uintptr_t)value;
+    return sys_bpf(BPF_MAP_LOOKUP_ELEM, &attr) < 0 ? -1 : 0;
+}
+
+int bpf_link_xdp(int prog_fd, int ifindex, uint32_t flags) {
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = prog_fd;
+    attr.link_create.target_ifindex = ifindex;
+    attr.link_create.attach_type = BPF_XDP;
+    attr.link_create.flags = flags;
+    return (int)sys_bpf(BPF_LINK_CREATE, &attr);
+}
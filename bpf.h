@@ -0,0 +1,161 @@
+#ifndef STUN_SERVER_BPF_H
+#define STUN_SERVER_BPF_H
+/**
+ * Copyright Fractal Computers, Inc. 2021
+ * @file bpf.h
+ * @brief Minimal helpers to assemble and load BPF programs without libbpf or
+ *        a BPF toolchain
+============================
+Usage
+============================
+
+Programs are small enough to be written directly as instructions: build them
+into a bpf_program_t with the bpf_* instruction builders, using
+bpf_jump_to() and bpf_label() for forward jumps, then load them with
+bpf_prog_load(). Maps are created and updated with the bpf_map_* wrappers
+around the bpf(2) syscall.
+*/
+
+/*
+============================
+Includes
+============================
+*/
+
+#include <linux/bpf.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <map>
+#include <vector>
+
+/*
+============================
+Custom Types
+============================
+*/
+
+typedef struct {
+    std::vector<struct bpf_insn> insns;
+    // Jumps waiting for their label, by label
+    std::multimap<int, size_t> pending_jumps;
+} bpf_program_t;
+
+/*
+============================
+Public Functions
+============================
+*/
+
+/**
+ * @brief                          Append dst = imm
+ */
+void bpf_mov_imm(bpf_program_t* prog, int dst, int32_t imm);
+
+/**
+ * @brief                          Append dst = src
+ */
+void bpf_mov_reg(bpf_program_t* prog, int dst, int src);
+
+/**
+ * @brief                          Append dst op= imm, e.g. op = BPF_ADD
+ */
+void bpf_alu_imm(bpf_program_t* prog, int op, int dst, int32_t imm);
+
+/**
+ * @brief                          Append dst = *(size*)(src + off), with size
+ *                                 one of BPF_B, BPF_H, BPF_W and BPF_DW
+ */
+void bpf_load(bpf_program_t* prog, int size, int dst, int src, int16_t off);
+
+/**
+ * @brief                          Append *(size*)(dst + off) = src
+ */
+void bpf_store(bpf_program_t* prog, int size, int dst, int src, int16_t off);
+
+/**
+ * @brief                          Append dst = the map with file descriptor
+ *                                 map_fd, for use as a helper argument
+ */
+void bpf_load_map(bpf_program_t* prog, int dst, int map_fd);
+
+/**
+ * @brief                          Append a call to a BPF helper, e.g.
+ *                                 BPF_FUNC_redirect_map
+ */
+void bpf_call(bpf_program_t* prog, int32_t helper);
+
+/**
+ * @brief                          Append return r0
+ */
+void bpf_exit(bpf_program_t* prog);
+
+/**
+ * @brief                          Append if (dst op imm) goto label, e.g. op
+ *                                 = BPF_JNE. Labels may only be jumped to
+ *                                 forward
+ */
+void bpf_jump_to(bpf_program_t* prog, int op, int dst, int32_t imm, int label);
+
+/**
+ * @brief                          Append if (dst op src) goto label
+ */
+void bpf_jump_reg_to(bpf_program_t* prog, int op, int dst, int src,
+                     int label);
+
+/**
+ * @brief                          Place a label at the next instruction
+ */
+void bpf_label(bpf_program_t* prog, int label);
+
+/**
+ * @brief                          Load a program into the kernel, logging the
+ *                                 verifier's output if it is rejected
+ *
+ * @param type                     The program type
+ * @param prog                     The program, with every label placed
+ * @param name                     Name of the program, for bpftool
+ *
+ * @returns                        The program's file descriptor, or -1
+ */
+int bpf_prog_load(enum bpf_prog_type type, const bpf_program_t* prog,
+                  const char* name);
+
+/**
+ * @brief                          Create a map
+ *
+ * @returns                        The map's file descriptor, or -1
+ */
+int bpf_map_create(enum bpf_map_type type, uint32_t key_size,
+                   uint32_t value_size, uint32_t max_entries,
+                   const char* name);
+
+/**
+ * @brief                          Set a map's value for a key
+ *
+ * @returns                        0 on success, -1 on failure
+ */
+int bpf_map_update(int map_fd, const void* key, const void* value);
+
+/**
+ * @brief                          Get a map's value for a key
+ *
+ * @returns                        0 on success, -1 on failure
+ */
+int bpf_map_lookup(int map_fd, const void* key, void* value);
+
+/**
+ * @brief                          Attach an XDP program to a network
+ *                                 interface. It is detached when the returned
+ *                                 link is closed, including when the process
+ *                                 dies
+ *
+ * @param prog_fd                  The XDP program
+ * @param ifindex                  The network interface
+ * @param flags                    XDP_FLAGS_SKB_MODE or XDP_FLAGS_DRV_MODE
+ *
+ * @returns                        The link's file descriptor, or -1
+ */
+int bpf_link_xdp(int prog_fd, int ifindex, uint32_t flags);
+
+#endif  // STUN_SERVER_BPF_H
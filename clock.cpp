@@ -0,0 +1,23 @@
+/**
+ * Copyright Fractal Computers, Inc. 2021
+ * @file clock.cpp
+ * @brief Clocks used by the STUN server
+ */
+
+#include "clock.h"
+
+#include <stddef.h>
+#include <sys/time.h>
+#include <time.h>
+
+double time() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
@@ -0,0 +1,44 @@
+#ifndef STUN_SERVER_CLOCK_H
+#define STUN_SERVER_CLOCK_H
+/**
+ * Copyright Fractal Computers, Inc. 2021
+ * @file clock.h
+ * @brief Clocks used by the STUN server
+============================
+Usage
+============================
+
+Use time() for wall clock timestamps, e.g. those stored in the registry, which
+is shared with other processes. Use monotonic_ns() to measure durations and
+schedule timers.
+*/
+
+/*
+============================
+Includes
+============================
+*/
+
+#include <stdint.h>
+
+/*
+============================
+Public Functions
+============================
+*/
+
+/**
+ * @brief                          Get the wall clock time
+ *
+ * @returns                        Seconds since the epoch
+ */
+double time();
+
+/**
+ * @brief                          Get the monotonic clock time
+ *
+ * @returns                        Nanoseconds since an arbitrary point
+ */
+uint64_t monotonic_ns();
+
+#endif  // STUN_SERVER_CLOCK_H
@@ -0,0 +1,393 @@
+/**
+ * Copyright Fractal Computers, Inc. 2021
+ * @file config.cpp
+ * @brief Startup options of the STUN server
+ */
+
+#include "config.h"
+
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "registry.h"
+#include "stun.h"
+
+stun_config_t config = {
+    HOLEPUNCH_PORT,  // port
+    NULL,            // shm_registry
+    1 << 18,         // registry_capacity
+    0,               // registry_memory
+    1024,            // ip_quota
+    1,               // workers
+    NULL,            // cpus
+    NULL,            // irq_affinity
+    false,           // incoming_cpu
+    false,           // numa_local
+    0,               // busy_poll
+    0,               // busy_poll_budget
+    4096,            // max_waiters
+    false,           // ask_cookies
+    0,               // alt_port
+    NULL,            // alt_ip
+    NULL,            // xdp
+    1,               // xdp_queues
+    false,           // xdp_generic
+    "metrics.prom",  // metrics_file
+    10,              // metrics_interval
+    false,           // hugepages
+    false,           // shard_registry
+    4096,            // tcp_backlog
+    256,             // tcp_fastopen
+    4096,            // tcp_max_connections
+    64,              // tcp_max_per_ip
+};
+
+static void print_usage(const char* name) {
+    printf(
+        "Usage: %s [options]\n"
+        "  --port=PORT               UDP/TCP port to listen on (default %d)\n"
+        "  --shm-registry=NAME       keep the registry in the POSIX shared\n"
+        "                            memory object NAME, shared with every\n"
+        "                            other stun process started with it\n"
+        "  --registry-capacity=N     number of registrations the registry can\n"
+        "                            hold (default %u)\n"
+        "  --registry-memory=MB      size the registry to fit in MB\n"
+        "                            megabytes instead\n"
+        "  --ip-quota=N              registrations an IP may add once the\n"
+        "                            registry is 75%% full, plus one per\n"
+        "                            recent lookup of them (default %u)\n"
+        "  --workers=N               number of UDP worker threads\n"
+        "                            (default 1)\n"
+        "  --cpus=LIST               pin worker i to the i-th CPU of LIST,\n"
+        "                            e.g. 0-3,8\n"
+        "  --irq-affinity=IFACE      pin the workers to the CPUs servicing\n"
+        "                            the queue interrupts of IFACE\n"
+        "  --incoming-cpu            steer packets received on a worker's CPU\n"
+        "                            to that worker (SO_INCOMING_CPU)\n"
+        "  --numa-local              allocate worker buffers, and with\n"
+        "                            --shard-registry place their registry\n"
+        "                            shards, on the NUMA node of the\n"
+        "                            worker's CPU\n"
+        "  --busy-poll=USEC          have the workers busy-poll their sockets\n"
+        "                            instead of sleeping, with SO_BUSY_POLL\n"
+        "                            set to USEC\n"
+        "  --busy-poll-budget=N      SO_BUSY_POLL_BUDGET of the workers'\n"
+        "                            sockets\n"
+        "  --max-waiters=N           most ASK_INFOs waiting for their server\n"
+        "                            at once, 0 to never wait (default %u)\n"
+        "  --ask-cookies             only look up the UDP ASK_INFOs that echo\n"
+        "                            a cookie proving their source address,\n"
+        "                            so that spoofed ones don't reach\n"
+        "                            servers. Version 1 clients can then only\n"
+        "                            ASK over TCP\n"
+        "  --alt-port=PORT           also listen on UDP port PORT, to answer\n"
+        "                            NAT behavior discovery probes from a\n"
+        "                            second port\n"
+        "  --alt-ip=ADDR             also answer NAT behavior discovery\n"
+        "                            probes from ADDR, a second IP of this\n"
+        "                            host\n"
+        "  --xdp=IFACE               serve the UDP requests arriving on\n"
+        "                            IFACE over AF_XDP\n"
+        "  --xdp-queues=N            number of queues of IFACE to serve over\n"
+        "                            AF_XDP, from queue 0 (default 1)\n"
+        "  --xdp-generic             attach the XDP program in generic mode\n"
+        "                            instead of trying native mode first\n"
+        "  --metrics-file=PATH       where to write the metrics, in the\n"
+        "                            Prometheus text format (default\n"
+        "                            metrics.prom, empty to disable)\n"
+        "  --metrics-interval=SEC    seconds between two writes of the\n"
+        "                            metrics file (default %d)\n"
+        "  --hugepages               back the pools of waiters,\n"
+        "                            notifications and TCP connections with\n"
+        "                            huge pages\n"
+        "  --shard-registry          give every worker a shard of the\n"
+        "                            registry of its own, and forward it the\n"
+        "                            requests the others receive for it\n"
+        "  --tcp-backlog=N           most TCP connections waiting to be\n"
+        "                            accepted, up to net.core.somaxconn\n"
+        "                            (default %d)\n"
+        "  --tcp-fastopen=N          accept TCP requests sent in the SYN,\n"
+        "                            with at most N connections pending\n"
+        "                            their handshake, 0 to disable\n"
+        "                            (default %d)\n"
+        "  --tcp-max-connections=N   most TCP connections open at once,\n"
+        "                            past which new ones are reset\n"
+        "                            (default %u)\n"
+        "  --tcp-max-per-ip=N        most TCP connections open at once\n"
+        "                            from one IP (default %u)\n"
+        "  --help                    print this message\n",
+        name, HOLEPUNCH_PORT, config.registry_capacity, config.ip_quota,
+        config.max_waiters, config.metrics_interval, config.tcp_backlog,
+        config.tcp_fastopen, config.tcp_max_connections, config.tcp_max_per_ip);
+}
+
+// Parses optarg as an unsigned integer in [min, max]
+static bool parse_uint(const char* name, const char* arg, unsigned long min,
+                       unsigned long max, unsigned long* out) {
+    char* end;
+    unsigned long value = strtoul(arg, &end, 0);
+    if (*arg == '\0' || *end != '\0' || value < min || value > max) {
+        fprintf(stderr, "Invalid value \"%s\" for --%s (%lu to %lu)\n", arg,
+                name, min, max);
+        return false;
+    }
+    *out = value;
+    return true;
+}
+
+int parse_config(int argc, char* argv[]) {
+    enum {
+        OPT_PORT = 256,
+        OPT_SHM_REGISTRY,
+        OPT_REGISTRY_CAPACITY,
+        OPT_REGISTRY_MEMORY,
+        OPT_IP_QUOTA,
+        OPT_WORKERS,
+        OPT_CPUS,
+        OPT_IRQ_AFFINITY,
+        OPT_INCOMING_CPU,
+        OPT_NUMA_LOCAL,
+        OPT_BUSY_POLL,
+        OPT_BUSY_POLL_BUDGET,
+        OPT_MAX_WAITERS,
+        OPT_ASK_COOKIES,
+        OPT_ALT_PORT,
+        OPT_ALT_IP,
+        OPT_XDP,
+        OPT_XDP_QUEUES,
+        OPT_XDP_GENERIC,
+        OPT_METRICS_FILE,
+        OPT_METRICS_INTERVAL,
+        OPT_HUGEPAGES,
+        OPT_SHARD_REGISTRY,
+        OPT_TCP_BACKLOG,
+        OPT_TCP_FASTOPEN,
+        OPT_TCP_MAX_CONNECTIONS,
+        OPT_TCP_MAX_PER_IP,
+        OPT_HELP,
+    };
+    static const struct option options[] = {
+        {"port", required_argument, NULL, OPT_PORT},
+        {"shm-registry", required_argument, NULL, OPT_SHM_REGISTRY},
+        {"registry-capacity", required_argument, NULL, OPT_REGISTRY_CAPACITY},
+        {"registry-memory", required_argument, NULL, OPT_REGISTRY_MEMORY},
+        {"ip-quota", required_argument, NULL, OPT_IP_QUOTA},
+        {"workers", required_argument, NULL, OPT_WORKERS},
+        {"cpus", required_argument, NULL, OPT_CPUS},
+        {"irq-affinity", required_argument, NULL, OPT_IRQ_AFFINITY},
+        {"incoming-cpu", no_argument, NULL, OPT_INCOMING_CPU},
+        {"numa-local", no_argument, NULL, OPT_NUMA_LOCAL},
+        {"busy-poll", required_argument, NULL, OPT_BUSY_POLL},
+        {"busy-poll-budget", required_argument, NULL, OPT_BUSY_POLL_BUDGET},
+        {"max-waiters", required_argument, NULL, OPT_MAX_WAITERS},
+        {"ask-cookies", no_argument, NULL, OPT_ASK_COOKIES},
+        {"alt-port", required_argument, NULL, OPT_ALT_PORT},
+        {"alt-ip", required_argument, NULL, OPT_ALT_IP},
+        {"xdp", required_argument, NULL, OPT_XDP},
+        {"xdp-queues", required_argument, NULL, OPT_XDP_QUEUES},
+        {"xdp-generic", no_argument, NULL, OPT_XDP_GENERIC},
+        {"metrics-file", required_argument, NULL, OPT_METRICS_FILE},
+        {"metrics-interval", required_argument, NULL, OPT_METRICS_INTERVAL},
+        {"hugepages", no_argument, NULL, OPT_HUGEPAGES},
+        {"shard-registry", no_argument, NULL, OPT_SHARD_REGISTRY},
+        {"tcp-backlog", required_argument, NULL, OPT_TCP_BACKLOG},
+        {"tcp-fastopen", required_argument, NULL, OPT_TCP_FASTOPEN},
+        {"tcp-max-connections", required_argument, NULL,
+         OPT_TCP_MAX_CONNECTIONS},
+        {"tcp-max-per-ip", required_argument, NULL, OPT_TCP_MAX_PER_IP},
+        {"help", no_argument, NULL, OPT_HELP},
+        {NULL, 0, NULL, 0},
+    };
+
+    int opt;
+    unsigned long value;
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (opt) {
+            case OPT_PORT:
+                if (!parse_uint("port", optarg, 1, 65535, &value)) return -1;
+                config.port = (int)value;
+                break;
+            case OPT_SHM_REGISTRY:
+                if (optarg[0] != '/') {
+                    fprintf(stderr,
+                            "--shm-registry must start with a '/', e.g. "
+                            "/stun-registry\n");
+                    return -1;
+                }
+                config.shm_registry = optarg;
+                break;
+            case OPT_REGISTRY_CAPACITY:
+                if (!parse_uint("registry-capacity", optarg, 16,
+                                REGISTRY_MAX_CAPACITY, &value)) {
+                    return -1;
+                }
+                config.registry_capacity = (unsigned int)value;
+                break;
+            case OPT_REGISTRY_MEMORY:
+                if (!parse_uint("registry-memory", optarg, 1, 1 << 16,
+                                &value)) {
+                    return -1;
+                }
+                config.registry_memory = (unsigned int)value;
+                break;
+            case OPT_IP_QUOTA:
+                if (!parse_uint("ip-quota", optarg, 1, REGISTRY_MAX_CAPACITY,
+                                &value)) {
+                    return -1;
+                }
+                config.ip_quota = (unsigned int)value;
+                break;
+            case OPT_WORKERS:
+                if (!parse_uint("workers", optarg, 1, 256, &value)) return -1;
+                config.workers = (int)value;
+                break;
+            case OPT_CPUS:
+                config.cpus = optarg;
+                break;
+            case OPT_IRQ_AFFINITY:
+                config.irq_affinity = optarg;
+                break;
+            case OPT_INCOMING_CPU:
+                config.incoming_cpu = true;
+                break;
+            case OPT_NUMA_LOCAL:
+                config.numa_local = true;
+                break;
+            case OPT_BUSY_POLL:
+                if (!parse_uint("busy-poll", optarg, 1, 1000000, &value)) {
+                    return -1;
+                }
+                config.busy_poll = (int)value;
+                break;
+            case OPT_BUSY_POLL_BUDGET:
+                if (!parse_uint("busy-poll-budget", optarg, 1, 65535,
+                                &value)) {
+                    return -1;
+                }
+                config.busy_poll_budget = (int)value;
+                break;
+            case OPT_MAX_WAITERS:
+                if (!parse_uint("max-waiters", optarg, 0, 1 << 20, &value)) {
+                    return -1;
+                }
+                config.max_waiters = (unsigned int)value;
+                break;
+            case OPT_ASK_COOKIES:
+                config.ask_cookies = true;
+                break;
+            case OPT_ALT_PORT:
+                if (!parse_uint("alt-port", optarg, 1, 65535, &value)) {
+                    return -1;
+                }
+                config.alt_port = (int)value;
+                break;
+            case OPT_ALT_IP: {
+                struct in_addr addr;
+                if (inet_pton(AF_INET, optarg, &addr) != 1) {
+                    fprintf(stderr,
+                            "Invalid IPv4 address \"%s\" for --alt-ip\n",
+                            optarg);
+                    return -1;
+                }
+                config.alt_ip = optarg;
+                break;
+            }
+            case OPT_XDP:
+                config.xdp = optarg;
+                break;
+            case OPT_XDP_QUEUES:
+                if (!parse_uint("xdp-queues", optarg, 1, 256, &value)) {
+                    return -1;
+                }
+                config.xdp_queues = (int)value;
+                break;
+            case OPT_XDP_GENERIC:
+                config.xdp_generic = true;
+                break;
+            case OPT_METRICS_FILE:
+                config.metrics_file = optarg;
+                break;
+            case OPT_METRICS_INTERVAL:
+                if (!parse_uint("metrics-interval", optarg, 1, 3600, &value)) {
+                    return -1;
+                }
+                config.metrics_interval = (int)value;
+                break;
+            case OPT_HUGEPAGES:
+                config.hugepages = true;
+                break;
+            case OPT_SHARD_REGISTRY:
+                config.shard_registry = true;
+                break;
+            case OPT_TCP_BACKLOG:
+                if (!parse_uint("tcp-backlog", optarg, 1, 65535, &value)) {
+                    return -1;
+                }
+                config.tcp_backlog = (int)value;
+                break;
+            case OPT_TCP_FASTOPEN:
+                if (!parse_uint("tcp-fastopen", optarg, 0, 65535, &value)) {
+                    return -1;
+                }
+                config.tcp_fastopen = (int)value;
+                break;
+            case OPT_TCP_MAX_CONNECTIONS:
+                if (!parse_uint("tcp-max-connections", optarg, 1, 1 << 20,
+                                &value)) {
+                    return -1;
+                }
+                config.tcp_max_connections = (unsigned int)value;
+                break;
+            case OPT_TCP_MAX_PER_IP:
+                if (!parse_uint("tcp-max-per-ip", optarg, 1, 1 << 20,
+                                &value)) {
+                    return -1;
+                }
+                config.tcp_max_per_ip = (unsigned int)value;
+                break;
+            case OPT_HELP:
+                print_usage(argv[0]);
+                exit(0);
+            default:
+                print_usage(argv[0]);
+                return -1;
+        }
+    }
+    if (config.cpus && config.irq_affinity) {
+        fprintf(stderr, "--cpus and --irq-affinity are mutually exclusive\n");
+        return -1;
+    }
+    if (config.incoming_cpu && !config.cpus && !config.irq_affinity) {
+        fprintf(stderr, "--incoming-cpu needs --cpus or --irq-affinity\n");
+        return -1;
+    }
+    if (config.busy_poll_budget && !config.busy_poll) {
+        fprintf(stderr, "--busy-poll-budget needs --busy-poll\n");
+        return -1;
+    }
+    if (config.alt_port == config.port) {
+        fprintf(stderr, "--alt-port must differ from --port\n");
+        return -1;
+    }
+    if (config.alt_ip && !config.alt_port) {
+        fprintf(stderr, "--alt-ip needs --alt-port\n");
+        return -1;
+    }
+    if (config.xdp_generic && !config.xdp) {
+        fprintf(stderr, "--xdp-generic needs --xdp\n");
+        return -1;
+    }
+    if (config.shard_registry && config.busy_poll) {
+        fprintf(stderr, "--shard-registry and --busy-poll are mutually "
+                        "exclusive\n");
+        return -1;
+    }
+    if (optind < argc) {
+        fprintf(stderr, "Unexpected argument \"%s\"\n", argv[optind]);
+        print_usage(argv[0]);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,107 @@
+#ifndef STUN_SERVER_CONFIG_H
+#define STUN_SERVER_CONFIG_H
+/**
+ * Copyright Fractal Computers, Inc. 2021
+ * @file config.h
+ * @brief Startup options of the STUN server
+============================
+Usage
+============================
+
+Call parse_config() once from main() with the command line, then read the
+options from the global `config`. Every option has a default that matches the
+behavior of a plain `./stun`, so the server can still be started without any
+arguments.
+*/
+
+/*
+============================
+Custom Types
+============================
+*/
+
+typedef struct {
+    // UDP and TCP port to listen on
+    int port;
+    // Name of the POSIX shared memory object holding the registry, or NULL to
+    // keep the registry private to this process
+    const char* shm_registry;
+    // Number of registrations the registry can hold
+    unsigned int registry_capacity;
+    // Megabytes the registry may use, overriding registry_capacity, or 0
+    unsigned int registry_memory;
+    // Registrations an IP may add once the registry is filling up, before
+    // counting how often they are looked up
+    unsigned int ip_quota;
+    // Number of UDP worker threads, each with its own SO_REUSEPORT socket
+    int workers;
+    // CPUs to pin the workers to, in worker order, or NULL to let them float
+    const char* cpus;
+    // Network interface whose queue interrupts decide which CPUs the workers
+    // are pinned to, or NULL
+    const char* irq_affinity;
+    // Set SO_INCOMING_CPU on every worker's socket, so that the kernel hands
+    // each worker the packets received on its CPU
+    bool incoming_cpu;
+    // Allocate every worker's buffers from the NUMA node of its CPU
+    bool numa_local;
+    // SO_BUSY_POLL of the workers' sockets in microseconds, 0 to have the
+    // workers sleep in recvmmsg(2) rather than busy-poll
+    int busy_poll;
+    // SO_BUSY_POLL_BUDGET of the workers' sockets, 0 for the kernel's default
+    int busy_poll_budget;
+    // Most ASK_INFOs waiting for their server at once, 0 to never wait
+    unsigned int max_waiters;
+    // Only look up the UDP ASK_INFOs that echo a cookie
+    bool ask_cookies;
+    // Secondary UDP port answering NAT behavior discovery probes, or 0
+    int alt_port;
+    // Secondary IP of the host answering NAT behavior discovery probes, on
+    // both ports, or NULL
+    const char* alt_ip;
+    // Network interface whose UDP requests are served over AF_XDP, or
+    // NULL
+    const char* xdp;
+    // Number of queues of the interface served over AF_XDP, from queue 0
+    int xdp_queues;
+    // Attach the XDP program in generic (skb) mode only
+    bool xdp_generic;
+    // File the metrics are written to, or NULL
+    const char* metrics_file;
+    // Seconds between two writes of the metrics file
+    int metrics_interval;
+    // Back the slab pools with huge pages
+    bool hugepages;
+    // Give every worker a shard of the registry of its own, and forward it
+    // the requests other workers receive for its IPs
+    bool shard_registry;
+    // Length of the queue of TCP connections waiting to be accepted
+    int tcp_backlog;
+    // Most TCP Fast Open connections pending at once, 0 to disable it
+    int tcp_fastopen;
+    // Most TCP connections open at once, past which new ones are reset
+    unsigned int tcp_max_connections;
+    // Most TCP connections open at once from a single IP
+    unsigned int tcp_max_per_ip;
+} stun_config_t;
+
+/*
+============================
+Public Functions
+============================
+*/
+
+extern stun_config_t config;
+
+/**
+ * @brief                          Fill `config` from the command line
+ *
+ * @param argc                     argc as given to main()
+ * @param argv                     argv as given to main()
+ *
+ * @returns                        0 on success, -1 if the command line is
+ *                                 invalid (usage has then been printed)
+ */
+int parse_config(int argc, char* argv[]);
+
+#endif  // STUN_SERVER_CONFIG_H
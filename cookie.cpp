@@ -0,0 +1,116 @@
+/**
+ * Copyright Fractal Computers, Inc. 2021
+ * @file cookie.cpp
+ * @brief Stateless cookies proving that a UDP client owns its source address
+ */
+
+#include "cookie.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/random.h>
+
+#include <atomic>
+
+#include "log.h"
+#include "metrics.h"
+
+using namespace std;
+
+static uint64_t key[2];
+
+// Updated from every worker
+static atomic<uint64_t> issued;
+static atomic<uint64_t> accepted;
+static atomic<uint64_t> rejected;
+static atomic<uint64_t> v1_dropped;
+
+static inline uint64_t rotl(uint64_t x, int b) {
+    return (x << b) | (x >> (64 - b));
+}
+
+#define SIPROUND            \
+    do {                    \
+        v0 += v1;           \
+        v1 = rotl(v1, 13);  \
+        v1 ^= v0;           \
+        v0 = rotl(v0, 32);  \
+        v2 += v3;           \
+        v3 = rotl(v3, 16);  \
+        v3 ^= v2;           \
+        v0 += v3;           \
+        v3 = rotl(v3, 21);  \
+        v3 ^= v0;           \
+        v2 += v1;           \
+        v1 = rotl(v1, 17);  \
+        v1 ^= v2;           \
+        v2 = rotl(v2, 32);  \
+    } while (0)
+
+// SipHash-2-4 of a message of two 64-bit words, which is all a cookie covers
+static uint64_t siphash(uint64_t m0, uint64_t m1) {
+    uint64_t v0 = key[0] ^ 0x736f6d6570736575ULL;
+    uint64_t v1 = key[1] ^ 0x646f72616e646f6dULL;
+    uint64_t v2 = key[0] ^ 0x6c7967656e657261ULL;
+    uint64_t v3 = key[1] ^ 0x7465646279746573ULL;
+    uint64_t words[] = {m0, m1, (uint64_t)16 << 56};
+    for (uint64_t m : words) {
+        v3 ^= m;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m;
+    }
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static uint32_t cookie_of(const struct sockaddr_in* client, uint64_t epoch) {
+    uint64_t address =
+        (uint64_t)client->sin_addr.s_addr << 16 | client->sin_port;
+    return (uint32_t)siphash(address, epoch);
+}
+
+static void write_cookie_metrics(FILE* f) {
+    metrics_write_counter(f, "stun_cookies_issued_total",
+                          "Cookies sent to ASK_INFOs without a valid one",
+                          issued.load(memory_order_relaxed));
+    metrics_write_counter(f, "stun_cookies_accepted_total",
+                          "Datagrams whose cookie was valid",
+                          accepted.load(memory_order_relaxed));
+    metrics_write_counter(f, "stun_cookies_rejected_total",
+                          "Datagrams whose cookie was stale or forged",
+                          rejected.load(memory_order_relaxed));
+    metrics_write_counter(f, "stun_cookies_v1_dropped_total",
+                          "Version 1 UDP ASK_INFOs dropped as they can't "
+                          "carry a cookie",
+                          v1_dropped.load(memory_order_relaxed));
+}
+
+int cookie_init() {
+    if (getrandom(key, sizeof(key), 0) != sizeof(key)) {
+        log("Failed to draw the cookie key: %s\n", strerror(errno));
+        return -1;
+    }
+    metrics_register(write_cookie_metrics);
+    return 0;
+}
+
+uint32_t cookie_make(const struct sockaddr_in* client, double now) {
+    issued.fetch_add(1, memory_order_relaxed);
+    return cookie_of(client, (uint64_t)now / COOKIE_EPOCH_SECONDS);
+}
+
+bool cookie_check(uint32_t cookie, const struct sockaddr_in* client,
+                  double now) {
+    uint64_t epoch = (uint64_t)now / COOKIE_EPOCH_SECONDS;
+    bool valid = cookie == cookie_of(client, epoch) ||
+                 cookie == cookie_of(client, epoch - 1);
+    (valid ? accepted : rejected).fetch_add(1, memory_order_relaxed);
+    return valid;
+}
+
+void cookie_count_v1_drop() { v1_dropped.fetch_add(1, memory_order_relaxed); }
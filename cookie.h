@@ -0,0 +1,80 @@
+#ifndef STUN_SERVER_COOKIE_H
+#define STUN_SERVER_COOKIE_H
+/**
+ * Copyright Fractal Computers, Inc. 2021
+ * @file cookie.h
+ * @brief Stateless cookies proving that a UDP client owns its source address
+============================
+Usage
+============================
+
+Call cookie_init() once at startup. cookie_make() then returns the cookie of
+a source address for the current epoch, and cookie_check() accepts it for
+that epoch and the next one, so that a cookie lives between
+COOKIE_EPOCH_SECONDS and twice that.
+
+A cookie is a SipHash-2-4 MAC of the source IP, port and epoch under a key
+drawn at startup, so nothing is stored per client: a spoofed source never
+sees its cookie, and can't get its ASK_INFOs past cookie_check().
+*/
+
+/*
+============================
+Includes
+============================
+*/
+
+#include <netinet/in.h>
+#include <stdint.h>
+
+/*
+============================
+Defines
+============================
+*/
+
+#define COOKIE_EPOCH_SECONDS 30
+
+/*
+============================
+Public Functions
+============================
+*/
+
+/**
+ * @brief                          Draw the key of the cookies
+ *
+ * @returns                        0 on success, -1 on failure
+ */
+int cookie_init();
+
+/**
+ * @brief                          Compute the cookie of a source address
+ *
+ * @param client                   The source address
+ * @param now                      The current time()
+ *
+ * @returns                        The cookie
+ */
+uint32_t cookie_make(const struct sockaddr_in* client, double now);
+
+/**
+ * @brief                          Check the cookie echoed by a source address
+ *
+ * @param cookie                   The cookie
+ * @param client                   The source address
+ * @param now                      The current time()
+ *
+ * @returns                        True if it is the cookie of client for this
+ *                                 epoch or the previous one
+ */
+bool cookie_check(uint32_t cookie, const struct sockaddr_in* client,
+                  double now);
+
+/**
+ * @brief                          Count a version 1 UDP ASK_INFO dropped as it
+ *                                 has no room for a cookie
+ */
+void cookie_count_v1_drop();
+
+#endif  // STUN_SERVER_COOKIE_H
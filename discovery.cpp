@@ -0,0 +1,154 @@
+/**
+ * Copyright Fractal Computers, Inc. 2021
+ * @file discovery.cpp
+ * @brief NAT behavior discovery (RFC 5780) from a secondary port and IP
+ */
+
+#include "discovery.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "filter.h"
+#include "handler.h"
+#include "log.h"
+
+// Indexed by [secondary IP][secondary port], -1 where there is no socket
+static int sockets[2][2] = {{-1, -1}, {-1, -1}};
+static uint32_t alt_ip;
+static uint16_t alt_port;
+
+// Opens a UDP socket bound to ip:port, both in network byte order
+static int open_socket(uint32_t ip, uint16_t port) {
+    int s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (s < 0) {
+        log("Could not create UDP socket.\n");
+        return -1;
+    }
+
+    // The secondary IP's sockets overlap with the INADDR_ANY ones on the
+    // same ports
+    int opt = 1;
+    if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+        log("Failed to set reuseaddr socket: %s\n", strerror(errno));
+        close(s);
+        return -1;
+    }
+    if (attach_request_filter(s) < 0) {
+        close(s);
+        return -1;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = ip;
+    addr.sin_port = port;
+    if (bind(s, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        log("Failed to bind socket to %s:%d: %s\n", inet_ntoa(addr.sin_addr),
+            ntohs(port), strerror(errno));
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
+// Answers the requests arriving on a secondary socket. They are few, one
+// thread per socket without batching is plenty
+static void* serve(void* vargp) {
+    int s = (int)(intptr_t)vargp;
+    uint8_t request[STUN_MAX_DATAGRAM];
+    uint8_t response[STUN_MAX_DATAGRAM];
+    while (true) {
+        struct sockaddr_in client;
+        socklen_t slen = sizeof(client);
+        int size = recvfrom(s, request, sizeof(request), 0,
+                            (struct sockaddr*)&client, &slen);
+        if (size < 0) {
+            if (errno != EINTR) {
+                log("Failed to recvfrom(2) on a discovery socket: %s\n",
+                    strerror(errno));
+            }
+            continue;
+        }
+        int response_size = handle_datagram(request, size, &client, s, 0,
+                                            response);
+        if (response_size > 0) {
+            sendto(s, response, response_size, MSG_NOSIGNAL,
+                   (struct sockaddr*)&client, sizeof(client));
+        }
+    }
+    return NULL;
+}
+
+int discovery_start(int primary_socket) {
+    sockets[0][0] = primary_socket;
+    if (!config.alt_port) {
+        return 0;
+    }
+    alt_port = htons(config.alt_port);
+    uint16_t port = htons(config.port);
+    sockets[0][1] = open_socket(htonl(INADDR_ANY), alt_port);
+    if (sockets[0][1] < 0) {
+        return -1;
+    }
+    if (config.alt_ip) {
+        inet_pton(AF_INET, config.alt_ip, &alt_ip);
+        sockets[1][0] = open_socket(alt_ip, port);
+        sockets[1][1] = open_socket(alt_ip, alt_port);
+        if (sockets[1][0] < 0 || sockets[1][1] < 0) {
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < 2; i++) {
+        for (int j = i == 0 ? 1 : 0; j < 2; j++) {
+            pthread_t thread_id;
+            if (sockets[i][j] >= 0 &&
+                pthread_create(&thread_id, NULL, serve,
+                               (void*)(intptr_t)sockets[i][j]) != 0) {
+                log("Failed to start a discovery thread\n");
+                return -1;
+            }
+        }
+    }
+    log("Answering NAT behavior discovery probes on port %d%s%s\n",
+        config.alt_port, config.alt_ip ? " and IP " : "",
+        config.alt_ip ? config.alt_ip : "");
+    return 0;
+}
+
+void discovery_other_address(uint32_t* ip, uint16_t* port) {
+    *ip = alt_ip;
+    *port = alt_port;
+}
+
+bool discovery_send_changed(int s, uint8_t changes, const void* response,
+                            int size, const struct sockaddr_in* client) {
+    // Anything but a secondary socket is a worker's, on the primary IP and
+    // port
+    int ip_index = 0, port_index = 0;
+    for (int i = 0; i < 2; i++) {
+        for (int j = 0; j < 2; j++) {
+            if (sockets[i][j] == s && s >= 0) {
+                ip_index = i;
+                port_index = j;
+            }
+        }
+    }
+    ip_index ^= (changes & STUN_V2_PROBE_CHANGE_IP) ? 1 : 0;
+    port_index ^= (changes & STUN_V2_PROBE_CHANGE_PORT) ? 1 : 0;
+
+    int changed = sockets[ip_index][port_index];
+    if (changed < 0) {
+        return false;
+    }
+    sendto(changed, response, size, MSG_NOSIGNAL,
+           (const struct sockaddr*)client, sizeof(*client));
+    return true;
+}
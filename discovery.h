@@ -0,0 +1,77 @@
+#ifndef STUN_SERVER_DISCOVERY_H
+#define STUN_SERVER_DISCOVERY_H
+/**
+ * Copyright Fractal Computers, Inc. 2021
+ * @file discovery.h
+ * @brief NAT behavior discovery (RFC 5780) from a secondary port and IP
+============================
+Usage
+============================
+
+Call discovery_start() once the UDP workers' sockets are bound. With
+--alt-port, it listens on the secondary port, and with --alt-ip on both ports
+of the secondary IP too, answering every request arriving there like the
+workers do.
+
+A client then learns in one round trip of STUN_V2_PROBE records how its NAT
+maps and filters: a probe answered from another port or IP only gets through
+a NAT that doesn't filter by port or address, and probes sent to the
+secondary address tell whether the mapping depends on the destination.
+
+The primary IP is whichever the host routes replies from, the worker sockets
+being bound to INADDR_ANY.
+*/
+
+/*
+============================
+Includes
+============================
+*/
+
+#include <netinet/in.h>
+#include <stdint.h>
+
+#include "stun.h"
+
+/*
+============================
+Public Functions
+============================
+*/
+
+/**
+ * @brief                          Open the sockets of the secondary port and
+ *                                 IP configured, and start serving them
+ *
+ * @param primary_socket           A UDP worker's socket, used to answer from
+ *                                 the primary port and IP
+ *
+ * @returns                        0 on success, -1 on failure
+ */
+int discovery_start(int primary_socket);
+
+/**
+ * @brief                          Fill in the OTHER-ADDRESS of a probe's
+ *                                 response
+ *
+ * @param ip                       Set to the secondary IP, 0 if none
+ * @param port                     Set to the secondary port, 0 if none
+ */
+void discovery_other_address(uint32_t* ip, uint16_t* port);
+
+/**
+ * @brief                          Send a response from another port and/or
+ *                                 IP than the request was received on
+ *
+ * @param s                        Socket the request was received on
+ * @param changes                  STUN_V2_PROBE_CHANGE_* flags
+ * @param response                 The response
+ * @param size                     Size of the response
+ * @param client                   Where to send it
+ *
+ * @returns                        False if there is no such port or IP
+ */
+bool discovery_send_changed(int s, uint8_t changes, const void* response,
+                            int size, const struct sockaddr_in* client);
+
+#endif  // STUN_SERVER_DISCOVERY_H
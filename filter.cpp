@@ -0,0 +1,135 @@
+/**
+ * Copyright Fractal Computers, Inc. 2021
+ * @file filter.cpp
+ * @brief Classic BPF programs attached to the UDP sockets
+ */
+
+#include "filter.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/filter.h>
+#include <linux/sock_diag.h>
+#include <linux/udp.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "log.h"
+#include "stun.h"
+
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+
+// The source IP is mixed with xorshift-multiply-xorshift, so that IPs which
+// only differ in their last octet still spread over every worker
+#define STEERING_MULTIPLIER 0x45d9f3bu
+
+unsigned int steering_worker(unsigned int ip, unsigned int workers) {
+    // Classic BPF loads words in host order from network order, and its
+    // arithmetic is on 32-bit unsigned integers
+    uint32_t hash = ntohl(ip);
+    hash ^= hash >> 16;
+    hash *= STEERING_MULTIPLIER;
+    hash ^= hash >> 16;
+    return hash % workers;
+}
+
+int attach_ip_steering(int s, unsigned int workers) {
+    // The program sees the datagram past its UDP header, the IP header is
+    // reached through SKF_NET_OFF. It returns the index of the socket
+    struct sock_filter code[] = {
+        // A = source IP
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t)SKF_NET_OFF + 12),
+        // A ^= A >> 16
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),
+        BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+        BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, STEERING_MULTIPLIER),
+        // A ^= A >> 16
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),
+        BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, workers),
+        BPF_STMT(BPF_RET | BPF_A, 0),
+    };
+    struct sock_fprog prog;
+    prog.len = sizeof(code) / sizeof(code[0]);
+    prog.filter = code;
+    if (setsockopt(s, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+                   sizeof(prog)) < 0) {
+        log("Failed to attach the reuseport steering program: %s\n",
+            strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Jump offsets are relative to the next instruction
+#define FILTER_JUMP(from, to) ((to) - (from)-1)
+
+int attach_request_filter(int s) {
+    // Socket filters see the datagram from its UDP header on, so the length
+    // and offsets include it. Loads are in network order, hence htonl() to
+    // match the version 1 type as the client wrote it in host order
+    const uint32_t udp = sizeof(struct udphdr);
+    const uint32_t v2_record = sizeof(stun_v2_record_t);
+    enum { V2 = 5, ACCEPT = 17, DROP = 18 };
+    struct sock_filter code[] = {
+        // 0: version 1 requests have a fixed size
+        BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, udp + sizeof(stun_request_t), 0,
+                 FILTER_JUMP(1, V2)),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                 udp + offsetof(stun_request_t, type)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htonl(ASK_INFO),
+                 FILTER_JUMP(3, ACCEPT), 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htonl(POST_INFO),
+                 FILTER_JUMP(4, ACCEPT), FILTER_JUMP(4, DROP)),
+        // 5: version 2 requests need the magic, the version, and a size that
+        // matches their number of records
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS,
+                 udp + offsetof(stun_v2_header_t, magic)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, STUN_V2_MAGIC, 0,
+                 FILTER_JUMP(6, DROP)),
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS,
+                 udp + offsetof(stun_v2_header_t, version)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, STUN_V2_VERSION, 0,
+                 FILTER_JUMP(8, DROP)),
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS,
+                 udp + offsetof(stun_v2_header_t, num_records)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, FILTER_JUMP(10, DROP), 0),
+        BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, STUN_V2_MAX_RECORDS,
+                 FILTER_JUMP(11, DROP), 0),
+        // X = expected length
+        BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, v2_record),
+        BPF_STMT(BPF_ALU | BPF_ADD | BPF_K, udp + sizeof(stun_v2_header_t)),
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_X, 0, FILTER_JUMP(16, ACCEPT),
+                 FILTER_JUMP(16, DROP)),
+        // 17: accept the whole datagram
+        BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+        // 18
+        BPF_STMT(BPF_RET | BPF_K, 0),
+    };
+    struct sock_fprog prog;
+    prog.len = sizeof(code) / sizeof(code[0]);
+    prog.filter = code;
+    if (setsockopt(s, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+        log("Failed to attach the request filter: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+uint64_t socket_drops(int s) {
+    uint32_t meminfo[SK_MEMINFO_VARS];
+    socklen_t optlen = sizeof(meminfo);
+    if (getsockopt(s, SOL_SOCKET, SO_MEMINFO, meminfo, &optlen) < 0 ||
+        optlen <= SK_MEMINFO_DROPS * sizeof(uint32_t)) {
+        return 0;
+    }
+    return meminfo[SK_MEMINFO_DROPS];
+}
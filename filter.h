@@ -0,0 +1,84 @@
+#ifndef STUN_SERVER_FILTER_H
+#define STUN_SERVER_FILTER_H
+/**
+ * Copyright Fractal Computers, Inc. 2021
+ * @file filter.h
+ * @brief Classic BPF programs attached to the UDP sockets
+============================
+Usage
+============================
+
+Once every worker's socket is bound, call attach_ip_steering() on any of them
+so that the kernel hands each datagram to the worker steering_worker() picks
+for its source IP, rather than hashing its whole 4-tuple. Classic BPF needs
+neither privileges nor an eBPF toolchain.
+
+Every worker's socket also gets attach_request_filter(), which drops anything
+that is not a well-formed request in the kernel, before it costs a wakeup, a
+copy or a log line. socket_drops() reads how many datagrams a socket dropped.
+*/
+
+/*
+============================
+Includes
+============================
+*/
+
+#include <stdint.h>
+
+/*
+============================
+Public Functions
+============================
+*/
+
+/**
+ * @brief                          The worker the kernel hands the datagrams
+ *                                 of an IP to once attach_ip_steering() is
+ *                                 called
+ *
+ * @param ip                       The source IP, in network byte order
+ * @param workers                  Number of workers
+ *
+ * @returns                        The worker's index, i.e. the order its
+ *                                 socket was bound in
+ */
+unsigned int steering_worker(unsigned int ip, unsigned int workers);
+
+/**
+ * @brief                          Steer the datagrams of a SO_REUSEPORT group
+ *                                 by source IP, so that all of a host's
+ *                                 requests reach the same worker
+ *
+ * @param s                        Any socket of the group, once all of them
+ *                                 are bound
+ * @param workers                  Number of sockets in the group
+ *
+ * @returns                        0 on success, -1 on failure
+ */
+int attach_ip_steering(int s, unsigned int workers);
+
+/**
+ * @brief                          Drop datagrams that are neither a
+ *                                 stun_request_t with a valid type nor a
+ *                                 well-formed version 2 request before they
+ *                                 are queued on a socket
+ *
+ * @param s                        A worker's UDP socket
+ *
+ * @returns                        0 on success, -1 on failure
+ */
+int attach_request_filter(int s);
+
+/**
+ * @brief                          Number of datagrams a socket dropped,
+ *                                 either rejected by its filter or because
+ *                                 its receive buffer was full
+ *
+ * @param s                        The socket
+ *
+ * @returns                        The number of drops, 0 if unknown
+ */
+uint64_t socket_drops(int s);
+
+#endif  // STUN_SERVER_FILTER_H
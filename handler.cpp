@@ -0,0 +1,623 @@
+/**
+ * Copyright Fractal Computers, Inc. 2021
+ * @file handler.cpp
+ * @brief Handling of ASK_INFO and POST_INFO requests, whichever way they
+ *        arrived
+ */
+
+#include "handler.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "clock.h"
+#include "config.h"
+#include "cookie.h"
+#include "discovery.h"
+#include "log.h"
+#include "notify.h"
+#include "outbound.h"
+#include "predict.h"
+#include "registry.h"
+#include "waiters.h"
+
+// Estimates the one-way delay to the peer of a TCP socket, as half its
+// smoothed RTT
+static uint32_t tcp_one_way_us(int s) {
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if (getsockopt(s, IPPROTO_TCP, TCP_INFO, &info, &len) < 0) {
+        return 0;
+    }
+    return info.tcpi_rtt / 2;
+}
+
+// Tells the server parked on server_socket about the client, then has both
+// of them connect at about the same time. Returns the delay the client must
+// wait before connecting, if it asked over TCP, or 0 for the server to go as
+// soon as it can
+static uint32_t start_tcp_hole_punch(int server_socket,
+                                     const stun_entry_t* entry,
+                                     int client_socket) {
+    // Both ends connect STUN_TCP_GO_MARGIN_US after the farthest one gets
+    // its go signal
+    uint32_t server_delay = tcp_one_way_us(server_socket);
+    uint32_t client_delay =
+        client_socket > 0 ? tcp_one_way_us(client_socket) : 0;
+    uint32_t farthest =
+        server_delay > client_delay ? server_delay : client_delay;
+    server_delay = farthest - server_delay + STUN_TCP_GO_MARGIN_US;
+    client_delay = farthest - client_delay + STUN_TCP_GO_MARGIN_US;
+
+    stun_tcp_go_t go;
+    go.magic = htonl(STUN_TCP_GO_MAGIC);
+    go.delay_us = htonl(server_delay);
+    uint8_t notification[sizeof(*entry) + sizeof(go)];
+    memcpy(notification, entry, sizeof(*entry));
+    memcpy(notification + sizeof(*entry), &go, sizeof(go));
+    outbound_send(server_socket, notification, sizeof(notification));
+    return client_delay;
+}
+
+// Looks up the server registered for ip:public_port, and tells it the IP:Port
+// of the client. Returns the server's private port, or 0 if there is none.
+// A server that registered with version 2 over TCP also gets a
+// stun_tcp_go_t, and go_delay_us, for version 2 clients on TCP, is set to the
+// delay the client waits. Requests call it once
+// registry_may_contain() let them through, so that most ASK_INFOs for servers
+// that never registered are answered before any logging
+static unsigned short ask(unsigned int ip, unsigned short public_port,
+                          const struct sockaddr_in* client, int s,
+                          int tcp_connection_socket, uint32_t* go_delay_us) {
+    struct in_addr requested_addr;
+    requested_addr.s_addr = ip;
+    char original[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &client->sin_addr, original, sizeof(original));
+
+    log("%s:%d Wants to connect to public %s:%d.\n", original,
+        ntohs(client->sin_port), inet_ntoa(requested_addr),
+        ntohs(public_port));
+
+    unsigned short private_port = 0;
+    int server_socket = s;
+
+    // Check for a stun entry related to this IP:Port
+    registry_entry_t map_entry;
+    bool found = registry_lookup(ip, public_port, time(), &map_entry);
+    if (found && map_entry.tcp_socket > 0) {
+        // A server parked on TCP is handed to a single client, which holds
+        // its socket open until the server is notified
+        server_socket = map_entry.tcp_socket = registry_take(ip, public_port);
+        found = server_socket > 0;
+    }
+    if (found) {
+        // We found the correct private port!
+        private_port = map_entry.entry.private_port;
+        log("Found port %d to public %d!\n\n", ntohs(private_port),
+            ntohs(public_port));
+    }
+
+    if (private_port == 0) {
+        if (found && map_entry.tcp_socket > 0) {
+            outbound_release(server_socket);
+        }
+        // Missing private port is 0, notifying the client that no such
+        // private port was found
+        log("Could not find private_port entry associated with %s:%d!\n\n",
+            inet_ntoa(requested_addr), ntohs(public_port));
+        return 0;
+    }
+
+    struct sockaddr_in si_server;
+    si_server.sin_family = AF_INET;
+    si_server.sin_addr.s_addr = ip;
+    si_server.sin_port = private_port;
+
+    if (map_entry.tcp_socket <= 0 && (map_entry.flags & REGISTRY_RELIABLE)) {
+        stun_v2_record_t notification;
+        memset(&notification, 0, sizeof(notification));
+        notification.type = STUN_V2_NOTIFY;
+        notification.ip = client->sin_addr.s_addr;
+        notification.public_port = public_port;
+        notification.private_port = client->sin_port;
+        notify_server(s, &si_server, &notification);
+        return private_port;
+    }
+
+    stun_entry_t entry;
+    // Tell the server what IP:Port the client has
+    entry.ip = client->sin_addr.s_addr;
+    entry.private_port = client->sin_port;
+
+    if (map_entry.tcp_socket > 0 && (map_entry.flags & REGISTRY_TCP_GO)) {
+        uint32_t client_delay_us = start_tcp_hole_punch(
+            server_socket, &entry, go_delay_us ? tcp_connection_socket : 0);
+        if (go_delay_us && tcp_connection_socket > 0) {
+            *go_delay_us = client_delay_us;
+        }
+        outbound_release(server_socket);
+        return private_port;
+    }
+
+    // Notify the server about the STUN connection, without ever waiting for
+    // a server parked on TCP to read it
+    if (map_entry.tcp_socket > 0) {
+        outbound_send(server_socket, &entry, sizeof(entry));
+        outbound_release(server_socket);
+    } else {
+        sendto(server_socket, &entry, sizeof(entry), MSG_NOSIGNAL,
+               (struct sockaddr*)&si_server, sizeof(si_server));
+    }
+    return private_port;
+}
+
+// Registers public_port for the client's IP, with private_port as its private
+// port, or the client's source port if private_port is 0
+static registry_post_result_t post(unsigned short public_port,
+                                   unsigned short private_port,
+                                   const struct sockaddr_in* client,
+                                   int tcp_connection_socket, uint32_t flags) {
+    stun_entry_t entry;
+    entry.ip = client->sin_addr.s_addr;
+    entry.private_port = private_port ? private_port : client->sin_port;
+    entry.public_port = public_port;
+    registry_post_result_t result =
+        registry_post(&entry, tcp_connection_socket, flags, time());
+    if (result != REGISTRY_FULL) {
+        waiters_wake(entry.ip, public_port);
+    }
+    return result;
+}
+
+static void log_post(registry_post_result_t result,
+                     const struct sockaddr_in* client, const char* type) {
+    // If the entry would've been expired, we log it as a new POST_INFO packet
+    // rather than silently refresh the port info
+    if (result == REGISTRY_NEW) {
+        log("Received %s POST_INFO packet from %s:%d.\n\n", type,
+            inet_ntoa(client->sin_addr), ntohs(client->sin_port));
+    } else if (result == REGISTRY_FULL) {
+        log("Registry is full, dropping %s POST_INFO packet from %s:%d.\n\n",
+            type, inet_ntoa(client->sin_addr), ntohs(client->sin_port));
+    }
+}
+
+static int handle_v1(const stun_request_t* request,
+                     const struct sockaddr_in* client, int s,
+                     int tcp_connection_socket, const char* type,
+                     uint8_t* response) {
+    if (request->type == ASK_INFO) {
+        // Version 1 has no room for a cookie, UDP clients must use version 2.
+        // Counted rather than logged, as spoofed floods are what it stops
+        if (config.ask_cookies && tcp_connection_socket <= 0) {
+            cookie_count_v1_drop();
+            return 0;
+        }
+
+        // Return request with private port to client
+        stun_entry_t entry = request->entry;
+        entry.private_port = 0;
+        memcpy(response, &entry, sizeof(entry));
+        if (!registry_may_contain(entry.ip, entry.public_port)) {
+            return sizeof(entry);
+        }
+        log("Received %s REQUEST packet from %s:%d.\n", type,
+            inet_ntoa(client->sin_addr), ntohs(client->sin_port));
+        // Version 1 responses never carry a go signal, keeping their size
+        entry.private_port = ask(entry.ip, entry.public_port, client, s,
+                                 tcp_connection_socket, NULL);
+        memcpy(response, &entry, sizeof(entry));
+        log("Responding to STUN request\n");
+        return sizeof(entry);
+    } else if (request->type == POST_INFO) {
+        log_post(post(request->entry.public_port, 0, client,
+                      tcp_connection_socket, 0),
+                 client, type);
+    }
+    return 0;
+}
+
+// Handles a STUN_V2_POST record, which may register a whole range or bitmap
+// of ports
+static stun_v2_status_t handle_v2_post(stun_v2_record_t* record,
+                                       const struct sockaddr_in* client,
+                                       int tcp_connection_socket,
+                                       const char* type) {
+    // Ports public_port + i are registered for every i < count, or only for
+    // those whose bit is set in a bitmap
+    uint32_t count = 1;
+    uint32_t bitmap = 0xffffffff;
+    uint32_t arg = ntohl(record->arg);
+    uint8_t layout = record->flags & ~STUN_V2_POST_RELIABLE;
+    uint32_t flags =
+        record->flags & STUN_V2_POST_RELIABLE ? REGISTRY_RELIABLE : 0;
+    if (tcp_connection_socket > 0) {
+        flags |= REGISTRY_TCP_GO;
+    }
+    if (layout == STUN_V2_POST_RANGE) {
+        count = arg;
+        if (count == 0 || count > STUN_V2_MAX_RANGE) {
+            return STUN_V2_INVALID;
+        }
+    } else if (layout == STUN_V2_POST_BITMAP) {
+        if (arg == 0) {
+            return STUN_V2_INVALID;
+        }
+        count = 32 - __builtin_clz(arg);
+        bitmap = arg;
+    } else if (layout != 0) {
+        return STUN_V2_INVALID;
+    }
+    uint32_t public_port = ntohs(record->public_port);
+    uint32_t private_port = ntohs(record->private_port);
+    if (public_port + count - 1 > 0xffff ||
+        (private_port && private_port + count - 1 > 0xffff)) {
+        return STUN_V2_INVALID;
+    }
+
+    uint32_t registered = 0, created = 0;
+    registry_post_result_t result = REGISTRY_NEW;
+    bool full = false;
+    for (uint32_t i = 0; i < count; i++) {
+        if (!(bitmap & (1u << (i % 32)))) {
+            continue;
+        }
+        result = post(htons(public_port + i),
+                      private_port ? htons(private_port + i) : 0, client,
+                      tcp_connection_socket, flags);
+        full |= result == REGISTRY_FULL;
+        registered += result != REGISTRY_FULL;
+        created += result == REGISTRY_NEW;
+    }
+
+    if (layout == 0) {
+        log_post(result, client, type);
+    } else {
+        log("Received %s bulk POST_INFO packet from %s:%d registering %u "
+            "ports, %u new%s.\n\n",
+            type, inet_ntoa(client->sin_addr), ntohs(client->sin_port),
+            registered, created, full ? ", registry is full" : "");
+    }
+    record->ip = client->sin_addr.s_addr;
+    if (!private_port) {
+        record->private_port = client->sin_port;
+    }
+    record->arg = htonl(registered);
+    return full ? STUN_V2_FULL : STUN_V2_OK;
+}
+
+// Parks a STUN_V2_ASK_WAIT record that found nothing. Only UDP clients can
+// wait, as TCP connections are answered once and closed
+static bool wait_for_server(const stun_v2_record_t* record, uint32_t txid,
+                            const struct sockaddr_in* client, int s,
+                            int tcp_connection_socket) {
+    if (!(record->flags & STUN_V2_ASK_WAIT) || tcp_connection_socket > 0 ||
+        config.max_waiters == 0) {
+        return false;
+    }
+    uint32_t wait_ms = ntohl(record->arg);
+    if (wait_ms > STUN_V2_MAX_WAIT_MS) {
+        wait_ms = STUN_V2_MAX_WAIT_MS;
+    }
+
+    waiter_t waiter;
+    waiter.record = *record;
+    waiter.txid = txid;
+    waiter.client = *client;
+    waiter.s = s;
+    waiter.deadline_ns = monotonic_ns() + wait_ms * 1000000ULL;
+    if (!waiters_add(&waiter)) {
+        return false;
+    }
+    log("%s:%d waits %ums for public %s:%d.\n", inet_ntoa(client->sin_addr),
+        ntohs(client->sin_port), wait_ms,
+        inet_ntoa(*(const struct in_addr*)&record->ip),
+        ntohs(record->public_port));
+    return true;
+}
+
+// Answers a waiting ASK record in a datagram of its own
+static void answer_waiter(const waiter_t* waiter, bool timed_out) {
+    stun_v2_header_t header;
+    header.magic = htons(STUN_V2_MAGIC);
+    header.version = STUN_V2_VERSION;
+    header.num_records = 1;
+    header.txid = waiter->txid;
+
+    stun_v2_record_t record = waiter->record;
+    record.private_port = 0;
+    if (!timed_out) {
+        record.private_port = ask(record.ip, record.public_port,
+                                  &waiter->client, waiter->s, 0, NULL);
+    }
+    record.status = htons(record.private_port ? STUN_V2_OK : STUN_V2_NOT_FOUND);
+
+    uint8_t response[sizeof(header) + sizeof(record)];
+    memcpy(response, &header, sizeof(header));
+    memcpy(response + sizeof(header), &record, sizeof(record));
+    sendto(waiter->s, response, sizeof(response), MSG_NOSIGNAL,
+           (const struct sockaddr*)&waiter->client, sizeof(waiter->client));
+}
+
+// Handles one record of a version 2 request, filling in its result. An ASK is
+// only looked up if the filter let it through, see handle_v2()
+static stun_v2_status_t handle_v2_record(stun_v2_record_t* record,
+                                         uint32_t txid, bool verified,
+                                         bool filtered,
+                                         const struct sockaddr_in* client,
+                                         int s, int tcp_connection_socket,
+                                         const char* type) {
+    switch (record->type) {
+        case STUN_V2_ASK: {
+            if (!verified) {
+                record->arg = htonl(cookie_make(client, time()));
+                return STUN_V2_COOKIE_REQUIRED;
+            }
+            uint32_t go_delay_us = 0;
+            record->private_port =
+                filtered ? 0
+                         : ask(record->ip, record->public_port, client, s,
+                               tcp_connection_socket, &go_delay_us);
+            if (record->private_port) {
+                if (go_delay_us) {
+                    record->arg = htonl(go_delay_us);
+                }
+                return STUN_V2_OK;
+            }
+            if (wait_for_server(record, txid, client, s,
+                                tcp_connection_socket)) {
+                return STUN_V2_PENDING;
+            }
+            return STUN_V2_NOT_FOUND;
+        }
+        case STUN_V2_POST:
+            return handle_v2_post(record, client, tcp_connection_socket, type);
+        case STUN_V2_PREDICT: {
+            predict_result_t prediction;
+            if (!predict_ports(record->ip, time(), &prediction)) {
+                return STUN_V2_NOT_FOUND;
+            }
+            record->public_port = prediction.last_port;
+            record->arg = htonl((uint32_t)(uint16_t)prediction.stride << 16 |
+                                prediction.count);
+            return STUN_V2_OK;
+        }
+        case STUN_V2_PROBE: {
+            if (record->flags &
+                ~(STUN_V2_PROBE_CHANGE_PORT | STUN_V2_PROBE_CHANGE_IP)) {
+                return STUN_V2_INVALID;
+            }
+            uint32_t other_ip;
+            uint16_t other_port;
+            discovery_other_address(&other_ip, &other_port);
+            record->ip = client->sin_addr.s_addr;
+            record->public_port = client->sin_port;
+            record->private_port = other_port;
+            record->arg = other_ip;
+            return STUN_V2_OK;
+        }
+        case STUN_V2_ACK:
+            return notify_ack(record->arg, client) ? STUN_V2_OK
+                                                   : STUN_V2_NOT_FOUND;
+        case STUN_V2_COOKIE:
+            if (!verified) {
+                record->arg = htonl(cookie_make(client, time()));
+                return STUN_V2_COOKIE_REQUIRED;
+            }
+            return STUN_V2_OK;
+        default:
+            return STUN_V2_INVALID;
+    }
+}
+
+static int handle_v2(const uint8_t* data, int size,
+                     const struct sockaddr_in* client, int s,
+                     int tcp_connection_socket, const char* type,
+                     uint8_t* response) {
+    // Everything is at a fixed offset, so the whole datagram is validated at
+    // once before any record is looked at
+    stun_v2_header_t header;
+    memcpy(&header, data, sizeof(header));
+    size_t expected_size =
+        sizeof(header) + header.num_records * sizeof(stun_v2_record_t);
+    if ((header.magic != htons(STUN_V2_MAGIC)) |
+        (header.version != STUN_V2_VERSION) | (header.num_records == 0) |
+        (header.num_records > STUN_V2_MAX_RECORDS) |
+        ((size_t)size != expected_size)) {
+        log("Invalid version 2 %s packet of %d bytes from %s:%d\n", type, size,
+            inet_ntoa(client->sin_addr), ntohs(client->sin_port));
+        return 0;
+    }
+
+    // With --ask-cookies, the ASKs of a UDP datagram are only looked up if it
+    // echoes the cookie of its source address. Until then nothing is kept
+    // about the sender, and nothing is sent to anyone but it
+    bool verified = !config.ask_cookies || tcp_connection_socket > 0;
+    for (int i = 0; i < header.num_records && !verified; i++) {
+        size_t offset = sizeof(header) + i * sizeof(stun_v2_record_t);
+        stun_v2_record_t record;
+        memcpy(&record, data + offset, sizeof(record));
+        verified = record.type == STUN_V2_COOKIE &&
+                   cookie_check(ntohl(record.arg), client, time());
+    }
+
+    // The ASKs are run past the filter first, so that a datagram only asking
+    // for servers that never registered is answered without any logging
+    static_assert(STUN_V2_MAX_RECORDS <= 32, "filtered ASKs don't fit");
+    uint32_t filtered = 0;
+    bool quiet = verified;
+    for (int i = 0; i < header.num_records; i++) {
+        size_t offset = sizeof(header) + i * sizeof(stun_v2_record_t);
+        stun_v2_record_t record;
+        memcpy(&record, data + offset, sizeof(record));
+        bool ask_filtered =
+            verified && record.type == STUN_V2_ASK &&
+            !registry_may_contain(record.ip, record.public_port);
+        filtered |= (uint32_t)ask_filtered << i;
+        quiet &= ask_filtered && !(record.flags & STUN_V2_ASK_WAIT);
+    }
+    if (!quiet) {
+        log("Received %s version 2 packet with %d records from %s:%d.\n",
+            type, header.num_records, inet_ntoa(client->sin_addr),
+            ntohs(client->sin_port));
+    }
+
+    // The response is the request with every record's result filled in
+    memcpy(response, &header, sizeof(header));
+    bool only_acks = true;
+    for (int i = 0; i < header.num_records; i++) {
+        size_t offset = sizeof(header) + i * sizeof(stun_v2_record_t);
+        stun_v2_record_t record;
+        memcpy(&record, data + offset, sizeof(record));
+        only_acks &= record.type == STUN_V2_ACK;
+        record.status =
+            htons(handle_v2_record(&record, header.txid, verified,
+                                   filtered & (1u << i), client, s,
+                                   tcp_connection_socket, type));
+        // A probe asking for a change is answered from the other port or IP
+        // only, so it must be alone in a UDP datagram
+        if (record.type == STUN_V2_PROBE && record.flags &&
+            (header.num_records != 1 || tcp_connection_socket > 0)) {
+            record.status = htons(STUN_V2_INVALID);
+        }
+        memcpy(response + offset, &record, sizeof(record));
+    }
+    // ACKs are never acknowledged themselves
+    if (only_acks) {
+        return 0;
+    }
+
+    stun_v2_record_t first;
+    memcpy(&first, response + sizeof(header), sizeof(first));
+    if (first.type == STUN_V2_PROBE && first.flags &&
+        first.status == htons(STUN_V2_OK)) {
+        if (discovery_send_changed(s, first.flags, response, expected_size,
+                                   client)) {
+            return 0;
+        }
+        first.status = htons(STUN_V2_INVALID);
+        memcpy(response + sizeof(header), &first, sizeof(first));
+    }
+    return (int)expected_size;
+}
+
+int handle_datagram(const void* data, int size,
+                    const struct sockaddr_in* client, int s,
+                    int tcp_connection_socket, void* response) {
+    const char* type = "UDP";
+    if (tcp_connection_socket > 0) {
+        type = "TCP";
+    } else {
+        // NATs allocate TCP ports on their own, only UDP ports are predicted
+        predict_observe(client->sin_addr.s_addr, client->sin_port, time());
+    }
+
+    if (size == sizeof(stun_request_t)) {
+        stun_request_t request;
+        memcpy(&request, data, sizeof(request));
+        return handle_v1(&request, client, s, tcp_connection_socket, type,
+                         (uint8_t*)response);
+    }
+    if (size >= (int)(sizeof(stun_v2_header_t) + sizeof(stun_v2_record_t))) {
+        return handle_v2((const uint8_t*)data, size, client, s,
+                         tcp_connection_socket, type, (uint8_t*)response);
+    }
+    log("Incorrect size! %d instead of %d\n", size,
+        (int)sizeof(stun_request_t));
+    return 0;
+}
+
+unsigned int handler_request_ip(const void* data, int size,
+                                const struct sockaddr_in* client) {
+    if (size == sizeof(stun_request_t)) {
+        stun_request_t request;
+        memcpy(&request, data, sizeof(request));
+        if (request.type == ASK_INFO) {
+            return request.entry.ip;
+        }
+        return request.type == POST_INFO ? client->sin_addr.s_addr : 0;
+    }
+
+    stun_v2_header_t header;
+    if (size < (int)(sizeof(header) + sizeof(stun_v2_record_t))) {
+        return 0;
+    }
+    memcpy(&header, data, sizeof(header));
+    if ((size_t)size !=
+        sizeof(header) + header.num_records * sizeof(stun_v2_record_t)) {
+        return 0;
+    }
+    unsigned int ip = 0;
+    for (int i = 0; i < header.num_records; i++) {
+        stun_v2_record_t record;
+        memcpy(&record,
+               (const uint8_t*)data + sizeof(header) + i * sizeof(record),
+               sizeof(record));
+        unsigned int record_ip = 0;
+        if (record.type == STUN_V2_ASK) {
+            record_ip = record.ip;
+        } else if (record.type == STUN_V2_POST) {
+            record_ip = client->sin_addr.s_addr;
+        }
+        if (record_ip && ip && record_ip != ip) {
+            return 0;
+        }
+        ip = record_ip ? record_ip : ip;
+    }
+    return ip;
+}
+
+int handler_frame_size(const void* data, int size) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    uint16_t magic = htons(STUN_V2_MAGIC);
+    if (size < (int)sizeof(magic)) {
+        return 0;
+    }
+    // A version 1 request starts with its host-endian type, 0 or 1, which
+    // never reads as the version 2 magic
+    if (memcmp(bytes, &magic, sizeof(magic)) != 0) {
+        return sizeof(stun_request_t);
+    }
+    stun_v2_header_t header;
+    if (size < (int)offsetof(stun_v2_header_t, txid)) {
+        return 0;
+    }
+    memcpy(&header, data, offsetof(stun_v2_header_t, txid));
+    if (header.version != STUN_V2_VERSION || header.num_records == 0 ||
+        header.num_records > STUN_V2_MAX_RECORDS) {
+        return -1;
+    }
+    return sizeof(header) + header.num_records * sizeof(stun_v2_record_t);
+}
+
+bool handler_request_registers(const void* data, int size) {
+    if (size == sizeof(stun_request_t)) {
+        stun_request_t request;
+        memcpy(&request, data, sizeof(request));
+        return request.type == POST_INFO;
+    }
+    for (int offset = sizeof(stun_v2_header_t); offset < size;
+         offset += sizeof(stun_v2_record_t)) {
+        stun_v2_record_t record;
+        memcpy(&record, (const uint8_t*)data + offset, sizeof(record));
+        if (record.type == STUN_V2_POST) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int handler_init() {
+    if (config.ask_cookies && cookie_init() < 0) {
+        return -1;
+    }
+    if (notify_init(NOTIFY_MAX_PENDING) < 0) {
+        return -1;
+    }
+    return waiters_init(config.max_waiters, answer_waiter);
+}
@@ -0,0 +1,109 @@
+#ifndef STUN_SERVER_HANDLER_H
+#define STUN_SERVER_HANDLER_H
+/**
+ * Copyright Fractal Computers, Inc. 2021
+ * @file handler.h
+ * @brief Handling of ASK_INFO and POST_INFO requests, whichever way they
+ *        arrived
+============================
+Usage
+============================
+
+Call handler_init() once at startup, after registry_init(). Then call
+handle_datagram() with every datagram received over UDP, TCP or AF_XDP, of
+either protocol version, and send the response back to the client over the
+same path if there is one. Notifications to servers are sent by
+handle_datagram() itself. With a sharded registry, handler_request_ip() tells
+which worker should handle a request.
+
+A TCP connection carries a stream of requests rather than datagrams, and may
+deliver them in pieces: handler_frame_size() tells where the first request of
+what was received so far ends, version 1 requests having a fixed size and
+version 2 ones the number of records in their header.
+*/
+
+/*
+============================
+Includes
+============================
+*/
+
+#include <netinet/in.h>
+
+#include "stun.h"
+
+/*
+============================
+Public Functions
+============================
+*/
+
+/**
+ * @brief                          Start answering long-polling ASK_INFOs,
+ *                                 once the registry is set up
+ *
+ * @returns                        0 on success, -1 on failure
+ */
+int handler_init();
+
+/**
+ * @brief                          Handle a version 1 or version 2 request
+ *
+ * @param data                     The request
+ * @param size                     Number of bytes received
+ * @param client                   Address the request came from
+ * @param s                        UDP socket used to notify servers that
+ *                                 registered over UDP
+ * @param tcp_connection_socket    The accepted TCP socket the request arrived
+ *                                 on, or 0 if it arrived over UDP
+ * @param response                 Filled with the response to the client, of
+ *                                 at least STUN_MAX_DATAGRAM bytes
+ *
+ * @returns                        Size of the response to send to the
+ *                                 client, 0 if there is none
+ */
+int handle_datagram(const void* data, int size,
+                    const struct sockaddr_in* client, int s,
+                    int tcp_connection_socket, void* response);
+
+/**
+ * @brief                          Find the IP whose registrations a request
+ *                                 looks up or modifies, without handling it
+ *
+ * @param data                     The request
+ * @param size                     Number of bytes received
+ * @param client                   Address the request came from
+ *
+ * @returns                        The IP, in network byte order, or 0 if the
+ *                                 request touches no registration or those of
+ *                                 several IPs
+ */
+unsigned int handler_request_ip(const void* data, int size,
+                                const struct sockaddr_in* client);
+
+/**
+ * @brief                          Find the size of the request at the start
+ *                                 of the bytes received on a TCP connection
+ *
+ * @param data                     The bytes received and not handled yet
+ * @param size                     Their number
+ *
+ * @returns                        The size of the request, which may be more
+ *                                 than size if it isn't all there yet, 0 if
+ *                                 more bytes are needed to tell, or -1 if
+ *                                 they can't be a request
+ */
+int handler_frame_size(const void* data, int size);
+
+/**
+ * @brief                          Tell whether a request registers a server,
+ *                                 whose connection the registry then keeps
+ *
+ * @param data                     The request
+ * @param size                     Its size
+ *
+ * @returns                        True if it holds a POST_INFO
+ */
+bool handler_request_registers(const void* data, int size);
+
+#endif  // STUN_SERVER_HANDLER_H
@@ -0,0 +1,54 @@
+/**
+ * Copyright Fractal Computers, Inc. 2021
+ * @file log.cpp
+ * @brief Logging for the STUN server
+ */
+
+#include "log.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+FILE* log_file = NULL;
+// Workers log concurrently, so lines and log rotation must not interleave
+pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void log(const char* fmt, ...) {
+    pthread_mutex_lock(&log_mutex);
+    if (!log_file) {
+        log_file = fopen("log.txt", "a");
+    }
+
+    time_t rawtime;
+    struct tm timeinfo;
+    char time_string[32];
+    time(&rawtime);
+    localtime_r(&rawtime, &timeinfo);
+    asctime_r(&timeinfo, time_string);
+    time_string[strlen(time_string) - 1] = '\0';
+
+    printf("%s | ", time_string);
+    fprintf(log_file, "%s | ", time_string);
+
+    va_list args;
+    va_start(args, fmt);
+
+    vprintf(fmt, args);
+    va_start(args, fmt);
+    vfprintf(log_file, fmt, args);
+    fflush(log_file);
+
+    fseek(log_file, 0, SEEK_END);
+    int sz = ftell(log_file);
+    if (sz > 5 * 1024 * 1024) {
+        printf("Moving log.txt to old_log.txt!\n");
+        fclose(log_file);
+        system("mv log.txt old_log.txt");
+        log_file = fopen("log.txt", "a");
+    }
+    pthread_mutex_unlock(&log_mutex);
+}
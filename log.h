@@ -0,0 +1,29 @@
+#ifndef STUN_SERVER_LOG_H
+#define STUN_SERVER_LOG_H
+/**
+ * Copyright Fractal Computers, Inc. 2021
+ * @file log.h
+ * @brief Logging for the STUN server
+============================
+Usage
+============================
+
+Use log() like printf(). Every line is timestamped, printed to stdout and
+appended to log.txt, which is rotated to old_log.txt once it reaches 5MB.
+*/
+
+/*
+============================
+Public Functions
+============================
+*/
+
+/**
+ * @brief                          Log a printf-style message to stdout and to
+ *                                 log.txt
+ *
+ * @param fmt                      The format string
+ */
+void log(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+
+#endif  // STUN_SERVER_LOG_H
@@ -9,228 +9,911 @@
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <pthread.h>
-#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
-#include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cerrno>
+#include <vector>
 
-#define HOLEPUNCH_PORT 48800  // Fractal default holepunch port
-#define STUN_ENTRY_TIMEOUT 30000
+#include "affinity.h"
+#include "clock.h"
+#include "config.h"
+#include "discovery.h"
+#include "filter.h"
+#include "handler.h"
+#include "log.h"
+#include "metrics.h"
+#include "outbound.h"
+#include "registry.h"
+#include "shard.h"
+#include "slab.h"
+#include "stun.h"
+#include "xdp.h"
+
+using namespace std;
 
-FILE* log_file = NULL;
+atomic<int> tcp_socket;
 
-void log(const char* fmt, ...) {
-    if (!log_file) {
-        log_file = fopen("log.txt", "a");
+// The socket of the first UDP worker, used to notify servers that registered
+// over UDP when a client asks over TCP
+int udp_socket;
+
+// Every TCP connection is served by a thread of its own with a stack of
+// TCP_THREAD_STACK_SIZE, up to --tcp-max-connections of them
+#define TCP_THREAD_STACK_SIZE (256 * 1024)
+// Send buffer of every TCP connection, past which what is sent to it is
+// queued, see outbound.h
+#define TCP_SEND_BUFFER (16 * 1024)
+// How long the kernel holds on to a connection waiting for its first request
+// before queueing it for accept(2) anyway
+#define TCP_DEFER_ACCEPT_SECONDS 3
+// Bit of net.ipv4.tcp_fastopen enabling TCP Fast Open for listening sockets
+#define TFO_SERVER_ENABLE 0x2
+
+// Allocated when a connection is accepted, and freed once its socket is
+// closed, see tcp_connection_closed()
+typedef struct {
+    // Unique internal tcp socket for communication, see return value of
+    // accept(3)
+    int new_tcp_socket;
+    // Client IP/Port data
+    struct sockaddr_in si_client;
+    // Bytes received but not handled yet, at most one request's worth since
+    // a request is handled as soon as it's all there
+    int buffered;
+    uint8_t buffer[STUN_MAX_DATAGRAM];
+} tcp_connection_data_t;
+
+// How many connections an IP has open, in an open-addressed table at least
+// twice as large as --tcp-max-connections, so that it never fills up
+typedef struct {
+    uint32_t ip;
+    // 0 for an unused slot
+    uint32_t connections;
+} tcp_ip_count_t;
+
+static slab_pool_t* tcp_connections;
+static atomic<uint32_t> num_tcp_connections;
+static atomic<uint64_t> tcp_accepted;
+static atomic<uint64_t> tcp_fastopened;
+static atomic<uint64_t> tcp_accept_errors;
+static tcp_ip_count_t* tcp_ip_counts;
+static unsigned int tcp_ip_mask;
+static pthread_mutex_t tcp_ip_counts_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic<uint64_t> tcp_shed_total;
+static atomic<uint64_t> tcp_shed_per_ip;
+
+// Handles the requests buffered on a connection, and returns whether it should
+// be kept reading
+static bool handle_tcp_requests(tcp_connection_data_t* connection,
+                                bool* registered) {
+    int handled = 0;
+    while (true) {
+        uint8_t* request = connection->buffer + handled;
+        int available = connection->buffered - handled;
+        int request_size = handler_frame_size(request, available);
+        if (request_size < 0) {
+            log("Dropping TCP connection from %s:%d, which sent no request\n",
+                inet_ntoa(connection->si_client.sin_addr),
+                ntohs(connection->si_client.sin_port));
+            return false;
+        }
+        if (request_size == 0 || request_size > available) {
+            break;
+        }
+        *registered |= handler_request_registers(request, request_size);
+        uint8_t response[STUN_MAX_DATAGRAM];
+        int response_size = handle_datagram(
+            request, request_size, &connection->si_client, udp_socket,
+            connection->new_tcp_socket, response);
+        if (response_size > 0) {
+            outbound_send(connection->new_tcp_socket, response, response_size);
+        }
+        handled += request_size;
+    }
+    memmove(connection->buffer, connection->buffer + handled,
+            connection->buffered - handled);
+    connection->buffered -= handled;
+    return true;
+}
+
+static void* handle_tcp_response(void* vargp) {
+    tcp_connection_data_t* connection = (tcp_connection_data_t*)vargp;
+    int new_tcp_socket = connection->new_tcp_socket;
+    log("TCP Connection found!\n");
+
+    // Requests may arrive in pieces, or several at a time, e.g. a server
+    // refreshing its registration over the connection it registered on. The
+    // registry is safe to use from any thread, so they are handled right here
+    // rather than handed over to a worker
+    bool registered = false;
+    while (true) {
+        int recv_size =
+            read(new_tcp_socket, connection->buffer + connection->buffered,
+                 sizeof(connection->buffer) - connection->buffered);
+        if (recv_size < 0) {
+            log("Failed to TCP read(3): %s\n", strerror(errno));
+        }
+        if (recv_size <= 0) {
+            break;
+        }
+        connection->buffered += recv_size;
+        if (!handle_tcp_requests(connection, &registered)) {
+            break;
+        }
     }
 
-    time_t rawtime;
-    struct tm* timeinfo;
-    time(&rawtime);
-    timeinfo = localtime(&rawtime);
-    char* time_string = asctime(timeinfo);
-    time_string[strlen(time_string) - 1] = '\0';
+    // The servers parked on the connection can't be reached anymore. The
+    // socket is closed once a client it was just handed to is done with it
+    if (registered) {
+        registry_hang_up(new_tcp_socket);
+    }
+    outbound_release(new_tcp_socket);
+    return NULL;
+}
+
+// Slot of tcp_ip_counts holding an IP, or the unused one it would go in. Must
+// hold tcp_ip_counts_lock
+static unsigned int tcp_ip_slot(uint32_t ip) {
+    // The hash steering IPs to workers spreads them over the table too
+    unsigned int slot = steering_worker(ip, tcp_ip_mask + 1);
+    while (tcp_ip_counts[slot].connections > 0 &&
+           tcp_ip_counts[slot].ip != ip) {
+        slot = (slot + 1) & tcp_ip_mask;
+    }
+    return slot;
+}
 
-    printf("%s | ", time_string);
-    fprintf(log_file, "%s | ", time_string);
+// Counts a connection from an IP, unless it has --tcp-max-per-ip open already
+static bool count_tcp_ip(uint32_t ip) {
+    pthread_mutex_lock(&tcp_ip_counts_lock);
+    tcp_ip_count_t* count = &tcp_ip_counts[tcp_ip_slot(ip)];
+    bool counted = count->connections < config.tcp_max_per_ip;
+    if (counted) {
+        count->ip = ip;
+        count->connections++;
+    }
+    pthread_mutex_unlock(&tcp_ip_counts_lock);
+    return counted;
+}
 
-    va_list args;
-    va_start(args, fmt);
+static void uncount_tcp_ip(uint32_t ip) {
+    pthread_mutex_lock(&tcp_ip_counts_lock);
+    unsigned int hole = tcp_ip_slot(ip);
+    if (--tcp_ip_counts[hole].connections == 0) {
+        // Shifts back the IPs probed past the freed slot, so that no probe
+        // stops short of them
+        unsigned int slot = hole;
+        while (true) {
+            slot = (slot + 1) & tcp_ip_mask;
+            if (tcp_ip_counts[slot].connections == 0) {
+                break;
+            }
+            unsigned int home =
+                steering_worker(tcp_ip_counts[slot].ip, tcp_ip_mask + 1);
+            if (((slot - home) & tcp_ip_mask) >=
+                ((slot - hole) & tcp_ip_mask)) {
+                tcp_ip_counts[hole] = tcp_ip_counts[slot];
+                tcp_ip_counts[slot].connections = 0;
+                hole = slot;
+            }
+        }
+    }
+    pthread_mutex_unlock(&tcp_ip_counts_lock);
+}
 
-    vprintf(fmt, args);
-    va_start(args, fmt);
-    vfprintf(log_file, fmt, args);
-    fflush(log_file);
+// Counts a connection out of the limits once its socket is closed, which may
+// be after its thread exited
+static void tcp_connection_closed(void* context) {
+    tcp_connection_data_t* connection = (tcp_connection_data_t*)context;
+    uncount_tcp_ip(connection->si_client.sin_addr.s_addr);
+    slab_free(tcp_connections, connection);
+    num_tcp_connections.fetch_sub(1, memory_order_relaxed);
+}
 
-    fseek(log_file, 0, SEEK_END);
-    int sz = ftell(log_file);
-    if (sz > 5 * 1024 * 1024) {
-        printf("Moving log.txt to old_log.txt!\n");
-        fclose(log_file);
-        system("mv log.txt old_log.txt");
-        log_file = fopen("log.txt", "a");
+// The registry holds the sockets of the servers parked on TCP, and of the
+// clients they are handed to, through the same references as their threads
+static void hold_tcp_socket(int s, bool held) {
+    if (held) {
+        outbound_hold(s);
+    } else {
+        outbound_release(s);
     }
 }
 
-#include <atomic>
-#include <map>
-#include <vector>
+// Closes a connection that exceeds a limit with a RST rather than a FIN, so
+// that it's gone at once, leaving no TIME_WAIT behind
+static void shed_tcp_connection(int s, atomic<uint64_t>* counter) {
+    struct linger linger = {1, 0};
+    setsockopt(s, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    close(s);
+    metrics_add(counter, 1);
+}
 
-using namespace std;
+// Hands an accepted connection to a thread of its own, unless that would
+// exceed the limits on open connections. Connections are shed before anything
+// is allocated for them, so that a flood costs no more than its accept4(2)s
+static void start_tcp_connection(int new_tcp_socket,
+                                 const struct sockaddr_in* si_client,
+                                 const pthread_attr_t* attr) {
+    uint32_t ip = si_client->sin_addr.s_addr;
+    if (!count_tcp_ip(ip)) {
+        shed_tcp_connection(new_tcp_socket, &tcp_shed_per_ip);
+        return;
+    }
+    tcp_connection_data_t* handle_tcp_response_data = NULL;
+    if (num_tcp_connections.load(memory_order_relaxed) <
+        config.tcp_max_connections) {
+        handle_tcp_response_data =
+            (tcp_connection_data_t*)slab_alloc(tcp_connections);
+    }
+    if (!handle_tcp_response_data) {
+        uncount_tcp_ip(ip);
+        shed_tcp_connection(new_tcp_socket, &tcp_shed_total);
+        return;
+    }
+    handle_tcp_response_data->si_client = *si_client;
+    handle_tcp_response_data->new_tcp_socket = new_tcp_socket;
+    handle_tcp_response_data->buffered = 0;
+    if (outbound_open(new_tcp_socket, handle_tcp_response_data) < 0) {
+        slab_free(tcp_connections, handle_tcp_response_data);
+        uncount_tcp_ip(ip);
+        shed_tcp_connection(new_tcp_socket, &tcp_shed_total);
+        return;
+    }
+    num_tcp_connections.fetch_add(1, memory_order_relaxed);
+    // Messages are a few bytes each, so a peer that stopped reading never
+    // needs the megabytes a send buffer may autotune to
+    int send_buffer = TCP_SEND_BUFFER;
+    setsockopt(new_tcp_socket, SOL_SOCKET, SO_SNDBUF, &send_buffer,
+               sizeof(send_buffer));
 
-// A small struct to maintain pending STUN pairs
-// private_port is the port that the client wants to connect to,
-// and public_port is what the client must actually connect to in order to
-// access the underlying private_port
-typedef struct {
-    unsigned int ip;
-    unsigned short private_port;
-    unsigned short public_port;
-} stun_entry_t;
+    pthread_t thread_id;
+    if (pthread_create(&thread_id, attr, handle_tcp_response,
+                       handle_tcp_response_data) != 0) {
+        log("Failed to start a TCP connection thread\n");
+        // Reset like the others, letting go of the thread's reference
+        struct linger linger = {1, 0};
+        setsockopt(new_tcp_socket, SOL_SOCKET, SO_LINGER, &linger,
+                   sizeof(linger));
+        outbound_release(new_tcp_socket);
+        metrics_add(&tcp_shed_total, 1);
+    }
+}
+
+// Whether an accepted connection's request came in its SYN, with TCP Fast
+// Open
+static bool carried_syn_data(int s) {
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    return getsockopt(s, IPPROTO_TCP, TCP_INFO, &info, &len) == 0 &&
+           (info.tcpi_options & TCPI_OPT_SYN_DATA);
+}
+
+static void* grab_tcp_connection(void* vargp) {
+    (void)vargp;
+    // Nobody joins the connection threads, so they release their stacks
+    // themselves, which needn't be the default 8MB
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, TCP_THREAD_STACK_SIZE);
+    struct pollfd listener = {tcp_socket, POLLIN, 0};
+    while (true) {
+        if (poll(&listener, 1, -1) < 0 && errno != EINTR) {
+            log("Failed to poll(2) the TCP socket: %s\n", strerror(errno));
+            return NULL;
+        }
+
+        // Empty the accept queue at every wakeup, since a burst of connections
+        // only wakes us once. Connections are only queued once their first
+        // request arrived, see TCP_DEFER_ACCEPT
+        while (true) {
+            struct sockaddr_in si_client;
+            socklen_t slen = sizeof(si_client);
+            int new_tcp_socket =
+                accept4(tcp_socket, (struct sockaddr*)&si_client, &slen,
+                        SOCK_CLOEXEC);
+            if (new_tcp_socket < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                }
+                if (errno == ECONNABORTED || errno == EINTR) {
+                    continue;
+                }
+                // Most likely out of file descriptors, which closing
+                // connections will free
+                log("Failed to TCP accept4(2): %s\n", strerror(errno));
+                metrics_add(&tcp_accept_errors, 1);
+                usleep(1000);
+                break;
+            }
+            metrics_add(&tcp_accepted, 1);
+            if (config.tcp_fastopen && carried_syn_data(new_tcp_socket)) {
+                metrics_add(&tcp_fastopened, 1);
+            }
+            start_tcp_connection(new_tcp_socket, &si_client, &attr);
+        }
+    }
+}
+
+// Length of the accept queue of a listening TCP socket, and the most it may
+// hold
+static void accept_queue(int s, uint32_t* length, uint32_t* backlog) {
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    *length = *backlog = 0;
+    if (getsockopt(s, IPPROTO_TCP, TCP_INFO, &info, &len) == 0) {
+        *length = info.tcpi_unacked;
+        *backlog = info.tcpi_sacked;
+    }
+}
+
+// The net.ipv4.tcp_fastopen setting of the host
+static int host_tcp_fastopen() {
+    FILE* f = fopen("/proc/sys/net/ipv4/tcp_fastopen", "r");
+    int value = 0;
+    if (f) {
+        if (fscanf(f, "%d", &value) != 1) {
+            value = 0;
+        }
+        fclose(f);
+    }
+    return value;
+}
+
+// Reads a TcpExt counter of the host from /proc/net/netstat, where a line of
+// names is followed by a line of their values
+static uint64_t tcp_ext_counter(const char* name) {
+    FILE* f = fopen("/proc/net/netstat", "r");
+    if (!f) {
+        return 0;
+    }
+    uint64_t value = 0;
+    char names[4096], values[4096];
+    while (fgets(names, sizeof(names), f) && fgets(values, sizeof(values), f)) {
+        if (strncmp(names, "TcpExt:", 7) != 0) {
+            continue;
+        }
+        char* names_state;
+        char* values_state;
+        char* n = strtok_r(names, " \n", &names_state);
+        char* v = strtok_r(values, " \n", &values_state);
+        while (n && v) {
+            if (strcmp(n, name) == 0) {
+                value = strtoull(v, NULL, 10);
+                break;
+            }
+            n = strtok_r(NULL, " \n", &names_state);
+            v = strtok_r(NULL, " \n", &values_state);
+        }
+        break;
+    }
+    fclose(f);
+    return value;
+}
+
+static void write_tcp_metrics(FILE* f) {
+    uint32_t length, backlog;
+    accept_queue(tcp_socket, &length, &backlog);
+    metrics_write_counter(f, "stun_tcp_accepted_total",
+                          "TCP connections accepted",
+                          tcp_accepted.load(memory_order_relaxed));
+    metrics_write_counter(f, "stun_tcp_accept_errors_total",
+                          "Failed accept4 calls, e.g. for lack of file "
+                          "descriptors",
+                          tcp_accept_errors.load(memory_order_relaxed));
+    // The kernel only counts them for the whole host
+    metrics_write_counter(f, "stun_tcp_listen_overflows_total",
+                          "TCP connections the host dropped as the accept "
+                          "queue of their listening socket was full",
+                          tcp_ext_counter("ListenOverflows"));
+    metrics_write_counter(f, "stun_tcp_listen_drops_total",
+                          "TCP connections the host dropped before they "
+                          "were queued for accept, overflows included",
+                          tcp_ext_counter("ListenDrops"));
+    if (config.tcp_fastopen) {
+        metrics_write_counter(f, "stun_tcp_fastopen_total",
+                              "TCP connections whose request came in their "
+                              "SYN",
+                              tcp_fastopened.load(memory_order_relaxed));
+        metrics_write_counter(f, "stun_tcp_fastopen_overflows_total",
+                              "SYNs whose data the host ignored as too many "
+                              "TCP Fast Open connections were pending",
+                              tcp_ext_counter("TCPFastOpenListenOverflow"));
+    }
+    metrics_write_gauge(f, "stun_tcp_accept_queue",
+                        "TCP connections waiting to be accepted", length);
+    metrics_write_gauge(f, "stun_tcp_accept_queue_limit",
+                        "Most TCP connections the accept queue holds",
+                        backlog);
+    metrics_write_gauge(f, "stun_tcp_connections",
+                        "TCP connections open",
+                        num_tcp_connections.load(memory_order_relaxed));
+    metrics_write_gauge(f, "stun_tcp_connections_limit",
+                        "Most TCP connections open at once",
+                        config.tcp_max_connections);
+    metrics_write_counter(f, "stun_tcp_shed_total",
+                          "TCP connections reset as soon as accepted, as "
+                          "--tcp-max-connections were already open or no "
+                          "thread could be started for them",
+                          tcp_shed_total.load(memory_order_relaxed));
+    metrics_write_counter(f, "stun_tcp_shed_per_ip_total",
+                          "TCP connections reset as soon as accepted, as "
+                          "their IP already had --tcp-max-per-ip open",
+                          tcp_shed_per_ip.load(memory_order_relaxed));
+}
+
+// Number of datagrams a worker receives per recvmmsg(2)
+#define WORKER_BATCH 16
 
-// Servers will post info about themselves, clients will ask info about servers
-typedef enum stun_request_type { ASK_INFO, POST_INFO } stun_request_type_t;
+// In busy-poll mode, how long a worker keeps spinning without receiving
+// anything before going back to sleep in epoll_wait(2). The window doubles
+// when traffic resumes right after the worker fell asleep, and halves when it
+// then sleeps for longer than the window
+#define BUSY_POLL_MIN_SPIN_NS (50 * 1000)
+#define BUSY_POLL_MAX_SPIN_NS (20 * 1000 * 1000)
 
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+#ifndef SO_BUSY_POLL_BUDGET
+#define SO_BUSY_POLL_BUDGET 70
+#endif
+
+// Statistics of a worker, only ever updated by the worker itself
 typedef struct {
-    // Ask or Post
-    stun_request_type_t type;
-    // IP / priv / public
-    stun_entry_t entry;
-} stun_request_t;
+    atomic<uint64_t> packets;
+    // Non-blocking receives that found nothing, in busy-poll mode
+    atomic<uint64_t> empty_polls;
+    // Times the worker went back to sleep, in busy-poll mode
+    atomic<uint64_t> sleeps;
+    // From a receive returning a datagram to its response being sent
+    metrics_histogram_t poll_to_response;
+} worker_stats_t;
 
 typedef struct {
-    double time;
-    int tcp_socket;
-    stun_entry_t entry;
-} stun_map_entry_t;
+    int index;
+    // CPU the worker is pinned to, or -1
+    int cpu;
+    // The worker's own socket, bound to the same port as every other
+    // worker's through SO_REUSEPORT
+    int udp_socket;
+    worker_stats_t* stats;
+} worker_t;
+
+// A worker's receive buffers, allocated by the worker itself once it runs on
+// its CPU
+typedef struct {
+    uint8_t datagrams[WORKER_BATCH][STUN_MAX_DATAGRAM];
+    uint8_t response[STUN_MAX_DATAGRAM];
+    struct sockaddr_in addrs[WORKER_BATCH];
+    struct iovec iovecs[WORKER_BATCH];
+    struct mmsghdr msgs[WORKER_BATCH];
+} worker_buffers_t;
+
+vector<worker_t> workers;
+
+static void reset_buffers(worker_buffers_t* buffers) {
+    for (int i = 0; i < WORKER_BATCH; i++) {
+        buffers->msgs[i].msg_hdr.msg_namelen = sizeof(buffers->addrs[i]);
+    }
+}
 
-map<int, vector<stun_map_entry_t>> stun_entries;
+// With --shard-registry, forwards a datagram to the worker owning the
+// registrations it touches. Returns false if the worker should handle it
+static bool forward(worker_t* worker, const void* data, int size,
+                    const struct sockaddr_in* client) {
+    unsigned int ip = handler_request_ip(data, size, client);
+    if (ip == 0) {
+        return false;
+    }
+    unsigned int owner = steering_worker(ip, config.workers);
+    return owner != (unsigned int)worker->index &&
+           shard_forward(worker->index, owner, data, size, client);
+}
 
-double time() {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    return tv.tv_sec + tv.tv_usec / 1000000.0;
+// Handles the datagrams of a recvmmsg(2) that returned at polled_ns
+static void handle_batch(worker_t* worker, worker_buffers_t* buffers,
+                         int received, uint64_t polled_ns) {
+    // Anything but a well-formed request, e.g. the empty datagrams clients
+    // used to send to make us check for TCP connections, never gets here
+    for (int i = 0; i < received; i++) {
+        if (config.shard_registry &&
+            forward(worker, buffers->datagrams[i], buffers->msgs[i].msg_len,
+                    &buffers->addrs[i])) {
+            continue;
+        }
+        int response_size = handle_datagram(
+            buffers->datagrams[i], buffers->msgs[i].msg_len, &buffers->addrs[i],
+            worker->udp_socket, 0, buffers->response);
+        if (response_size > 0) {
+            sendto(worker->udp_socket, buffers->response, response_size,
+                   MSG_NOSIGNAL, (struct sockaddr*)&buffers->addrs[i],
+                   sizeof(buffers->addrs[i]));
+        }
+        metrics_observe(&worker->stats->poll_to_response,
+                        monotonic_ns() - polled_ns);
+    }
+    metrics_add(&worker->stats->packets, received);
+    if (config.shard_registry) {
+        shard_flush(worker->index);
+    }
 }
 
-atomic<int> tcp_socket;
+// Answers a request another worker forwarded, from this worker's socket
+static void handle_forwarded(const void* data, int size,
+                             const struct sockaddr_in* client, void* context) {
+    worker_t* worker = (worker_t*)context;
+    uint8_t response[STUN_MAX_DATAGRAM];
+    int response_size = handle_datagram(data, size, client,
+                                        worker->udp_socket, 0, response);
+    if (response_size > 0) {
+        sendto(worker->udp_socket, response, response_size, MSG_NOSIGNAL,
+               (const struct sockaddr*)client, sizeof(*client));
+    }
+}
 
-typedef struct {
-    // Unique internal tcp socket for communication, see return value of
-    // accept(3)
-    int new_tcp_socket;
-    // Client IP/Port data
-    struct sockaddr_in si_client;
-    // The request itself
-    stun_request_t request;
-    // Used to ensure validity of request. If recv_size !=
-    // sizeof(stun_request_t), then "request" is not filled correctly
-    int recv_size;
-} tcp_connection_data_t;
+static void receive_failed() {
+    // A dead worker would silently drop its share of the port's traffic, so
+    // take the whole server down and let Immortal restart it
+    log("Could not receive UDP packet from client: %d\n", errno);
+    exit(-1);
+}
 
-pthread_mutex_t tcp_connection_data_mutex = PTHREAD_MUTEX_INITIALIZER;
-// A TCP Connection Ask/Post request will be dumped into this struct upon
-// receival
-tcp_connection_data_t tcp_connection_data;
-// True if tcp_connection_data is currently holding TCP data
-atomic<bool> pending_tcp_data;
+// Sleeps in recvmmsg(2) until datagrams arrive
+static void blocking_loop(worker_t* worker, worker_buffers_t* buffers) {
+    while (true) {
+        reset_buffers(buffers);
 
-void* handle_tcp_response(void* vargp) {
-    tcp_connection_data_t* handle_tcp_response_data =
-        (tcp_connection_data_t*)vargp;
-    struct sockaddr_in si_client = handle_tcp_response_data->si_client;
-    int new_tcp_socket = handle_tcp_response_data->new_tcp_socket;
-    delete handle_tcp_response_data;
+        // When new clients send datagram connection requests...
+        int received = recvmmsg(worker->udp_socket, buffers->msgs,
+                                WORKER_BATCH, MSG_WAITFORONE, NULL);
+        if (received < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            receive_failed();
+        }
+        handle_batch(worker, buffers, received, monotonic_ns());
+    }
+}
 
-    int recv_size;
-    stun_request_t request;
-    if ((recv_size = read(new_tcp_socket, &request, sizeof(request))) < 0) {
-        log("Failed to TCP read(3): %s\n", strerror(errno));
-        return NULL;
+// Spins on non-blocking recvmmsg(2), which also busy-polls the NIC queue
+// thanks to SO_BUSY_POLL, and only sleeps in epoll_wait(2) once idle
+static void busy_poll_loop(worker_t* worker, worker_buffers_t* buffers) {
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = worker->udp_socket;
+    if (epoll_fd < 0 ||
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, worker->udp_socket, &event) < 0) {
+        log("Could not create epoll for worker %d: %s\n", worker->index,
+            strerror(errno));
+        exit(-1);
     }
 
+    uint64_t spin_ns = BUSY_POLL_MIN_SPIN_NS;
+    uint64_t idle_since_ns = monotonic_ns();
     while (true) {
-        // If pending_tcp_data, wait for main.c to read the data out of
-        // tcp_connection_data
-        while (pending_tcp_data)
-            ;
-
-        // Use mutex to negotiate which pending handle_tcp_response actually
-        // writes to the buffer first, As there may be several waiting at the
-        // same time
-        pthread_mutex_lock(&tcp_connection_data_mutex);
-        if (pending_tcp_data) {
-            pthread_mutex_unlock(&tcp_connection_data_mutex);
+        reset_buffers(buffers);
+        int received = recvmmsg(worker->udp_socket, buffers->msgs,
+                                WORKER_BATCH, MSG_DONTWAIT, NULL);
+        uint64_t polled_ns = monotonic_ns();
+        if (received > 0) {
+            handle_batch(worker, buffers, received, polled_ns);
+            idle_since_ns = monotonic_ns();
             continue;
         }
+        if (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+            errno != EINTR) {
+            receive_failed();
+        }
 
-        tcp_connection_data.si_client = si_client;
-        tcp_connection_data.new_tcp_socket = new_tcp_socket;
-        tcp_connection_data.request = request;
-        tcp_connection_data.recv_size = recv_size;
-        pending_tcp_data = true;
-        pthread_mutex_unlock(&tcp_connection_data_mutex);
-        break;
+        metrics_add(&worker->stats->empty_polls, 1);
+        if (polled_ns - idle_since_ns < spin_ns) {
+            continue;
+        }
+
+        // Idle for the whole spin window, go back to sleep
+        metrics_add(&worker->stats->sleeps, 1);
+        if (epoll_wait(epoll_fd, &event, 1, -1) < 0 && errno != EINTR) {
+            log("Could not epoll_wait(2) in worker %d: %s\n", worker->index,
+                strerror(errno));
+            exit(-1);
+        }
+        uint64_t woke_ns = monotonic_ns();
+        if (woke_ns - polled_ns < spin_ns) {
+            spin_ns = min<uint64_t>(spin_ns * 2, BUSY_POLL_MAX_SPIN_NS);
+        } else {
+            spin_ns = max<uint64_t>(spin_ns / 2, BUSY_POLL_MIN_SPIN_NS);
+        }
+        idle_since_ns = woke_ns;
     }
-    return NULL;
 }
 
-void* grab_tcp_connection(void* vargp) {
+// With --shard-registry, handles both the datagrams of the worker's socket
+// and the requests other workers forward, sleeping in epoll_wait(2) on the
+// socket and the worker's eventfd once there is neither
+static void sharded_loop(worker_t* worker, worker_buffers_t* buffers) {
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event events[2];
+    events[0].events = EPOLLIN;
+    events[0].data.fd = worker->udp_socket;
+    events[1].events = EPOLLIN;
+    events[1].data.fd = shard_wakeup_fd(worker->index);
+    if (epoll_fd < 0 ||
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, worker->udp_socket, &events[0]) <
+            0 ||
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, events[1].data.fd, &events[1]) <
+            0) {
+        log("Could not create epoll for worker %d: %s\n", worker->index,
+            strerror(errno));
+        exit(-1);
+    }
+
     while (true) {
-        // Listen indefinitely until a request occurs
-        if (listen(tcp_socket, 3) < 0) {
-            log("Failed to TCP listen(2): %s\n", strerror(errno));
-            return NULL;
+        bool busy =
+            shard_drain(worker->index, handle_forwarded, worker) > 0;
+        reset_buffers(buffers);
+        int received = recvmmsg(worker->udp_socket, buffers->msgs,
+                                WORKER_BATCH, MSG_DONTWAIT, NULL);
+        if (received > 0) {
+            handle_batch(worker, buffers, received, monotonic_ns());
+            busy = true;
+        } else if (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+                   errno != EINTR) {
+            receive_failed();
         }
-
-        struct sockaddr_in si_client;
-        socklen_t slen = sizeof(si_client);
-
-        // Grab the request ("accept" gives it a unique internal tcp_socket for
-        // just that one TCP instance,
-        //                   since they all end up sharing the underlying TCP
-        //                   port)
-        int new_tcp_socket;
-        if ((new_tcp_socket =
-                 accept(tcp_socket, (struct sockaddr*)&si_client, &slen)) < 0) {
-            log("Failed to TCP accept(3): %s\n", strerror(errno));
-            usleep(1000);
+        if (busy || !shard_sleep(worker->index)) {
             continue;
         }
+        if (epoll_wait(epoll_fd, events, 2, -1) < 0 && errno != EINTR) {
+            log("Could not epoll_wait(2) in worker %d: %s\n", worker->index,
+                strerror(errno));
+            exit(-1);
+        }
+        shard_woke(worker->index);
+    }
+}
+
+// UDP hole punching loop
+static void* udp_worker(void* vargp) {
+    worker_t* worker = (worker_t*)vargp;
+
+    if (worker->cpu >= 0 && pin_thread(worker->cpu) == 0) {
+        log("Worker %d pinned to CPU %d\n", worker->index, worker->cpu);
+    }
+
+    worker_buffers_t* buffers;
+    if (config.numa_local) {
+        buffers = (worker_buffers_t*)numa_alloc_local(sizeof(*buffers));
+    } else {
+        buffers = (worker_buffers_t*)calloc(1, sizeof(*buffers));
+    }
+    if (!buffers) {
+        log("Could not allocate buffers for worker %d\n", worker->index);
+        exit(-1);
+    }
+    // The registry was mapped before any worker was placed, and the shard of
+    // a worker is mostly touched by that worker alone
+    void* shard_memory;
+    size_t shard_bytes;
+    if (config.numa_local && config.shard_registry &&
+        registry_shard_memory(worker->index, &shard_memory, &shard_bytes) ==
+            0) {
+        numa_bind_local(shard_memory, shard_bytes);
+    }
+    for (int i = 0; i < WORKER_BATCH; i++) {
+        buffers->iovecs[i].iov_base = buffers->datagrams[i];
+        buffers->iovecs[i].iov_len = sizeof(buffers->datagrams[i]);
+        buffers->msgs[i].msg_hdr.msg_iov = &buffers->iovecs[i];
+        buffers->msgs[i].msg_hdr.msg_iovlen = 1;
+        buffers->msgs[i].msg_hdr.msg_name = &buffers->addrs[i];
+    }
+
+    if (config.shard_registry) {
+        sharded_loop(worker, buffers);
+    } else if (config.busy_poll) {
+        busy_poll_loop(worker, buffers);
+    } else {
+        blocking_loop(worker, buffers);
+    }
+    return NULL;
+}
 
-        // Handle the response asynchronously
-        tcp_connection_data_t* handle_tcp_response_data =
-            new tcp_connection_data_t;
-        handle_tcp_response_data->si_client = si_client;
-        handle_tcp_response_data->new_tcp_socket = new_tcp_socket;
+static void write_worker_metrics(FILE* f) {
+    uint64_t packets = 0, drops = 0, empty_polls = 0, sleeps = 0;
+    vector<const metrics_histogram_t*> histograms;
+    for (worker_t& worker : workers) {
+        packets += worker.stats->packets.load(memory_order_relaxed);
+        drops += socket_drops(worker.udp_socket);
+        empty_polls += worker.stats->empty_polls.load(memory_order_relaxed);
+        sleeps += worker.stats->sleeps.load(memory_order_relaxed);
+        histograms.push_back(&worker.stats->poll_to_response);
+    }
+    metrics_write_counter(f, "stun_udp_packets_total",
+                          "UDP datagrams received by the workers", packets);
+    metrics_write_counter(f, "stun_udp_dropped_total",
+                          "UDP datagrams dropped by the kernel, as malformed "
+                          "requests or because a worker's receive buffer was "
+                          "full",
+                          drops);
+    metrics_write_histogram(
+        f, "stun_udp_poll_to_response_seconds",
+        "Time from receiving a UDP datagram to having answered it",
+        histograms.data(), histograms.size());
+    if (config.busy_poll) {
+        metrics_write_counter(f, "stun_busy_poll_empty_polls_total",
+                              "Busy-polls of a worker socket that found "
+                              "nothing",
+                              empty_polls);
+        metrics_write_counter(f, "stun_busy_poll_sleeps_total",
+                              "Times a busy-polling worker went idle and "
+                              "fell back to epoll_wait",
+                              sleeps);
+    }
+}
 
-        pthread_t thread_id;
-        pthread_create(&thread_id, NULL, handle_tcp_response,
-                       handle_tcp_response_data);
+// Decides which CPU every worker gets pinned to, -1 for none
+static int place_workers(worker_t* placed) {
+    vector<int> cpus;
+    if (config.cpus && parse_cpu_list(config.cpus, &cpus) < 0) {
+        log("Invalid CPU list %s\n", config.cpus);
+        return -1;
+    }
+    if (config.irq_affinity && irq_cpu_list(config.irq_affinity, &cpus) < 0) {
+        return -1;
+    }
+    for (int i = 0; i < config.workers; i++) {
+        placed[i].index = i;
+        placed[i].cpu = cpus.empty() ? -1 : cpus[i % cpus.size()];
     }
+    return 0;
+}
+
+static int set_busy_poll(int s) {
+    int opt = config.busy_poll;
+    if (setsockopt(s, SOL_SOCKET, SO_BUSY_POLL, &opt, sizeof(opt)) < 0) {
+        // Raising it above net.core.busy_read needs CAP_NET_ADMIN, the
+        // workers still spin in userspace without it
+        log("Could not set SO_BUSY_POLL, only polling from userspace: %s\n",
+            strerror(errno));
+        return 0;
+    }
+    opt = 1;
+    if (setsockopt(s, SOL_SOCKET, SO_PREFER_BUSY_POLL, &opt, sizeof(opt)) < 0) {
+        log("Could not set SO_PREFER_BUSY_POLL: %s\n", strerror(errno));
+    }
+    opt = config.busy_poll_budget;
+    if (opt && setsockopt(s, SOL_SOCKET, SO_BUSY_POLL_BUDGET, &opt,
+                          sizeof(opt)) < 0) {
+        log("Failed to set SO_BUSY_POLL_BUDGET: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
 }
 
 // main server loop
-int main(void) {
-    log("Starting STUN Server...\n");
+int main(int argc, char* argv[]) {
+    if (parse_config(argc, argv) < 0) {
+        return -1;
+    }
 
-    // punch vars
-    struct sockaddr_in si_me, si_client;  // our endpoint and the client's
-    int s, recv_size;                     // counters
-    socklen_t slen = sizeof(si_client);   // addr len
+    log("Starting STUN Server...\n");
 
-    // initialize endpoints for a node for reassignment later
-    int client_ip, server_ip;
-    short client_port, server_port;
+    unsigned int shards = config.shard_registry ? config.workers : 1;
+    unsigned int capacity = config.registry_capacity;
+    if (config.registry_memory) {
+        capacity = registry_capacity_for((size_t)config.registry_memory << 20,
+                                         shards);
+        if (capacity == 0) {
+            log("--registry-memory=%u is too small for a registry\n",
+                config.registry_memory);
+            return -1;
+        }
+        log("Sized the registry for %u registrations\n", capacity);
+    }
+    if (registry_init(config.shm_registry, capacity, config.ip_quota, shards,
+                      hold_tcp_socket) < 0) {
+        log("Failed to create the registry\n");
+        return -2;
+    }
+    if (config.shard_registry && shard_init(config.workers) < 0) {
+        return -1;
+    }
 
-    // create the UDP socket
-    if ((s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
-        log("Could not create UDP socket.\n");
+    if (handler_init() < 0) {
+        return -1;
     }
 
-    if ((tcp_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0) {
-        log("Could not create UDP socket.\n");
+    workers.resize(config.workers);
+    if (place_workers(workers.data()) < 0) {
+        return -1;
     }
 
+    // punch vars
+    struct sockaddr_in si_me;  // our endpoint
+
     // set our endpoint (for this UDP hole punching server not behind a NAT)
     memset((char*)&si_me, 0, sizeof(si_me));
     si_me.sin_family = AF_INET;
-    si_me.sin_port = htons(HOLEPUNCH_PORT);
+    si_me.sin_port = htons(config.port);
     si_me.sin_addr.s_addr = htonl(INADDR_ANY);
 
-    // bind socket to this endpoint
-    if (bind(s, (struct sockaddr*)&si_me, sizeof(si_me)) < 0) {
-        log("Failed to bind socket. `sudo reboot` and try again: %s\n",
-            strerror(errno));
+    // create the UDP sockets, in worker order
+    for (worker_t& worker : workers) {
+        int s;
+        if ((s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
+            log("Could not create UDP socket.\n");
+            return -1;
+        }
+
+        int opt = 1;
+        if (config.workers > 1 &&
+            setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+            log("Failed to set reuseport socket: %s\n", strerror(errno));
+            return -2;
+        }
+
+        // The secondary IP's socket binds to the same port
+        if (config.alt_ip &&
+            setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+            log("Failed to set reuseaddr socket: %s\n", strerror(errno));
+            return -2;
+        }
+
+        if (config.busy_poll && set_busy_poll(s) < 0) {
+            return -2;
+        }
+
+        if (config.incoming_cpu &&
+            setsockopt(s, SOL_SOCKET, SO_INCOMING_CPU, &worker.cpu,
+                       sizeof(worker.cpu)) < 0) {
+            log("Failed to set incoming CPU of socket: %s\n", strerror(errno));
+            return -2;
+        }
+
+        if (attach_request_filter(s) < 0) {
+            return -2;
+        }
+
+        // bind socket to this endpoint
+        if (bind(s, (struct sockaddr*)&si_me, sizeof(si_me)) < 0) {
+            log("Failed to bind socket. `sudo reboot` and try again: %s\n",
+                strerror(errno));
+            return -2;
+        }
+        worker.udp_socket = s;
+        worker.stats = new worker_stats_t();
+    }
+    udp_socket = workers[0].udp_socket;
+
+    // Keep each host's requests on one worker, unless they are already
+    // steered by CPU, which the kernel only does without a program
+    if (config.workers > 1 && !config.incoming_cpu &&
+        attach_ip_steering(udp_socket, config.workers) < 0) {
         return -2;
     }
 
+    // Nonblocking, so that the accept queue can be drained without blocking
+    if ((tcp_socket =
+             socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    IPPROTO_TCP)) < 0) {
+        log("Could not create TCP socket.\n");
+        return -1;
+    }
+
     int opt = 1;
     if (setsockopt(tcp_socket, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt,
                    sizeof(opt)) < 0) {
@@ -245,203 +928,74 @@ int main(void) {
         return -2;
     }
 
-    pending_tcp_data = false;
-    pthread_t thread_id;
-    pthread_create(&thread_id, NULL, grab_tcp_connection, NULL);
-
-    struct timeval timeout;
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 1 * 1000;
-
-    if (setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout,
-                   sizeof(timeout)) < 0) {
-        log("Could not set timeout!\n");
-        return -1;
+    // Only wake up for connections whose request already arrived
+    int defer_seconds = TCP_DEFER_ACCEPT_SECONDS;
+    if (setsockopt(tcp_socket, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_seconds,
+                   sizeof(defer_seconds)) < 0) {
+        log("Failed to set TCP_DEFER_ACCEPT: %s\n", strerror(errno));
     }
 
-    // main hole punching loop
-    while (true) {
-        stun_request_t request;  // receive buffer
-
-        // When a new client sends a datagram connection request...
-        if ((recv_size = recvfrom(s, &request, sizeof(request), 0,
-                                  (struct sockaddr*)&si_client, &slen)) < 0) {
-            if (errno == EAGAIN) {
-                recv_size = 0;
-            } else {
-                log("Could not receive UDP packet from client: %d\n", errno);
-                return -1;
-            }
+    // Let returning clients send their request in the SYN, saving a round
+    // trip. The host must enable it for servers, with the 0x2 bit of
+    // net.ipv4.tcp_fastopen
+    if (config.tcp_fastopen) {
+        if (setsockopt(tcp_socket, IPPROTO_TCP, TCP_FASTOPEN,
+                       &config.tcp_fastopen, sizeof(config.tcp_fastopen)) < 0) {
+            log("Failed to set TCP_FASTOPEN: %s\n", strerror(errno));
+        } else if (!(host_tcp_fastopen() & TFO_SERVER_ENABLE)) {
+            log("TCP Fast Open is disabled for servers on this host, set "
+                "net.ipv4.tcp_fastopen to 3 to enable it\n");
         }
+    }
 
-        int tcp_connection_socket = 0;
-
-        // TCP Listens are trigger by UDP packets of size 0
-        // (This system isn't needed anymore, we can simply check
-        // pending_tcp_data before checking recvfrom, as long as recvfrom gets a
-        // timeout)
-        if (recv_size == 0) {
-            // Check for any pending TCP data
-            if (pending_tcp_data) {
-                log("TCP Connection found!\n");
-                si_client = tcp_connection_data.si_client;
-                tcp_connection_socket = tcp_connection_data.new_tcp_socket;
-                request = tcp_connection_data.request;
-                recv_size = tcp_connection_data.recv_size;
-                pending_tcp_data = false;
-            } else {
-                // Received neither TCP nor UDP
-                continue;
-            }
-        }
+    // The kernel caps the backlog at net.core.somaxconn
+    if (listen(tcp_socket, config.tcp_backlog) < 0) {
+        log("Failed to TCP listen(2): %s\n", strerror(errno));
+        return -2;
+    }
 
-        const char* type = "UDP";
-        int connection_socket = s;
-        if (tcp_connection_socket > 0) {
-            type = "TCP";
-            // Use the special tcp unique connection socket
-            connection_socket = tcp_connection_socket;
-        }
-
-        // the client's public UDP endpoint data is now in si_client
-        // log("Received packet from %s:%d.\n", inet_ntoa(si_client.sin_addr),
-        // ntohs(si_client.sin_port));
-
-        if (recv_size == sizeof(request)) {
-            if (request.type == ASK_INFO) {
-                log("Received %s REQUEST packet from %s:%d.\n", type,
-                    inet_ntoa(si_client.sin_addr), ntohs(si_client.sin_port));
-
-                struct in_addr requested_addr;
-                requested_addr.s_addr = request.entry.ip;
-
-                char* original = inet_ntoa(si_client.sin_addr);
-
-                log("%s:%d Wants to connect to public %s:%d.\n", original,
-                    ntohs(si_client.sin_port), inet_ntoa(requested_addr),
-                    ntohs(request.entry.public_port));
-
-                // Record the public IP:Port that the client wants to connect to
-                int ip = request.entry.ip;
-                int port = request.entry.public_port;
-                int private_port = 0;  // Put the private_port here
-                int server_socket = s;
-
-                // Check for stun entries related to this IP
-                if (stun_entries.count(ip)) {
-                    for (stun_map_entry_t& map_entry : stun_entries[ip]) {
-                        // If map entry is expired, ignore it
-                        if (time() - map_entry.time >
-                            STUN_ENTRY_TIMEOUT / 1000.0) {
-                            continue;
-                        }
-                        stun_entry_t entry = map_entry.entry;
-                        // If this entry matches the requested public port,
-                        // we found the correct private port!
-                        if (port == entry.public_port) {
-                            if (map_entry.tcp_socket > 0) {
-                                server_socket = map_entry.tcp_socket;
-                                map_entry.time = 0;
-                            }
-                            private_port = entry.private_port;
-                            log("Found port %d to public %d!\n\n",
-                                ntohs(private_port), ntohs(port));
-                            break;
-                        }
-                    }
-                }
+    tcp_connections = slab_create(
+        "tcp_connections", sizeof(tcp_connection_data_t),
+        config.tcp_max_connections);
+    unsigned int ip_slots = 1;
+    while (ip_slots < 2 * config.tcp_max_connections) {
+        ip_slots <<= 1;
+    }
+    tcp_ip_counts = new tcp_ip_count_t[ip_slots]();
+    tcp_ip_mask = ip_slots - 1;
+    if (!tcp_connections ||
+        outbound_init(config.tcp_max_connections, tcp_connection_closed) < 0) {
+        return -1;
+    }
+    pthread_t thread_id;
+    pthread_create(&thread_id, NULL, grab_tcp_connection, NULL);
 
-                if (private_port == 0) {
-                    // Missing private port is 0, notifying the client that no
-                    // such private port was found
-                    request.entry.private_port = 0;
-                    log("Could not find private_port entry associated with "
-                        "%s:%d!\n\n",
-                        inet_ntoa(requested_addr), ntohs(port));
-                } else {
-                    // Fill in the missing private_port data
-                    request.entry.private_port = private_port;
-
-                    struct sockaddr_in si_server;
-                    si_server.sin_family = AF_INET;
-                    si_server.sin_addr.s_addr = request.entry.ip;
-                    si_server.sin_port = request.entry.private_port;
-
-                    stun_entry_t entry;
-                    // Tell the server what IP:Port the client has
-                    entry.ip = si_client.sin_addr.s_addr;
-                    entry.private_port = si_client.sin_port;
-
-                    // Notify the server about the STUN connection
-                    sendto(server_socket, &entry, sizeof(entry), MSG_NOSIGNAL,
-                           (struct sockaddr*)&si_server, sizeof(si_server));
-                }
+    if (discovery_start(udp_socket) < 0) {
+        log("Failed to listen on the NAT behavior discovery addresses\n");
+        return -2;
+    }
 
-                // Return request with private port to client
-                log("Responding to STUN request\n");
-                sendto(connection_socket, &request.entry, sizeof(request.entry),
-                       MSG_NOSIGNAL, (struct sockaddr*)&si_client,
-                       sizeof(si_client));
-            } else if (request.type == POST_INFO) {
-                int ip = si_client.sin_addr.s_addr;
-                request.entry.ip = ip;
-                request.entry.private_port = si_client.sin_port;
-
-                // First check if the entry is already in the map, because if so
-                // we should just update it
-                bool found = false;
-                for (stun_map_entry_t& map_entry : stun_entries[ip]) {
-                    if (map_entry.entry.public_port ==
-                        request.entry.public_port) {
-                        if (time() - map_entry.time >
-                            STUN_ENTRY_TIMEOUT / 1000.0) {
-                            // If the entry would've been expired, we log it as
-                            // a new POST_INFO packet rather than silently
-                            // refresh the port info
-                            log("Received %s POST_INFO packet from %s:%d.\n\n",
-                                type, inet_ntoa(si_client.sin_addr),
-                                ntohs(si_client.sin_port));
-                        }
-                        found = true;
-                        map_entry.time = time();
-                        map_entry.entry = request.entry;
-                        map_entry.tcp_socket = 0;
-                        if (tcp_connection_socket > 0) {
-                            map_entry.tcp_socket = tcp_connection_socket;
-                        }
-                    }
-                }
+    if (config.xdp && xdp_start(config.xdp, config.xdp_queues,
+                                config.xdp_generic, udp_socket) < 0) {
+        log("Failed to start the AF_XDP fast path on %s\n", config.xdp);
+        return -2;
+    }
 
-                // If we didn't find any such entry, we add it to the map
-                if (!found) {
-                    log("Received %s POST_INFO packet from %s:%d.\n\n", type,
-                        inet_ntoa(si_client.sin_addr),
-                        ntohs(si_client.sin_port));
-                    // If the IP has 5 ongoing requests at the same time, erase
-                    // one of them. This should never happen for our protocol,
-                    // so it not a problem if a request is dropped due to such a
-                    // situation (But it protects us from tampering)
-                    if (stun_entries[ip].size() > 5) {
-                        stun_entries[ip].erase(stun_entries[ip].begin());
-                    }
-                    // Record the map entry
-                    stun_map_entry_t map_entry;
-                    map_entry.time = time();
-                    map_entry.entry = request.entry;
-                    map_entry.tcp_socket = 0;
-                    if (tcp_connection_socket > 0) {
-                        map_entry.tcp_socket = tcp_connection_socket;
-                    }
-                    stun_entries[ip].push_back(map_entry);
-                }
-            }
-        } else {
-            log("Incorrect size! %d instead of %d\n", recv_size,
-                (int)sizeof(request));
-        }
-    }  // End of connection listening for loop
+    metrics_register(write_worker_metrics);
+    metrics_register(write_tcp_metrics);
+    if (metrics_start() < 0) {
+        return -1;
+    }
 
-    // Cleanup socket
-    close(s);
+    // The main thread runs the first worker itself
+    for (int i = 1; i < config.workers; i++) {
+        pthread_create(&thread_id, NULL, udp_worker, &workers[i]);
+    }
+    udp_worker(&workers[0]);
+
+    // Cleanup sockets
+    for (worker_t& worker : workers) {
+        close(worker.udp_socket);
+    }
     return 0;
 }
@@ -0,0 +1,124 @@
+/**
+ * Copyright Fractal Computers, Inc. 2021
+ * @file metrics.cpp
+ * @brief Metrics exported by the STUN server
+ */
+
+#include "metrics.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "config.h"
+#include "log.h"
+
+using namespace std;
+
+static pthread_mutex_t writers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static vector<metrics_writer_t> writers;
+
+void metrics_add(atomic<uint64_t>* counter, uint64_t value) {
+    counter->store(counter->load(memory_order_relaxed) + value,
+                   memory_order_relaxed);
+}
+
+void metrics_observe(metrics_histogram_t* histogram, uint64_t ns) {
+    // Bucket i holds durations of at most 2^i us
+    uint64_t us = ns / 1000;
+    int bucket = us <= 1 ? 0 : 64 - __builtin_clzll(us - 1);
+    if (bucket > METRICS_HISTOGRAM_BUCKETS - 1) {
+        bucket = METRICS_HISTOGRAM_BUCKETS - 1;
+    }
+    metrics_add(&histogram->buckets[bucket], 1);
+    metrics_add(&histogram->count, 1);
+    metrics_add(&histogram->sum_ns, ns);
+}
+
+void metrics_register(metrics_writer_t writer) {
+    pthread_mutex_lock(&writers_mutex);
+    writers.push_back(writer);
+    pthread_mutex_unlock(&writers_mutex);
+}
+
+void metrics_write_counter(FILE* f, const char* name, const char* help,
+                           uint64_t value) {
+    fprintf(f, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", name, help, name,
+            name, (unsigned long long)value);
+}
+
+void metrics_write_gauge(FILE* f, const char* name, const char* help,
+                         double value) {
+    fprintf(f, "# HELP %s %s\n# TYPE %s gauge\n%s %.17g\n", name, help, name,
+            name, value);
+}
+
+void metrics_write_histogram(FILE* f, const char* name, const char* help,
+                             const metrics_histogram_t* const* histograms,
+                             int count) {
+    fprintf(f, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    uint64_t cumulative = 0;
+    for (int bucket = 0; bucket < METRICS_HISTOGRAM_BUCKETS; bucket++) {
+        for (int i = 0; i < count; i++) {
+            cumulative +=
+                histograms[i]->buckets[bucket].load(memory_order_relaxed);
+        }
+        if (bucket < METRICS_HISTOGRAM_BUCKETS - 1) {
+            fprintf(f, "%s_bucket{le=\"%g\"} %llu\n", name,
+                    (1 << bucket) / 1000000.0, (unsigned long long)cumulative);
+        } else {
+            fprintf(f, "%s_bucket{le=\"+Inf\"} %llu\n", name,
+                    (unsigned long long)cumulative);
+        }
+    }
+    uint64_t total = 0, sum_ns = 0;
+    for (int i = 0; i < count; i++) {
+        total += histograms[i]->count.load(memory_order_relaxed);
+        sum_ns += histograms[i]->sum_ns.load(memory_order_relaxed);
+    }
+    fprintf(f, "%s_sum %.9f\n%s_count %llu\n", name, sum_ns / 1e9, name,
+            (unsigned long long)total);
+}
+
+static void* write_metrics(void* vargp) {
+    (void)vargp;
+    char tmp_file[4096];
+    snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", config.metrics_file);
+    while (true) {
+        sleep(config.metrics_interval);
+
+        // Write to a temporary file first, so that scrapers never see a
+        // partially written file
+        FILE* f = fopen(tmp_file, "w");
+        if (!f) {
+            log("Failed to open %s: %s\n", tmp_file, strerror(errno));
+            continue;
+        }
+        pthread_mutex_lock(&writers_mutex);
+        for (metrics_writer_t writer : writers) {
+            writer(f);
+        }
+        pthread_mutex_unlock(&writers_mutex);
+        if (fclose(f) != 0 || rename(tmp_file, config.metrics_file) < 0) {
+            log("Failed to write %s: %s\n", config.metrics_file,
+                strerror(errno));
+        }
+    }
+    return NULL;
+}
+
+int metrics_start() {
+    if (!config.metrics_file || config.metrics_file[0] == '\0') {
+        return 0;
+    }
+    pthread_t thread_id;
+    if (pthread_create(&thread_id, NULL, write_metrics, NULL) != 0) {
+        log("Failed to start the metrics thread\n");
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,134 @@
+#ifndef STUN_SERVER_METRICS_H
+#define STUN_SERVER_METRICS_H
+/**
+ * Copyright Fractal Computers, Inc. 2021
+ * @file metrics.h
+ * @brief Metrics exported by the STUN server
+============================
+Usage
+============================
+
+Every part of the server keeps its own counters and registers a writer with
+metrics_register(). Once metrics_start() has been called, a background thread
+periodically calls every writer and atomically replaces config.metrics_file
+with their output, in the Prometheus text format, e.g. for node_exporter's
+textfile collector.
+
+Counters and histograms that are only ever updated by one thread should use
+metrics_add() and metrics_observe(), which don't need atomic read-modify-write
+instructions.
+*/
+
+/*
+============================
+Includes
+============================
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+
+/*
+============================
+Defines
+============================
+*/
+
+// Latency histogram buckets are powers of two from 1us to 2^(N-2)us, plus
+// +Inf
+#define METRICS_HISTOGRAM_BUCKETS 18
+
+/*
+============================
+Custom Types
+============================
+*/
+
+typedef struct {
+    std::atomic<uint64_t> buckets[METRICS_HISTOGRAM_BUCKETS];
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum_ns;
+} metrics_histogram_t;
+
+// Writes some metrics to f with the metrics_write_* functions
+typedef void (*metrics_writer_t)(FILE* f);
+
+/*
+============================
+Public Functions
+============================
+*/
+
+/**
+ * @brief                          Add to a counter only ever updated by the
+ *                                 calling thread
+ *
+ * @param counter                  The counter
+ * @param value                    The value to add
+ */
+void metrics_add(std::atomic<uint64_t>* counter, uint64_t value);
+
+/**
+ * @brief                          Record a duration in a histogram only ever
+ *                                 updated by the calling thread
+ *
+ * @param histogram                The histogram
+ * @param ns                       The duration in nanoseconds
+ */
+void metrics_observe(metrics_histogram_t* histogram, uint64_t ns);
+
+/**
+ * @brief                          Register a writer, called every time the
+ *                                 metrics file is written
+ *
+ * @param writer                   The writer
+ */
+void metrics_register(metrics_writer_t writer);
+
+/**
+ * @brief                          Start the thread writing the metrics file,
+ *                                 if config.metrics_file is set
+ *
+ * @returns                        0 on success, -1 on failure
+ */
+int metrics_start();
+
+/**
+ * @brief                          Write a counter
+ *
+ * @param f                        The metrics file
+ * @param name                     Name of the metric
+ * @param help                     Description of the metric
+ * @param value                    Value of the counter
+ */
+void metrics_write_counter(FILE* f, const char* name, const char* help,
+                           uint64_t value);
+
+/**
+ * @brief                          Write a gauge
+ *
+ * @param f                        The metrics file
+ * @param name                     Name of the metric
+ * @param help                     Description of the metric
+ * @param value                    Value of the gauge
+ */
+void metrics_write_gauge(FILE* f, const char* name, const char* help,
+                         double value);
+
+/**
+ * @brief                          Write the sum of several histograms of
+ *                                 durations, in seconds
+ *
+ * @param f                        The metrics file
+ * @param name                     Name of the metric
+ * @param help                     Description of the metric
+ * @param histograms               The histograms to sum
+ * @param count                    Number of histograms
+ */
+void metrics_write_histogram(FILE* f, const char* name, const char* help,
+                             const metrics_histogram_t* const* histograms,
+                             int count);
+
+#endif  // STUN_SERVER_METRICS_H
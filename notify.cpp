@@ -0,0 +1,243 @@
+/**
+ * Copyright Fractal Computers, Inc. 2021
+ * @file notify.cpp
+ * @brief Reliable notifications of servers about the clients that want them
+ */
+
+#include "notify.h"
+
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+
+#include "clock.h"
+#include "log.h"
+#include "metrics.h"
+#include "slab.h"
+
+using namespace std;
+
+// How often the timer looks for notifications to retransmit
+#define NOTIFY_TICK_MS 10
+
+typedef struct {
+    stun_v2_header_t header;
+    stun_v2_record_t record;
+} notification_t;
+
+typedef struct pending {
+    notification_t notification;
+    struct sockaddr_in server;
+    int s;
+    // monotonic_ns() of the first transmission
+    uint64_t sent_ns;
+    // monotonic_ns() of the next retransmission
+    uint64_t retransmit_ns;
+    uint32_t retransmits;
+    struct pending* next;
+} pending_t;
+
+static pthread_mutex_t pending_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Chained hash table keyed by txid, with at least one bucket per pending
+// notification. Its nodes come from a slab pool
+static pending_t** buckets;
+static uint32_t bucket_mask;
+static slab_pool_t* pool;
+// Number of pending notifications, readable without the mutex
+static atomic<uint32_t> num_pending;
+static unsigned int capacity;
+static atomic<uint32_t> next_txid;
+
+// Updated from every worker
+static atomic<uint64_t> sent;
+static atomic<uint64_t> untracked;
+// Updated under pending_mutex
+static atomic<uint64_t> retransmitted;
+static atomic<uint64_t> acked;
+static atomic<uint64_t> lost;
+static metrics_histogram_t ack_latency;
+
+static pending_t** bucket_of(uint32_t txid) {
+    return &buckets[(txid * 0x9e3779b9) >> 16 & bucket_mask];
+}
+
+// Unlinks *link and frees it. Must hold pending_mutex
+static void forget(pending_t** link) {
+    pending_t* notification = *link;
+    *link = notification->next;
+    slab_free(pool, notification);
+    num_pending.fetch_sub(1, memory_order_relaxed);
+}
+
+static void send_notification(const pending_t* notification) {
+    sendto(notification->s, &notification->notification,
+           sizeof(notification->notification), MSG_NOSIGNAL,
+           (const struct sockaddr*)&notification->server,
+           sizeof(notification->server));
+}
+
+static void* notify_timer(void* vargp) {
+    (void)vargp;
+    while (true) {
+        usleep(NOTIFY_TICK_MS * 1000);
+        if (num_pending.load(memory_order_relaxed) == 0) {
+            continue;
+        }
+
+        uint64_t now_ns = monotonic_ns();
+        pthread_mutex_lock(&pending_mutex);
+        for (uint32_t i = 0; i <= bucket_mask; i++) {
+            for (pending_t** link = &buckets[i]; *link;) {
+                pending_t* notification = *link;
+                if (notification->retransmit_ns > now_ns) {
+                    link = &notification->next;
+                    continue;
+                }
+                if (notification->retransmits == NOTIFY_MAX_RETRANSMITS) {
+                    log("Server %s:%d never acknowledged notification %u\n",
+                        inet_ntoa(notification->server.sin_addr),
+                        ntohs(notification->server.sin_port),
+                        notification->notification.header.txid);
+                    metrics_add(&lost, 1);
+                    forget(link);
+                    continue;
+                }
+                // The record's arg tells the server which transmission this
+                // is
+                notification->retransmits++;
+                notification->notification.record.arg =
+                    htonl(notification->retransmits);
+                notification->retransmit_ns =
+                    now_ns + (NOTIFY_INITIAL_RTO_MS * 1000000ULL
+                              << notification->retransmits);
+                send_notification(notification);
+                metrics_add(&retransmitted, 1);
+                link = &notification->next;
+            }
+        }
+        pthread_mutex_unlock(&pending_mutex);
+    }
+    return NULL;
+}
+
+static void write_notify_metrics(FILE* f) {
+    metrics_write_gauge(f, "stun_notifications_pending",
+                        "Notifications awaiting their ACK",
+                        num_pending.load(memory_order_relaxed));
+    metrics_write_counter(f, "stun_notifications_sent_total",
+                          "Notifications sent to servers that acknowledge "
+                          "them, first transmissions only",
+                          sent.load(memory_order_relaxed));
+    metrics_write_counter(f, "stun_notifications_retransmitted_total",
+                          "Retransmissions of unacknowledged notifications",
+                          retransmitted.load(memory_order_relaxed));
+    metrics_write_counter(f, "stun_notifications_acked_total",
+                          "Notifications acknowledged by their server",
+                          acked.load(memory_order_relaxed));
+    metrics_write_counter(f, "stun_notifications_lost_total",
+                          "Notifications never acknowledged by their server",
+                          lost.load(memory_order_relaxed));
+    metrics_write_counter(f, "stun_notifications_untracked_total",
+                          "Notifications sent only once as too many were "
+                          "pending already",
+                          untracked.load(memory_order_relaxed));
+    const metrics_histogram_t* histograms[] = {&ack_latency};
+    metrics_write_histogram(f, "stun_notification_ack_seconds",
+                            "Time from the first transmission of a "
+                            "notification to its ACK",
+                            histograms, 1);
+}
+
+int notify_init(unsigned int max_pending) {
+    capacity = max_pending;
+    uint32_t num_buckets = 1;
+    while (num_buckets < capacity) {
+        num_buckets *= 2;
+    }
+    buckets = new pending_t*[num_buckets]();
+    bucket_mask = num_buckets - 1;
+    pool = slab_create("notifications", sizeof(pending_t), capacity);
+    if (!pool) {
+        return -1;
+    }
+
+    // Random txids keep a restarted process from taking the ACKs meant for
+    // its predecessor
+    uint32_t txid;
+    if (getrandom(&txid, sizeof(txid), 0) != sizeof(txid)) {
+        txid = (uint32_t)monotonic_ns() ^ (uint32_t)getpid();
+    }
+    next_txid = txid;
+
+    pthread_t thread_id;
+    if (pthread_create(&thread_id, NULL, notify_timer, NULL) != 0) {
+        log("Failed to start the notifications timer\n");
+        return -1;
+    }
+    metrics_register(write_notify_metrics);
+    return 0;
+}
+
+void notify_server(int s, const struct sockaddr_in* server,
+                   const stun_v2_record_t* notification) {
+    pending_t entry;
+    uint32_t txid = next_txid.fetch_add(1, memory_order_relaxed);
+    entry.notification.header.magic = htons(STUN_V2_MAGIC);
+    entry.notification.header.version = STUN_V2_VERSION;
+    entry.notification.header.num_records = 1;
+    entry.notification.header.txid = txid;
+    entry.notification.record = *notification;
+    entry.notification.record.arg = 0;
+    entry.server = *server;
+    entry.s = s;
+    entry.sent_ns = monotonic_ns();
+    entry.retransmit_ns = entry.sent_ns + NOTIFY_INITIAL_RTO_MS * 1000000ULL;
+    entry.retransmits = 0;
+
+    // Tracked before it is sent, so that an early ACK finds it
+    pthread_mutex_lock(&pending_mutex);
+    pending_t* tracked = NULL;
+    if (num_pending.load(memory_order_relaxed) < capacity) {
+        tracked = (pending_t*)slab_alloc(pool);
+    }
+    if (tracked) {
+        pending_t** bucket = bucket_of(txid);
+        *tracked = entry;
+        tracked->next = *bucket;
+        *bucket = tracked;
+        num_pending.fetch_add(1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&pending_mutex);
+
+    send_notification(&entry);
+    (tracked ? sent : untracked).fetch_add(1, memory_order_relaxed);
+}
+
+bool notify_ack(uint32_t txid, const struct sockaddr_in* from) {
+    if (num_pending.load(memory_order_relaxed) == 0) {
+        return false;
+    }
+
+    bool found = false;
+    pthread_mutex_lock(&pending_mutex);
+    for (pending_t** link = bucket_of(txid); *link; link = &(*link)->next) {
+        pending_t* notification = *link;
+        if (notification->notification.header.txid == txid &&
+            notification->server.sin_addr.s_addr == from->sin_addr.s_addr &&
+            notification->server.sin_port == from->sin_port) {
+            metrics_observe(&ack_latency,
+                            monotonic_ns() - notification->sent_ns);
+            metrics_add(&acked, 1);
+            forget(link);
+            found = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pending_mutex);
+    return found;
+}
@@ -0,0 +1,83 @@
+#ifndef STUN_SERVER_NOTIFY_H
+#define STUN_SERVER_NOTIFY_H
+/**
+ * Copyright Fractal Computers, Inc. 2021
+ * @file notify.h
+ * @brief Reliable notifications of servers about the clients that want them
+============================
+Usage
+============================
+
+Call notify_init() once at startup. notify_server() then sends a
+STUN_V2_NOTIFY record to a server that registered with STUN_V2_POST_RELIABLE,
+and keeps it in a pending table until notify_ack() is called with its txid.
+A timer retransmits the pending notifications with an exponential back-off,
+and gives up on them after NOTIFY_MAX_RETRANSMITS retransmissions.
+
+The table is bounded: once it is full, notifications are still sent, but only
+once.
+*/
+
+/*
+============================
+Includes
+============================
+*/
+
+#include <netinet/in.h>
+#include <stdint.h>
+
+#include "stun.h"
+
+/*
+============================
+Defines
+============================
+*/
+
+// Delay before the first retransmission, doubled for every following one
+#define NOTIFY_INITIAL_RTO_MS 100
+#define NOTIFY_MAX_RETRANSMITS 5
+// Most notifications awaiting their ACK at once
+#define NOTIFY_MAX_PENDING 4096
+
+/*
+============================
+Public Functions
+============================
+*/
+
+/**
+ * @brief                          Set up the pending table and start its
+ *                                 timer
+ *
+ * @param max_pending              Most notifications awaiting their ACK at
+ *                                 once
+ *
+ * @returns                        0 on success, -1 on failure
+ */
+int notify_init(unsigned int max_pending);
+
+/**
+ * @brief                          Send a notification, and retransmit it
+ *                                 until the server acknowledges it
+ *
+ * @param s                        UDP socket to send the notification with
+ * @param server                   Address of the server
+ * @param notification             The STUN_V2_NOTIFY record
+ */
+void notify_server(int s, const struct sockaddr_in* server,
+                   const stun_v2_record_t* notification);
+
+/**
+ * @brief                          Stop retransmitting a notification
+ *
+ * @param txid                     txid of the notification, as sent
+ * @param from                     Address the ACK came from, which must be
+ *                                 the notified server
+ *
+ * @returns                        True if the notification was pending
+ */
+bool notify_ack(uint32_t txid, const struct sockaddr_in* from);
+
+#endif  // STUN_SERVER_NOTIFY_H
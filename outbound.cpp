@@ -0,0 +1,298 @@
+/**
+ * Copyright Fractal Computers, Inc. 2021
+ * @file outbound.cpp
+ * @brief Writes to TCP connections that never block the caller
+ */
+
+#include "outbound.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+
+#include "clock.h"
+#include "log.h"
+#include "metrics.h"
+#include "slab.h"
+
+using namespace std;
+
+// How often the flusher looks for queues stalled past OUTBOUND_TIMEOUT_MS
+#define OUTBOUND_TICK_MS 100
+// Locks guarding the queues, that of socket s being locks[s % OUTBOUND_LOCKS]
+#define OUTBOUND_LOCKS 64
+#define OUTBOUND_MAX_SOCKETS (1 << 20)
+#define OUTBOUND_MAX_EVENTS 64
+
+typedef struct {
+    // monotonic_ns() of when the queue was created or last sent something
+    uint64_t progress_ns;
+    int length;
+    uint8_t data[OUTBOUND_HIGH_WATER];
+} outbound_queue_t;
+
+typedef struct {
+    // NULL when nothing is queued
+    outbound_queue_t* queue;
+    // What outbound_open() was given, for the closed callback
+    void* context;
+    // The connection's thread, the registry and the clients it was handed to
+    uint32_t references;
+} outbound_socket_t;
+
+static pthread_mutex_t locks[OUTBOUND_LOCKS];
+// Every open connection, indexed by socket
+static outbound_socket_t* sockets;
+static int max_sockets;
+static void (*closed)(void* context);
+// Highest socket ever queued for, which bounds the scans for stalled queues
+static atomic<int> highest_socket;
+static slab_pool_t* pool;
+static int epoll_fd;
+
+static atomic<uint32_t> num_queues;
+// Updated under different locks
+static atomic<uint64_t> queued;
+static atomic<uint64_t> dropped;
+static atomic<uint64_t> timeouts;
+
+// Sends what the socket takes of a queue, and returns false if the connection
+// failed. Must hold the socket's lock
+static bool flush(int s, outbound_queue_t* queue) {
+    while (queue->length > 0) {
+        ssize_t sent =
+            send(s, queue->data, queue->length, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        memmove(queue->data, queue->data + sent, queue->length - sent);
+        queue->length -= sent;
+        queue->progress_ns = monotonic_ns();
+    }
+    return true;
+}
+
+// Frees the queue of a socket and stops watching it. Must hold its lock
+static void release(int s) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, s, NULL);
+    slab_free(pool, sockets[s].queue);
+    sockets[s].queue = NULL;
+    num_queues.fetch_sub(1, memory_order_relaxed);
+}
+
+// Has the flusher wake up once the socket takes more
+static void watch(int s, int op) {
+    struct epoll_event event;
+    event.events = EPOLLOUT | EPOLLONESHOT;
+    event.data.fd = s;
+    epoll_ctl(epoll_fd, op, s, &event);
+}
+
+// Shuts down the connections whose queue made no progress for too long, so
+// that their peers reconnect. Their threads then see them hang up and let go
+// of them, which closes them once the registry did too
+static void shut_stalled_down(uint64_t now_ns) {
+    int highest = highest_socket.load(memory_order_relaxed);
+    for (int s = 0; s <= highest; s++) {
+        pthread_mutex_t* lock = &locks[s % OUTBOUND_LOCKS];
+        pthread_mutex_lock(lock);
+        outbound_queue_t* queue = sockets[s].queue;
+        if (queue &&
+            now_ns - queue->progress_ns > OUTBOUND_TIMEOUT_MS * 1000000ULL) {
+            shutdown(s, SHUT_RDWR);
+            release(s);
+            timeouts.fetch_add(1, memory_order_relaxed);
+        }
+        pthread_mutex_unlock(lock);
+    }
+}
+
+static void* outbound_flusher(void* vargp) {
+    (void)vargp;
+    struct epoll_event events[OUTBOUND_MAX_EVENTS];
+    uint64_t next_scan_ns = 0;
+    while (true) {
+        int ready = epoll_wait(epoll_fd, events, OUTBOUND_MAX_EVENTS,
+                               OUTBOUND_TICK_MS);
+        for (int i = 0; i < ready; i++) {
+            int s = events[i].data.fd;
+            pthread_mutex_t* lock = &locks[s % OUTBOUND_LOCKS];
+            pthread_mutex_lock(lock);
+            outbound_queue_t* queue = sockets[s].queue;
+            if (queue) {
+                if (!flush(s, queue) || queue->length == 0) {
+                    release(s);
+                } else {
+                    watch(s, EPOLL_CTL_MOD);
+                }
+            }
+            pthread_mutex_unlock(lock);
+        }
+
+        uint64_t now_ns = monotonic_ns();
+        if (now_ns >= next_scan_ns &&
+            num_queues.load(memory_order_relaxed) > 0) {
+            shut_stalled_down(now_ns);
+            next_scan_ns = now_ns + OUTBOUND_TICK_MS * 1000000ULL;
+        }
+    }
+    return NULL;
+}
+
+static void write_outbound_metrics(FILE* f) {
+    metrics_write_gauge(f, "stun_tcp_write_queues",
+                        "TCP connections with bytes waiting to be sent",
+                        num_queues.load(memory_order_relaxed));
+    metrics_write_counter(f, "stun_tcp_writes_queued_total",
+                          "Messages to TCP connections queued as their "
+                          "socket was full",
+                          queued.load(memory_order_relaxed));
+    metrics_write_counter(f, "stun_tcp_writes_dropped_total",
+                          "Messages to TCP connections dropped as their "
+                          "queue was full",
+                          dropped.load(memory_order_relaxed));
+    metrics_write_counter(f, "stun_tcp_write_timeouts_total",
+                          "TCP connections shut down as their queue "
+                          "stalled",
+                          timeouts.load(memory_order_relaxed));
+}
+
+int outbound_init(unsigned int max_queues, void (*on_closed)(void* context)) {
+    struct rlimit limit;
+    max_sockets = OUTBOUND_MAX_SOCKETS;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+        limit.rlim_cur < (rlim_t)max_sockets) {
+        max_sockets = (int)limit.rlim_cur;
+    }
+    sockets = new outbound_socket_t[max_sockets]();
+    closed = on_closed;
+    for (int i = 0; i < OUTBOUND_LOCKS; i++) {
+        pthread_mutex_init(&locks[i], NULL);
+    }
+    pool = slab_create("tcp_write_queues", sizeof(outbound_queue_t),
+                       max_queues);
+    if (!pool) {
+        return -1;
+    }
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        log("Failed to create the TCP write epoll: %s\n", strerror(errno));
+        return -1;
+    }
+
+    pthread_t thread_id;
+    if (pthread_create(&thread_id, NULL, outbound_flusher, NULL) != 0) {
+        log("Failed to start the TCP write flusher\n");
+        return -1;
+    }
+    metrics_register(write_outbound_metrics);
+    return 0;
+}
+
+void outbound_send(int s, const void* data, int size) {
+    if (s < 0 || s >= max_sockets) {
+        send(s, data, size, MSG_DONTWAIT | MSG_NOSIGNAL);
+        return;
+    }
+    pthread_mutex_t* lock = &locks[s % OUTBOUND_LOCKS];
+    pthread_mutex_lock(lock);
+    outbound_queue_t* queue = sockets[s].queue;
+    if (queue) {
+        // Behind what is queued already, whole or not at all
+        if (queue->length + size > OUTBOUND_HIGH_WATER) {
+            dropped.fetch_add(1, memory_order_relaxed);
+        } else {
+            memcpy(queue->data + queue->length, data, size);
+            queue->length += size;
+            queued.fetch_add(1, memory_order_relaxed);
+        }
+        pthread_mutex_unlock(lock);
+        return;
+    }
+
+    // Nothing is queued, so the message can go straight to the socket
+    int sent = 0;
+    while (sent < size) {
+        ssize_t just_sent = send(s, (const uint8_t*)data + sent, size - sent,
+                                 MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (just_sent < 0 && errno != EINTR) {
+            break;
+        }
+        sent += just_sent > 0 ? just_sent : 0;
+    }
+    if (sent == size || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+        pthread_mutex_unlock(lock);
+        return;
+    }
+
+    queue = (outbound_queue_t*)slab_alloc(pool);
+    if (!queue) {
+        // The rest of the message can't be dropped without garbling the
+        // stream, so the connection goes
+        if (sent > 0) {
+            shutdown(s, SHUT_RDWR);
+        }
+        dropped.fetch_add(1, memory_order_relaxed);
+        pthread_mutex_unlock(lock);
+        return;
+    }
+    queue->progress_ns = monotonic_ns();
+    queue->length = size - sent;
+    memcpy(queue->data, (const uint8_t*)data + sent, queue->length);
+    sockets[s].queue = queue;
+    num_queues.fetch_add(1, memory_order_relaxed);
+    queued.fetch_add(1, memory_order_relaxed);
+    int highest = highest_socket.load(memory_order_relaxed);
+    while (s > highest && !highest_socket.compare_exchange_weak(
+                              highest, s, memory_order_relaxed)) {
+    }
+    watch(s, EPOLL_CTL_ADD);
+    pthread_mutex_unlock(lock);
+}
+
+int outbound_open(int s, void* context) {
+    if (s < 0 || s >= max_sockets) {
+        log("TCP socket %d is past the %d the process may open\n", s,
+            max_sockets);
+        return -1;
+    }
+    pthread_mutex_t* lock = &locks[s % OUTBOUND_LOCKS];
+    pthread_mutex_lock(lock);
+    sockets[s].context = context;
+    sockets[s].references = 1;
+    pthread_mutex_unlock(lock);
+    return 0;
+}
+
+void outbound_hold(int s) {
+    pthread_mutex_t* lock = &locks[s % OUTBOUND_LOCKS];
+    pthread_mutex_lock(lock);
+    sockets[s].references++;
+    pthread_mutex_unlock(lock);
+}
+
+void outbound_release(int s) {
+    pthread_mutex_t* lock = &locks[s % OUTBOUND_LOCKS];
+    pthread_mutex_lock(lock);
+    if (--sockets[s].references == 0) {
+        // Nothing can send to it anymore, so what is queued would never
+        // reach anyone. Closed with the lock held, so that the next
+        // connection given the same descriptor finds it unused
+        if (sockets[s].queue) {
+            release(s);
+        }
+        close(s);
+        closed(sockets[s].context);
+        sockets[s].context = NULL;
+    }
+    pthread_mutex_unlock(lock);
+}
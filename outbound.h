@@ -0,0 +1,101 @@
+#ifndef STUN_SERVER_OUTBOUND_H
+#define STUN_SERVER_OUTBOUND_H
+/**
+ * Copyright Fractal Computers, Inc. 2021
+ * @file outbound.h
+ * @brief Writes to TCP connections that never block the caller
+============================
+Usage
+============================
+
+Call outbound_init() once at startup. Every write to an accepted TCP
+connection, be it a response or the notification of a server parked in the
+registry, then goes through outbound_send(), from any thread. What the socket
+doesn't take at once is queued, and a thread watching the queued sockets for
+EPOLLOUT sends the rest as their peers read it, so that a peer whose receive
+window is full never stalls a worker.
+
+A queue holds at most OUTBOUND_HIGH_WATER bytes: past that, further messages
+are dropped whole, so that the stream stays made of complete messages. A
+connection whose queue didn't drain at all for OUTBOUND_TIMEOUT_MS is shut
+down, and its queue freed. Its thread then sees it hang up, so it is closed as
+soon as the registry lets go of it too.
+
+Connections are also closed here, as several threads may write to one: call
+outbound_open() once it's accepted, with a reference held by its thread. The
+registry holds another while the connection is parked, and so does a client
+it is handed to until the notification is sent, with outbound_hold(). Every
+holder lets go with outbound_release(), and the last one closes the socket,
+dropping what is still queued, so that nothing is ever sent to the next
+connection with the same descriptor.
+*/
+
+/*
+============================
+Defines
+============================
+*/
+
+// Most bytes queued for one connection
+#define OUTBOUND_HIGH_WATER 2048
+// How long a connection's queue may stall before the connection is shut down
+#define OUTBOUND_TIMEOUT_MS 5000
+
+/*
+============================
+Public Functions
+============================
+*/
+
+/**
+ * @brief                          Set up the queues and start the thread
+ *                                 flushing them
+ *
+ * @param max_queues               Most connections with bytes queued at once
+ * @param closed                   Called with the context of every
+ *                                 connection once it's closed, from the
+ *                                 thread letting go of it last
+ *
+ * @returns                        0 on success, -1 on failure
+ */
+int outbound_init(unsigned int max_queues, void (*closed)(void* context));
+
+/**
+ * @brief                          Start tracking an accepted connection, with
+ *                                 a single reference to it
+ *
+ * @param s                        The connection's socket
+ * @param context                  Passed to the closed callback
+ *
+ * @returns                        0 on success, -1 if the socket is past the
+ *                                 descriptors the process may open
+ */
+int outbound_open(int s, void* context);
+
+/**
+ * @brief                          Send a message over a TCP connection, or
+ *                                 queue what doesn't fit in its socket
+ *
+ * @param s                        The connection's socket
+ * @param data                     The message
+ * @param size                     Its size
+ */
+void outbound_send(int s, const void* data, int size);
+
+/**
+ * @brief                          Take another reference to a connection,
+ *                                 keeping it open
+ *
+ * @param s                        The connection's socket
+ */
+void outbound_hold(int s);
+
+/**
+ * @brief                          Let go of a reference to a connection, and
+ *                                 close it if it was the last
+ *
+ * @param s                        The connection's socket
+ */
+void outbound_release(int s);
+
+#endif  // STUN_SERVER_OUTBOUND_H
@@ -0,0 +1,130 @@
+/**
+ * Copyright Fractal Computers, Inc. 2021
+ * @file predict.cpp
+ * @brief Prediction of the next ports a symmetric NAT will allocate
+ */
+
+#include "predict.h"
+
+#include <arpa/inet.h>
+#include <sched.h>
+#include <stdlib.h>
+
+#include <atomic>
+
+using namespace std;
+
+typedef struct {
+    // Held while the slot is read or written, the critical sections are a
+    // few dozen instructions long
+    atomic<bool> busy;
+    uint32_t ip;
+    double last_seen;
+    // Ring of the last source ports seen from ip, host byte order
+    uint16_t ports[PREDICT_HISTORY];
+    // Where the next port goes in ports
+    uint8_t head;
+    uint8_t size;
+} predict_slot_t;
+
+static predict_slot_t slots[PREDICT_SLOTS];
+
+static predict_slot_t* slot_of(uint32_t ip) {
+    uint32_t h = ip;
+    h ^= h >> 16;
+    h *= 0x45d9f3b;
+    h ^= h >> 16;
+    return &slots[h % PREDICT_SLOTS];
+}
+
+static void lock(predict_slot_t* slot) {
+    for (int spins = 1; slot->busy.exchange(true, memory_order_acquire);
+         spins++) {
+        if (spins % 1024 == 0) {
+            sched_yield();
+        }
+    }
+}
+
+static void unlock(predict_slot_t* slot) {
+    slot->busy.store(false, memory_order_release);
+}
+
+void predict_observe(uint32_t ip, uint16_t port, double now) {
+    predict_slot_t* slot = slot_of(ip);
+    lock(slot);
+    // Another IP, or a history too old to mean anything, starts over
+    if (slot->ip != ip || now - slot->last_seen > PREDICT_WINDOW_SECONDS) {
+        slot->ip = ip;
+        slot->head = 0;
+        slot->size = 0;
+    }
+    slot->last_seen = now;
+
+    // Requests sent through the same mapping tell nothing new
+    uint16_t host_port = ntohs(port);
+    uint8_t last = (slot->head + PREDICT_HISTORY - 1) % PREDICT_HISTORY;
+    if (slot->size == 0 || slot->ports[last] != host_port) {
+        slot->ports[slot->head] = host_port;
+        slot->head = (slot->head + 1) % PREDICT_HISTORY;
+        if (slot->size < PREDICT_HISTORY) {
+            slot->size++;
+        }
+    }
+    unlock(slot);
+}
+
+bool predict_ports(uint32_t ip, double now, predict_result_t* out) {
+    uint16_t ports[PREDICT_HISTORY];
+    int size = 0;
+    predict_slot_t* slot = slot_of(ip);
+    lock(slot);
+    if (slot->ip == ip && slot->size > 0 &&
+        now - slot->last_seen <= PREDICT_WINDOW_SECONDS) {
+        // Oldest first
+        size = slot->size;
+        int first = (slot->head + PREDICT_HISTORY - size) % PREDICT_HISTORY;
+        for (int i = 0; i < size; i++) {
+            ports[i] = slot->ports[(first + i) % PREDICT_HISTORY];
+        }
+    }
+    unlock(slot);
+    if (size == 0) {
+        return false;
+    }
+
+    // The stride is the most frequent difference between two consecutive
+    // ports, the most recent one winning ties. If none repeats, other hosts
+    // behind the NAT took ports in between, and the smallest difference is
+    // the best guess
+    int16_t deltas[PREDICT_HISTORY];
+    int num_deltas = size - 1;
+    for (int i = 0; i < num_deltas; i++) {
+        deltas[i] = (int16_t)(uint16_t)(ports[i + 1] - ports[i]);
+    }
+    int16_t stride = 0;
+    int best_count = 0;
+    for (int i = 0; i < num_deltas; i++) {
+        int count = 0;
+        for (int j = 0; j < num_deltas; j++) {
+            count += deltas[j] == deltas[i];
+        }
+        if (count >= best_count) {
+            best_count = count;
+            stride = deltas[i];
+        }
+    }
+    if (best_count == 1) {
+        for (int i = 0; i < num_deltas; i++) {
+            if (abs(deltas[i]) < abs(stride)) {
+                stride = deltas[i];
+            }
+        }
+    }
+
+    out->last_port = htons(ports[size - 1]);
+    out->stride = stride;
+    // A NAT that keeps its ports has only one guess worth trying
+    out->count = stride == 0 ? 1 : PREDICT_MAX_PORTS;
+    return true;
+}
@@ -0,0 +1,87 @@
+#ifndef STUN_SERVER_PREDICT_H
+#define STUN_SERVER_PREDICT_H
+/**
+ * Copyright Fractal Computers, Inc. 2021
+ * @file predict.h
+ * @brief Prediction of the next ports a symmetric NAT will allocate
+============================
+Usage
+============================
+
+Call predict_observe() with the source of every UDP request, then
+predict_ports() to guess the next ports the NAT in front of an IP will hand
+out. A symmetric NAT allocates a new port for every destination, usually
+`stride` after the previous one, so the history of the source ports seen from
+an IP gives away where its next mapping will be, unless other hosts behind
+the same NAT took those ports in the meantime.
+
+The history is a direct-mapped cache of PREDICT_SLOTS IPs, safe to use from
+any thread.
+*/
+
+/*
+============================
+Includes
+============================
+*/
+
+#include <stdint.h>
+
+/*
+============================
+Defines
+============================
+*/
+
+#define PREDICT_SLOTS (1 << 16)
+// Source ports remembered per IP
+#define PREDICT_HISTORY 8
+// A history older than this says nothing about the NAT's next allocation
+#define PREDICT_WINDOW_SECONDS 10
+// Most ports predicted at once
+#define PREDICT_MAX_PORTS 8
+
+/*
+============================
+Custom Types
+============================
+*/
+
+typedef struct {
+    // Last source port seen from the IP, network byte order
+    uint16_t last_port;
+    // Difference between two consecutive allocations, 0 for a NAT that keeps
+    // the same port
+    int16_t stride;
+    // Number of ports predicted: last_port + i * stride for i in 1..count
+    uint8_t count;
+} predict_result_t;
+
+/*
+============================
+Public Functions
+============================
+*/
+
+/**
+ * @brief                          Record the source of a request
+ *
+ * @param ip                       Source IP, network byte order
+ * @param port                     Source port, network byte order
+ * @param now                      The current time()
+ */
+void predict_observe(uint32_t ip, uint16_t port, double now);
+
+/**
+ * @brief                          Predict the next ports the NAT of ip will
+ *                                 allocate
+ *
+ * @param ip                       The IP, network byte order
+ * @param now                      The current time()
+ * @param out                      Filled with the prediction
+ *
+ * @returns                        False if nothing recent was seen from ip
+ */
+bool predict_ports(uint32_t ip, double now, predict_result_t* out);
+
+#endif  // STUN_SERVER_PREDICT_H
@@ -0,0 +1,1189 @@
+/**
+ * Copyright Fractal Computers, Inc. 2021
+ * @file registry.cpp
+ * @brief The table of servers that have POST_INFO'd, looked up by ASK_INFO
+ */
+
+#include "registry.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include "clock.h"
+#include "filter.h"
+#include "log.h"
+#include "metrics.h"
+
+using namespace std;
+
+// "STUR", and bumped whenever the layout below changes, so that processes
+// built from different versions refuse to share a registry
+#define REGISTRY_MAGIC 0x53545552
+#define REGISTRY_VERSION 7
+
+// 0.0.0.0 never sends us anything, and neither does 255.255.255.255, so they
+// mark never-used and wiped slots
+#define REGISTRY_EMPTY_IP 0
+#define REGISTRY_WIPED_IP 0xffffffff
+
+// A registration is stored at most this many slots away from where its key
+// hashes to, so that lookups, and misses in particular, stay cheap however
+// full the table gets
+#define REGISTRY_MAX_PROBES 64
+
+// Fewest slots of a shard, so that it has at least one block of the filter
+// and one bucket of the per-IP counts
+#define REGISTRY_MIN_SHARD_SLOTS 16
+
+// How long to wait for the process creating a shared registry to set it up
+#define REGISTRY_ATTACH_TIMEOUT_MS 1000
+
+// How many times a reader retries a slot that keeps being written before
+// treating it as a miss
+#define REGISTRY_READ_RETRIES 100000
+
+// Counters of the membership filter per registration the table can hold, and
+// how many of them, all in the same cache line, each key sets. With both its
+// IP and ip:public_port counted, a full table still lets through less than 3%
+// of the ASK_INFOs for unregistered IPs
+#define REGISTRY_FILTER_COUNTERS 16
+#define REGISTRY_FILTER_HASHES 4
+#define REGISTRY_FILTER_BLOCK 64
+#define REGISTRY_FILTER_SATURATED 255
+
+// Slots the CLOCK hand passes on every POST_INFO. It wipes dead registrations,
+// so that their keys leave the filter even if nothing replaces them, and once
+// REGISTRY_EVICT_LOAD percent of the slots are taken evicts the live ones
+// that weren't used since its last pass
+#define REGISTRY_SWEEP_SLOTS 8
+#define REGISTRY_EVICT_LOAD 90
+
+// Percentage of the slots taken above which IPs are held to their quota.
+// Eviction starts later, so that a single IP can't churn everyone else's
+// registrations out of the table
+#define REGISTRY_QUOTA_LOAD 75
+
+// Slots per bucket of the per-IP counts. Each row of buckets is hashed
+// differently and an IP's count is the smallest of its buckets, so that a
+// small IP only looks big if it shares both buckets with big ones
+#define REGISTRY_SLOTS_PER_IP_BUCKET 4
+#define REGISTRY_IP_ROWS 2
+// Every thread only counts one of its lookups in this many in the per-IP
+// buckets, for as many hits, so that readers rarely write to them
+#define REGISTRY_HIT_SAMPLE 16
+
+// Expiry times are stored in ticks since the registry was created, which
+// wrap after 13 years
+#define REGISTRY_TICKS_PER_SECOND 10
+#define REGISTRY_TIMEOUT_TICKS \
+    (STUN_ENTRY_TIMEOUT * REGISTRY_TICKS_PER_SECOND / 1000)
+
+// Besides its flags, a handle is 0 for a registration over UDP. Otherwise it
+// holds the index of the process that parked the server's TCP socket, from 1
+// to REGISTRY_MAX_PROCESSES - 1, and the index of the socket in that
+// process's connection table
+#define REGISTRY_MAX_PROCESSES 128
+#define REGISTRY_HANDLE_PROCESS_SHIFT 23
+#define REGISTRY_HANDLE_CONNECTION_MASK \
+    ((1 << REGISTRY_HANDLE_PROCESS_SHIFT) - 1)
+#define REGISTRY_HANDLE_TCP_GO (1u << 30)
+#define REGISTRY_HANDLE_RELIABLE (1u << 31)
+#define REGISTRY_HANDLE_FLAGS \
+    (REGISTRY_HANDLE_TCP_GO | REGISTRY_HANDLE_RELIABLE)
+// Socket of a parked connection whose peer hung up
+#define REGISTRY_HUNG_UP INT32_MIN
+
+// A registration as stored in the table
+typedef struct {
+    // Keyed by entry.ip and entry.public_port
+    stun_entry_t entry;
+    // Tick after which the registration is dead
+    uint32_t expiry;
+    // REGISTRY_HANDLE_FLAGS, and the server's TCP socket if any
+    uint32_t handle;
+} registry_record_t;
+
+typedef struct {
+    // Odd while a writer is modifying the slot
+    atomic<uint32_t> seq;
+    // Set by the readers that find the registration and by refreshes,
+    // cleared by the CLOCK hand
+    atomic<uint32_t> referenced;
+    registry_record_t record;
+} registry_slot_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slot_size;
+    // Slots of all the shards
+    uint32_t capacity;
+    // time() the ticks count from
+    double epoch;
+    // Set once the creator has filled in the fields above
+    atomic<uint32_t> ready;
+    uint32_t shards;
+    uint32_t reserved[8];
+    // PIDs of the processes sharing the registry, indexed like the handles,
+    // 0 where there is none
+    atomic<int32_t> processes[REGISTRY_MAX_PROCESSES];
+} registry_header_t;
+
+// What the writers of a shard share, on a cache line of its own so that
+// workers writing to their own shards never touch the same one
+typedef struct {
+    // Thread ID holding the shard's writer lock, 0 when unlocked
+    atomic<int32_t> writer;
+    // Slot being modified by the writer, -1 when none
+    atomic<int32_t> dirty_slot;
+    // Next slot the CLOCK hand passes
+    uint32_t sweep_cursor;
+    // Slots holding a registration, live or dead
+    atomic<uint32_t> occupied;
+    uint32_t reserved[12];
+} registry_shard_state_t;
+
+// Counting Bloom filter over the IPs and ip:public_port keys held in the
+// slots, so that lookups of unregistered servers don't probe the table. The
+// counters of a key are all in one block, costing a single cache miss
+typedef struct {
+    atomic<uint8_t> counters[REGISTRY_FILTER_BLOCK];
+} registry_filter_block_t;
+
+// Registrations of the IPs hashing to a bucket, and about how many times they
+// were found, halved every time the CLOCK hand passes the bucket's slots
+typedef struct {
+    uint32_t registrations;
+    atomic<uint32_t> hits;
+} registry_ip_bucket_t;
+
+static_assert(sizeof(registry_record_t) == 16, "registry layout changed");
+static_assert(sizeof(registry_slot_t) == 24, "registry layout changed");
+static_assert(sizeof(registry_header_t) == 576, "registry layout changed");
+static_assert(sizeof(registry_shard_state_t) == 64, "registry layout changed");
+static_assert(sizeof(registry_filter_block_t) == REGISTRY_FILTER_BLOCK,
+              "registry layout changed");
+static_assert(atomic<uint32_t>::is_always_lock_free,
+              "the registry needs address-free atomics");
+
+// A shard as mapped in this process. Every IP belongs to a single shard,
+// with its own slots, filter, per-IP counts and writer lock, and its own
+// counters here, so that the writers of different shards share nothing
+typedef struct alignas(64) {
+    registry_shard_state_t* state;
+    registry_slot_t* slots;
+    registry_filter_block_t* filter;
+    registry_ip_bucket_t* ip_buckets[REGISTRY_IP_ROWS];
+    // Only updated with the shard's writer lock held
+    atomic<uint64_t> evictions;
+    atomic<uint64_t> quota_refusals;
+} registry_shard_t;
+
+static registry_header_t* header;
+static registry_shard_t* shards;
+static uint32_t num_shards;
+// Masks of the slots, filter blocks and per-IP buckets of a shard
+static uint32_t mask;
+static uint32_t filter_mask;
+static uint32_t ip_bucket_mask;
+static uint32_t ip_quota;
+static int32_t pid;
+// Index of this process in header->processes
+static uint32_t process;
+
+// The TCP connections this process parked, indexed by the handles, one per
+// connection whatever the number of registrations made over it. An entry in
+// use holds the connection's socket, or REGISTRY_HUNG_UP. A free entry holds
+// -2 - the index of the next free one, or -1 if it is the last. The free list
+// is shared by the writers of every shard
+static atomic<int32_t>* connections;
+// Registrations of this process referring to every entry in use
+static uint32_t* connection_registrations;
+static uint32_t num_connections;
+static pthread_mutex_t connections_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int32_t free_connection = -1;
+// Entries of connections never used yet
+static uint32_t never_used_connections;
+// The entry of every socket parked and not hung up, indexed by socket, plus 1
+static uint32_t* socket_connections;
+static uint32_t num_sockets;
+// See registry_init()
+static void (*hold_socket)(int tcp_socket, bool held);
+
+// Counts of the lookups of a thread, only ever updated by the thread itself,
+// so that lookups don't bounce a shared counter between the workers. Threads
+// link theirs into readers on their first lookup, and fold them into the
+// retired counts when they exit
+struct registry_reader {
+    atomic<uint64_t> filter_rejects;
+    atomic<uint64_t> filter_misses;
+    // Lookups that found a registration, see REGISTRY_HIT_SAMPLE
+    uint32_t hits;
+    registry_reader* next;
+    registry_reader();
+    ~registry_reader();
+};
+
+static pthread_mutex_t readers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static registry_reader* readers;
+static uint64_t retired_filter_rejects;
+static uint64_t retired_filter_misses;
+static thread_local registry_reader reader;
+
+registry_reader::registry_reader()
+    : filter_rejects(0), filter_misses(0), hits(0) {
+    pthread_mutex_lock(&readers_mutex);
+    next = readers;
+    readers = this;
+    pthread_mutex_unlock(&readers_mutex);
+}
+
+registry_reader::~registry_reader() {
+    pthread_mutex_lock(&readers_mutex);
+    registry_reader** link = &readers;
+    while (*link != this) {
+        link = &(*link)->next;
+    }
+    *link = next;
+    retired_filter_rejects += filter_rejects.load(memory_order_relaxed);
+    retired_filter_misses += filter_misses.load(memory_order_relaxed);
+    pthread_mutex_unlock(&readers_mutex);
+}
+
+static uint32_t fmix32(uint32_t h) {
+    // murmur3 finalizer, as IPs and ports are stored in network byte order
+    // and their low bits are the least random ones
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+static uint32_t hash_key(uint32_t ip, uint16_t public_port) {
+    // Consecutive ports of one IP land far apart
+    return fmix32(ip ^ fmix32(public_port));
+}
+
+static uint64_t fmix64(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// The shard of an IP is the worker its datagrams are steered to, so that a
+// worker only ever writes to the shard it owns
+static registry_shard_t* shard_of(uint32_t ip) {
+    return num_shards == 1 ? shards : &shards[steering_worker(ip, num_shards)];
+}
+
+// The filter holds an IP under the key ip:0 with a bit no port sets
+static uint64_t filter_hash(uint32_t ip, uint32_t public_port) {
+    return fmix64((uint64_t)ip << 32 | public_port);
+}
+
+static uint64_t filter_hash_ip(uint32_t ip) { return filter_hash(ip, 1 << 16); }
+
+static bool filter_test(registry_shard_t* shard, uint64_t h) {
+    registry_filter_block_t* block = &shard->filter[(h >> 32) & filter_mask];
+    for (int i = 0; i < REGISTRY_FILTER_HASHES; i++, h >>= 6) {
+        if (block->counters[h % REGISTRY_FILTER_BLOCK].load(
+                memory_order_relaxed) == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Must hold the shard's writer lock. Saturated counters stay put, they only
+// make the filter a little less selective
+static void filter_update(registry_shard_t* shard, uint64_t h, int delta) {
+    registry_filter_block_t* block = &shard->filter[(h >> 32) & filter_mask];
+    for (int i = 0; i < REGISTRY_FILTER_HASHES; i++, h >>= 6) {
+        atomic<uint8_t>* counter = &block->counters[h % REGISTRY_FILTER_BLOCK];
+        uint8_t value = counter->load(memory_order_relaxed);
+        if (value != REGISTRY_FILTER_SATURATED && value + delta >= 0) {
+            counter->store(value + delta, memory_order_relaxed);
+        }
+    }
+}
+
+static registry_ip_bucket_t* ip_bucket(registry_shard_t* shard, int row,
+                                       uint32_t ip) {
+    return &shard->ip_buckets[row][fmix32(ip + row * 0x9e3779b9) &
+                                   ip_bucket_mask];
+}
+
+// Keys are added before their slot is written and removed after it is
+// overwritten, so the filter never misses a key a reader could find. Must
+// hold the shard's writer lock
+static void key_added(registry_shard_t* shard, uint32_t ip,
+                      uint16_t public_port) {
+    filter_update(shard, filter_hash_ip(ip), 1);
+    filter_update(shard, filter_hash(ip, public_port), 1);
+    for (int row = 0; row < REGISTRY_IP_ROWS; row++) {
+        ip_bucket(shard, row, ip)->registrations++;
+    }
+    atomic<uint32_t>* occupied = &shard->state->occupied;
+    occupied->store(occupied->load(memory_order_relaxed) + 1,
+                    memory_order_relaxed);
+}
+
+static void key_removed(registry_shard_t* shard, uint32_t ip,
+                        uint16_t public_port) {
+    filter_update(shard, filter_hash_ip(ip), -1);
+    filter_update(shard, filter_hash(ip, public_port), -1);
+    for (int row = 0; row < REGISTRY_IP_ROWS; row++) {
+        registry_ip_bucket_t* bucket = ip_bucket(shard, row, ip);
+        if (bucket->registrations > 0) {
+            bucket->registrations--;
+        }
+    }
+    atomic<uint32_t>* occupied = &shard->state->occupied;
+    uint32_t value = occupied->load(memory_order_relaxed);
+    if (value > 0) {
+        occupied->store(value - 1, memory_order_relaxed);
+    }
+}
+
+static bool load_above(registry_shard_t* shard, uint32_t percent) {
+    return (uint64_t)shard->state->occupied.load(memory_order_relaxed) * 100 >=
+           (uint64_t)(mask + 1) * percent;
+}
+
+// An IP may hold ip_quota registrations, plus one per recent lookup of its
+// registrations, so that the IPs of carrier-grade NATs get room as their
+// users get found. Must hold the shard's writer lock
+static bool over_quota(registry_shard_t* shard, uint32_t ip) {
+    uint32_t registrations = UINT32_MAX, hits = UINT32_MAX;
+    for (int row = 0; row < REGISTRY_IP_ROWS; row++) {
+        registry_ip_bucket_t* bucket = ip_bucket(shard, row, ip);
+        uint32_t row_hits = bucket->hits.load(memory_order_relaxed);
+        registrations = min(registrations, bucket->registrations);
+        hits = min(hits, row_hits);
+    }
+    return registrations >= ip_quota + (uint64_t)hits;
+}
+
+static bool filter_may_contain(registry_shard_t* shard, uint32_t ip,
+                               uint16_t public_port) {
+    return filter_test(shard, filter_hash_ip(ip)) &&
+           filter_test(shard, filter_hash(ip, public_port));
+}
+
+static uint32_t tick(double now) {
+    double ticks = (now - header->epoch) * REGISTRY_TICKS_PER_SECOND;
+    return ticks > 0 ? (uint32_t)ticks : 0;
+}
+
+static uint32_t handle_process(uint32_t handle) {
+    return (handle & ~REGISTRY_HANDLE_FLAGS) >> REGISTRY_HANDLE_PROCESS_SHIFT;
+}
+
+static bool has_key(const registry_record_t* record, uint32_t ip,
+                    uint16_t public_port) {
+    return record->entry.ip == ip && record->entry.public_port == public_port;
+}
+
+static bool is_taken(const registry_record_t* record) {
+    return record->entry.ip != REGISTRY_EMPTY_IP &&
+           record->entry.ip != REGISTRY_WIPED_IP;
+}
+
+static bool is_dead(const registry_record_t* record, double now) {
+    return tick(now) > record->expiry;
+}
+
+static bool is_live(const registry_record_t* record, double now) {
+    if (is_dead(record, now)) {
+        return false;
+    }
+    // Parked TCP sockets of other processes can't be used from here
+    uint32_t owner = handle_process(record->handle);
+    return owner == 0 || owner == process;
+}
+
+// Whether writing over a record frees or takes a connection of this process
+static bool holds_connection(const registry_record_t* record) {
+    return is_taken(record) && handle_process(record->handle) == process;
+}
+
+// Copies a slot, and the socket its handle refers to if it is one of this
+// process's. Returns false if writers kept modifying it
+static bool read_slot(registry_slot_t* slot, registry_record_t* record,
+                      int* tcp_socket) {
+    for (int retry = 0; retry < REGISTRY_READ_RETRIES; retry++) {
+        uint32_t seq = slot->seq.load(memory_order_acquire);
+        if (seq % 2 == 1) {
+            continue;
+        }
+        memcpy(record, &slot->record, sizeof(*record));
+        // The connection is only freed once its registration is gone,
+        // which the sequence counter tells, as entries are stored with
+        // release semantics
+        *tcp_socket = 0;
+        if (handle_process(record->handle) == process) {
+            *tcp_socket =
+                connections[record->handle & REGISTRY_HANDLE_CONNECTION_MASK]
+                    .load(memory_order_relaxed);
+        }
+        atomic_thread_fence(memory_order_acquire);
+        if (slot->seq.load(memory_order_relaxed) == seq) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Parks a TCP socket in the connection table, or refers to it once more if
+// it is already, and returns its handle, or 0 if the table is full. Must hold
+// connections_mutex
+static uint32_t connection_add(int tcp_socket);
+
+// Frees an entry of the connection table, letting go of its socket. Must hold
+// connections_mutex
+static void connection_free(uint32_t index) {
+    int32_t tcp_socket = connections[index].load(memory_order_relaxed);
+    if (tcp_socket >= 0) {
+        socket_connections[tcp_socket] = 0;
+        hold_socket(tcp_socket, false);
+    }
+    // Released after the wipe of the registration, so that a reader seeing
+    // the entry change sees the slot's sequence counter change too
+    connections[index].store(-2 - free_connection, memory_order_release);
+    free_connection = index;
+}
+
+// Drops a registration's reference to the connection of a handle if it
+// belongs to this process, freeing it with the last one. Must hold
+// connections_mutex
+static void connection_remove(uint32_t handle) {
+    if (handle_process(handle) != process) {
+        return;
+    }
+    uint32_t index = handle & REGISTRY_HANDLE_CONNECTION_MASK;
+    if (connection_registrations[index] > 1) {
+        connection_registrations[index]--;
+    } else {
+        connection_free(index);
+    }
+}
+
+// Whether a registration holds a connection of this process whose peer hung
+// up, which can't be handed to anyone anymore
+static bool hung_up(const registry_record_t* record) {
+    return holds_connection(record) &&
+           connections[record->handle & REGISTRY_HANDLE_CONNECTION_MASK].load(
+               memory_order_relaxed) == REGISTRY_HUNG_UP;
+}
+
+static void write_begin(registry_shard_t* shard, uint32_t index) {
+    registry_slot_t* slot = &shard->slots[index];
+    shard->state->dirty_slot.store(index, memory_order_relaxed);
+    slot->seq.store(slot->seq.load(memory_order_relaxed) + 1,
+                    memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static void write_end(registry_shard_t* shard, uint32_t index) {
+    registry_slot_t* slot = &shard->slots[index];
+    slot->seq.store(slot->seq.load(memory_order_relaxed) + 1,
+                    memory_order_release);
+    shard->state->dirty_slot.store(-1, memory_order_relaxed);
+}
+
+// Wipes whatever a dead writer was in the middle of writing
+static void recover(registry_shard_t* shard, int32_t dead_writer) {
+    int32_t index = shard->state->dirty_slot.load(memory_order_relaxed);
+    log("Registry writer %d died while holding the lock of shard %d, "
+        "recovering slot %d\n",
+        dead_writer, (int)(shard - shards), index);
+    if (index < 0) {
+        return;
+    }
+    // The slot is only inconsistent if the writer died between write_begin()
+    // and write_end()
+    registry_slot_t* slot = &shard->slots[index];
+    if (slot->seq.load(memory_order_relaxed) % 2 == 0) {
+        shard->state->dirty_slot.store(-1, memory_order_relaxed);
+        return;
+    }
+    slot->record.entry.ip = REGISTRY_WIPED_IP;
+    write_end(shard, index);
+}
+
+static void lock(registry_shard_t* shard) {
+    atomic<int32_t>* writer = &shard->state->writer;
+    int32_t self = (int32_t)syscall(SYS_gettid);
+    for (int spins = 1;; spins++) {
+        int32_t owner = 0;
+        if (writer->compare_exchange_weak(owner, self,
+                                          memory_order_acquire)) {
+            return;
+        }
+        if (spins % 1024 == 0) {
+            // Check whether the lock is held by a process that crashed
+            if (owner != 0 && kill(owner, 0) < 0 && errno == ESRCH &&
+                writer->compare_exchange_strong(owner, self,
+                                                memory_order_acquire)) {
+                recover(shard, owner);
+                return;
+            }
+            sched_yield();
+        }
+    }
+}
+
+static void unlock(registry_shard_t* shard) {
+    shard->state->writer.store(0, memory_order_release);
+}
+
+// Finds the slot of ip:public_port, or the slot it should be inserted into.
+// Must hold the shard's writer lock
+static int find_slot(registry_shard_t* shard, uint32_t ip,
+                     uint16_t public_port, double now, bool* found) {
+    int free_index = -1;
+    *found = false;
+    uint32_t home = hash_key(ip, public_port);
+    for (uint32_t i = 0; i < REGISTRY_MAX_PROBES && i <= mask; i++) {
+        uint32_t index = (home + i) & mask;
+        registry_record_t* record = &shard->slots[index].record;
+        if (has_key(record, ip, public_port)) {
+            *found = true;
+            return index;
+        }
+        if (record->entry.ip == REGISTRY_EMPTY_IP) {
+            return free_index >= 0 ? free_index : (int)index;
+        }
+        // Expired registrations can be replaced, but we keep probing in case
+        // ip:public_port is further down the chain
+        if (free_index < 0 && (record->entry.ip == REGISTRY_WIPED_IP ||
+                               is_dead(record, now))) {
+            free_index = index;
+        }
+    }
+    return free_index;
+}
+
+// Removes the registration in a slot from the table and the filter. Must hold
+// the shard's writer lock
+static void wipe(registry_shard_t* shard, uint32_t index) {
+    registry_record_t record = shard->slots[index].record;
+    // See registry_post()
+    bool connected = holds_connection(&record);
+    if (connected) {
+        pthread_mutex_lock(&connections_mutex);
+    }
+    write_begin(shard, index);
+    shard->slots[index].record.entry.ip = REGISTRY_WIPED_IP;
+    write_end(shard, index);
+    key_removed(shard, record.entry.ip, record.entry.public_port);
+    if (connected) {
+        connection_remove(record.handle);
+        pthread_mutex_unlock(&connections_mutex);
+    }
+}
+
+// Gives the registration in a slot a second chance if it was looked up since
+// the CLOCK hand last passed it. Must hold the shard's writer lock
+static bool second_chance(registry_shard_t* shard, uint32_t index) {
+    return shard->slots[index].referenced.exchange(0, memory_order_relaxed) !=
+           0;
+}
+
+// Moves the CLOCK hand over the next few slots. Must hold the shard's writer
+// lock
+static void sweep(registry_shard_t* shard, double now) {
+    for (int i = 0; i < REGISTRY_SWEEP_SLOTS; i++) {
+        uint32_t index = shard->state->sweep_cursor++ & mask;
+        if (index % REGISTRY_SLOTS_PER_IP_BUCKET == 0) {
+            for (int row = 0; row < REGISTRY_IP_ROWS; row++) {
+                atomic<uint32_t>* hits =
+                    &shard->ip_buckets[row][(index /
+                                             REGISTRY_SLOTS_PER_IP_BUCKET) &
+                                            ip_bucket_mask]
+                         .hits;
+                hits->store(hits->load(memory_order_relaxed) / 2,
+                            memory_order_relaxed);
+            }
+        }
+
+        registry_record_t* record = &shard->slots[index].record;
+        if (!is_taken(record)) {
+            continue;
+        }
+        if (is_dead(record, now) || hung_up(record)) {
+            wipe(shard, index);
+        } else if (load_above(shard, REGISTRY_EVICT_LOAD) &&
+                   !second_chance(shard, index)) {
+            wipe(shard, index);
+            metrics_add(&shard->evictions, 1);
+        }
+    }
+}
+
+// Picks the registration to evict among the slots a key may be stored in, when
+// they are all taken, the way the CLOCK hand would. Must hold the shard's
+// writer lock
+static int evict_near(registry_shard_t* shard, uint32_t ip,
+                      uint16_t public_port) {
+    metrics_add(&shard->evictions, 1);
+    uint32_t home = hash_key(ip, public_port);
+    uint32_t probes = min((uint32_t)REGISTRY_MAX_PROBES, mask + 1);
+    for (uint32_t i = 0; i < probes; i++) {
+        uint32_t index = (home + i) & mask;
+        if (!second_chance(shard, index)) {
+            return index;
+        }
+    }
+    // They were all looked up recently, and now none of them is
+    return home & mask;
+}
+
+// Frees the connections of this process that no registration refers to
+// anymore, and recounts the registrations of the others, as other processes
+// may have evicted them. The slots of every shard are read like lookups do,
+// and those of this process's registrations holding a connection are only
+// written under connections_mutex, so none of them is caught half-written.
+// Must hold connections_mutex
+static void reclaim_connections() {
+    vector<uint32_t> used(num_connections);
+    for (uint32_t s = 0; s < num_shards; s++) {
+        for (uint32_t i = 0; i <= mask; i++) {
+            registry_record_t record;
+            int tcp_socket;
+            if (!read_slot(&shards[s].slots[i], &record, &tcp_socket)) {
+                // Can't tell whether it refers to one, so free nothing
+                return;
+            }
+            if (holds_connection(&record)) {
+                used[record.handle & REGISTRY_HANDLE_CONNECTION_MASK]++;
+            }
+        }
+    }
+    free_connection = -1;
+    for (uint32_t i = 0; i < num_connections - never_used_connections; i++) {
+        if (used[i]) {
+            connection_registrations[i] = used[i];
+        } else {
+            connection_free(i);
+        }
+    }
+}
+
+static uint32_t connection_add(int tcp_socket) {
+    if (!hold_socket || (uint32_t)tcp_socket >= num_sockets) {
+        return 0;
+    }
+    if (socket_connections[tcp_socket] > 0) {
+        uint32_t index = socket_connections[tcp_socket] - 1;
+        connection_registrations[index]++;
+        return process << REGISTRY_HANDLE_PROCESS_SHIFT | index;
+    }
+    if (free_connection < 0 && never_used_connections == 0) {
+        reclaim_connections();
+    }
+    uint32_t index;
+    if (free_connection >= 0) {
+        index = free_connection;
+        free_connection = -2 - connections[index].load(memory_order_relaxed);
+    } else if (never_used_connections > 0) {
+        index = num_connections - never_used_connections--;
+    } else {
+        return 0;
+    }
+    connections[index].store(tcp_socket, memory_order_release);
+    connection_registrations[index] = 1;
+    socket_connections[tcp_socket] = index + 1;
+    hold_socket(tcp_socket, true);
+    return process << REGISTRY_HANDLE_PROCESS_SHIFT | index;
+}
+
+// Takes an index in header->processes for this process, wiping the TCP
+// registrations of the dead process that had it, if any
+static int join() {
+    // The first shard's lock also guards header->processes
+    lock(shards);
+    uint32_t claimed = 0;
+    int32_t other = 0;
+    for (uint32_t i = 1; i < REGISTRY_MAX_PROCESSES && !claimed; i++) {
+        other = header->processes[i].load(memory_order_relaxed);
+        if (other == 0 || (kill(other, 0) < 0 && errno == ESRCH)) {
+            header->processes[i].store(pid, memory_order_relaxed);
+            claimed = i;
+        }
+    }
+    unlock(shards);
+    if (!claimed) {
+        log("%d processes share the registry already\n",
+            REGISTRY_MAX_PROCESSES - 1);
+        return -1;
+    }
+
+    // The dead process's connections were never in this process's table,
+    // so they are wiped before its index becomes this process's
+    for (uint32_t s = 0; other != 0 && s < num_shards; s++) {
+        registry_shard_t* shard = &shards[s];
+        lock(shard);
+        for (uint32_t index = 0; index <= mask; index++) {
+            registry_record_t* record = &shard->slots[index].record;
+            if (is_taken(record) && handle_process(record->handle) == claimed) {
+                wipe(shard, index);
+            }
+        }
+        unlock(shard);
+    }
+    process = claimed;
+    return 0;
+}
+
+static uint32_t filter_blocks(uint32_t shard_slots) {
+    uint32_t blocks =
+        shard_slots / (REGISTRY_FILTER_BLOCK / REGISTRY_FILTER_COUNTERS);
+    return blocks > 0 ? blocks : 1;
+}
+
+static uint32_t ip_bucket_count(uint32_t shard_slots) {
+    return shard_slots / REGISTRY_SLOTS_PER_IP_BUCKET;
+}
+
+// Every shard's slots, filter and per-IP buckets follow each other, after
+// the header and the state of every shard
+static size_t shard_size(uint32_t shard_slots) {
+    return shard_slots * sizeof(registry_slot_t) +
+           filter_blocks(shard_slots) * sizeof(registry_filter_block_t) +
+           REGISTRY_IP_ROWS * ip_bucket_count(shard_slots) *
+               sizeof(registry_ip_bucket_t);
+}
+
+static size_t registry_size(uint32_t shard_slots, uint32_t shards_count) {
+    return sizeof(registry_header_t) +
+           shards_count *
+               (sizeof(registry_shard_state_t) + shard_size(shard_slots));
+}
+
+static void write_registry_metrics(FILE* f) {
+    pthread_mutex_lock(&readers_mutex);
+    uint64_t filter_rejects = retired_filter_rejects;
+    uint64_t filter_misses = retired_filter_misses;
+    for (registry_reader* r = readers; r; r = r->next) {
+        filter_rejects += r->filter_rejects.load(memory_order_relaxed);
+        filter_misses += r->filter_misses.load(memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&readers_mutex);
+
+    uint64_t evictions = 0, quota_refusals = 0, occupied = 0;
+    for (uint32_t s = 0; s < num_shards; s++) {
+        evictions += shards[s].evictions.load(memory_order_relaxed);
+        quota_refusals += shards[s].quota_refusals.load(memory_order_relaxed);
+        occupied += shards[s].state->occupied.load(memory_order_relaxed);
+    }
+
+    metrics_write_counter(f, "stun_registry_filter_rejects_total",
+                          "ASK_INFOs for servers the filter ruled out",
+                          filter_rejects);
+    metrics_write_counter(f, "stun_registry_filter_misses_total",
+                          "Lookups that got past the filter but found no "
+                          "live registration",
+                          filter_misses);
+    metrics_write_counter(f, "stun_registry_evictions_total",
+                          "Live registrations evicted to make room",
+                          evictions);
+    metrics_write_counter(f, "stun_registry_quota_refusals_total",
+                          "POST_INFOs refused as their IP was over its "
+                          "quota while the registry was filling up",
+                          quota_refusals);
+    metrics_write_gauge(f, "stun_registry_occupied_slots",
+                        "Slots of the registry holding a registration",
+                        occupied);
+    metrics_write_gauge(f, "stun_registry_capacity",
+                        "Registrations the registry can hold",
+                        header->capacity);
+    metrics_write_gauge(f, "stun_registry_shards",
+                        "Shards the registry is split into", num_shards);
+    metrics_write_gauge(f, "stun_registry_bytes",
+                        "Size of the registry in memory",
+                        registry_size(mask + 1, num_shards));
+}
+
+// Sets up the header and shard states of a new registry
+static void format(registry_header_t* new_header, uint32_t shard_slots,
+                   uint32_t shards_count) {
+    new_header->magic = REGISTRY_MAGIC;
+    new_header->version = REGISTRY_VERSION;
+    new_header->slot_size = sizeof(registry_slot_t);
+    new_header->capacity = shard_slots * shards_count;
+    new_header->shards = shards_count;
+    new_header->epoch = time();
+    registry_shard_state_t* states = (registry_shard_state_t*)(new_header + 1);
+    for (uint32_t s = 0; s < shards_count; s++) {
+        states[s].dirty_slot.store(-1, memory_order_relaxed);
+    }
+}
+
+static void* attach(const char* shm_name, uint32_t shard_slots,
+                    uint32_t shards_count) {
+    size_t size = registry_size(shard_slots, shards_count);
+    int fd = shm_open(shm_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    bool creator = fd >= 0;
+    if (!creator) {
+        if (errno != EEXIST || (fd = shm_open(shm_name, O_RDWR, 0)) < 0) {
+            log("Failed to shm_open(3) %s: %s\n", shm_name, strerror(errno));
+            return NULL;
+        }
+    }
+
+    if (creator) {
+        if (ftruncate(fd, size) < 0) {
+            log("Failed to ftruncate(2) %s: %s\n", shm_name, strerror(errno));
+            close(fd);
+            shm_unlink(shm_name);
+            return NULL;
+        }
+    } else {
+        // The creator may not have sized the object yet
+        struct stat st = {};
+        int waited_ms = 0;
+        while (fstat(fd, &st) == 0 &&
+               (size_t)st.st_size < sizeof(registry_header_t) &&
+               waited_ms < REGISTRY_ATTACH_TIMEOUT_MS) {
+            usleep(1000);
+            waited_ms++;
+        }
+        size = st.st_size;
+    }
+
+    void* mem = MAP_FAILED;
+    if (size >= sizeof(registry_header_t)) {
+        mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (mem == MAP_FAILED) {
+        log("Failed to map registry %s: %s\n", shm_name, strerror(errno));
+        return NULL;
+    }
+
+    registry_header_t* shared_header = (registry_header_t*)mem;
+    if (creator) {
+        format(shared_header, shard_slots, shards_count);
+        shared_header->ready.store(1, memory_order_release);
+        log("Created shared registry %s for %u registrations in %u shards\n",
+            shm_name, shared_header->capacity, shards_count);
+        return mem;
+    }
+
+    int waited_ms = 0;
+    while (!shared_header->ready.load(memory_order_acquire) &&
+           waited_ms < REGISTRY_ATTACH_TIMEOUT_MS) {
+        usleep(1000);
+        waited_ms++;
+    }
+    if (!shared_header->ready.load(memory_order_acquire) ||
+        shared_header->magic != REGISTRY_MAGIC ||
+        shared_header->version != REGISTRY_VERSION ||
+        shared_header->slot_size != sizeof(registry_slot_t) ||
+        shared_header->shards == 0 ||
+        shared_header->capacity % shared_header->shards != 0 ||
+        registry_size(shared_header->capacity / shared_header->shards,
+                      shared_header->shards) > size) {
+        log("Shared registry %s is incompatible or was never initialized, "
+            "remove /dev/shm%s and try again\n",
+            shm_name, shm_name);
+        munmap(mem, size);
+        return NULL;
+    }
+    log("Attached to shared registry %s holding %u registrations in %u "
+        "shards\n",
+        shm_name, shared_header->capacity, shared_header->shards);
+    return mem;
+}
+
+unsigned int registry_capacity_for(size_t bytes, unsigned int shards_count) {
+    uint32_t shard_slots = REGISTRY_MAX_CAPACITY / shards_count;
+    while (shard_slots >= REGISTRY_MIN_SHARD_SLOTS &&
+           registry_size(shard_slots, shards_count) > bytes) {
+        shard_slots /= 2;
+    }
+    return shard_slots >= REGISTRY_MIN_SHARD_SLOTS ? shard_slots * shards_count
+                                                   : 0;
+}
+
+int registry_init(const char* shm_name, unsigned int capacity,
+                  unsigned int quota, unsigned int shards_count,
+                  void (*hold)(int tcp_socket, bool held)) {
+    // Every shard holds the same power of two of slots
+    uint32_t shard_slots = REGISTRY_MIN_SHARD_SLOTS;
+    while ((uint64_t)shard_slots * shards_count < capacity) {
+        shard_slots *= 2;
+    }
+
+    void* mem;
+    if (shm_name) {
+        mem = attach(shm_name, shard_slots, shards_count);
+        if (!mem) {
+            return -1;
+        }
+    } else {
+        mem = mmap(NULL, registry_size(shard_slots, shards_count),
+                   PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            log("Failed to allocate registry: %s\n", strerror(errno));
+            return -1;
+        }
+        format((registry_header_t*)mem, shard_slots, shards_count);
+    }
+
+    header = (registry_header_t*)mem;
+    num_shards = header->shards;
+    shard_slots = header->capacity / num_shards;
+    mask = shard_slots - 1;
+    filter_mask = filter_blocks(shard_slots) - 1;
+    ip_bucket_mask = ip_bucket_count(shard_slots) - 1;
+    shards = new registry_shard_t[num_shards]();
+    registry_shard_state_t* states = (registry_shard_state_t*)(header + 1);
+    uint8_t* shard_memory = (uint8_t*)(states + num_shards);
+    for (uint32_t s = 0; s < num_shards; s++) {
+        registry_shard_t* shard = &shards[s];
+        shard->state = &states[s];
+        shard->slots =
+            (registry_slot_t*)(shard_memory + s * shard_size(shard_slots));
+        shard->filter = (registry_filter_block_t*)(shard->slots + shard_slots);
+        for (int row = 0; row < REGISTRY_IP_ROWS; row++) {
+            shard->ip_buckets[row] =
+                (registry_ip_bucket_t*)(shard->filter + filter_mask + 1) +
+                row * ip_bucket_count(shard_slots);
+        }
+    }
+    ip_quota = quota;
+    pid = getpid();
+    hold_socket = hold;
+
+    // Mapped lazily, only the entries of parked sockets get touched
+    num_connections = min(header->capacity,
+                          (uint32_t)REGISTRY_HANDLE_CONNECTION_MASK + 1);
+    never_used_connections = num_connections;
+    struct rlimit limit;
+    num_sockets = REGISTRY_HANDLE_CONNECTION_MASK + 1;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+        limit.rlim_cur < (rlim_t)num_sockets) {
+        num_sockets = (uint32_t)limit.rlim_cur;
+    }
+    size_t table_size =
+        num_connections * (sizeof(atomic<int32_t>) + sizeof(uint32_t)) +
+        num_sockets * sizeof(uint32_t);
+    void* table = mmap(NULL, table_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (table == MAP_FAILED) {
+        log("Failed to allocate the connection table: %s\n",
+            strerror(errno));
+        return -1;
+    }
+    connections = (atomic<int32_t>*)table;
+    connection_registrations = (uint32_t*)(connections + num_connections);
+    socket_connections = connection_registrations + num_connections;
+    if (join() < 0) {
+        return -1;
+    }
+    metrics_register(write_registry_metrics);
+    return 0;
+}
+
+int registry_shard_memory(unsigned int shard, void** mem, size_t* size) {
+    if (shard >= num_shards) {
+        return -1;
+    }
+    *mem = shards[shard].slots;
+    *size = shard_size(mask + 1);
+    return 0;
+}
+
+bool registry_lookup(unsigned int ip, unsigned short public_port, double now,
+                     registry_entry_t* out) {
+    registry_shard_t* shard = shard_of(ip);
+    if (ip == REGISTRY_EMPTY_IP || ip == REGISTRY_WIPED_IP ||
+        !filter_may_contain(shard, ip, public_port)) {
+        return false;
+    }
+
+    uint32_t home = hash_key(ip, public_port);
+    for (uint32_t i = 0; i < REGISTRY_MAX_PROBES && i <= mask; i++) {
+        registry_slot_t* slot = &shard->slots[(home + i) & mask];
+        registry_record_t record;
+        int tcp_socket;
+        if (!read_slot(slot, &record, &tcp_socket) ||
+            record.entry.ip == REGISTRY_EMPTY_IP) {
+            break;
+        }
+        if (has_key(&record, ip, public_port)) {
+            // A server whose TCP connection hung up can't be reached anymore
+            if (!is_live(&record, now) || tcp_socket < 0) {
+                break;
+            }
+            // Only written when it changes, so that hot registrations don't
+            // bounce their cache line between the readers
+            if (!slot->referenced.load(memory_order_relaxed)) {
+                slot->referenced.store(1, memory_order_relaxed);
+            }
+            // Sampled, for the same reason, and with a plain store rather
+            // than an atomic increment: concurrent lookups of one IP may lose
+            // a few hits, which only makes its quota grow a little slower
+            if (++reader.hits % REGISTRY_HIT_SAMPLE == 0) {
+                for (int row = 0; row < REGISTRY_IP_ROWS; row++) {
+                    atomic<uint32_t>* hits = &ip_bucket(shard, row, ip)->hits;
+                    hits->store(hits->load(memory_order_relaxed) +
+                                    REGISTRY_HIT_SAMPLE,
+                                memory_order_relaxed);
+                }
+            }
+            out->entry = record.entry;
+            out->tcp_socket = tcp_socket;
+            out->flags = 0;
+            if (record.handle & REGISTRY_HANDLE_RELIABLE) {
+                out->flags |= REGISTRY_RELIABLE;
+            }
+            if (record.handle & REGISTRY_HANDLE_TCP_GO) {
+                out->flags |= REGISTRY_TCP_GO;
+            }
+            return true;
+        }
+    }
+    metrics_add(&reader.filter_misses, 1);
+    return false;
+}
+
+bool registry_may_contain(unsigned int ip, unsigned short public_port) {
+    if (filter_may_contain(shard_of(ip), ip, public_port)) {
+        return true;
+    }
+    metrics_add(&reader.filter_rejects, 1);
+    return false;
+}
+
+registry_post_result_t registry_post(const stun_entry_t* entry, int tcp_socket,
+                                     uint32_t flags, double now) {
+    registry_shard_t* shard = shard_of(entry->ip);
+    registry_post_result_t result = REGISTRY_NEW;
+    lock(shard);
+
+    bool found;
+    int index = find_slot(shard, entry->ip, entry->public_port, now, &found);
+    if (!found && load_above(shard, REGISTRY_QUOTA_LOAD) &&
+        over_quota(shard, entry->ip)) {
+        metrics_add(&shard->quota_refusals, 1);
+        unlock(shard);
+        return REGISTRY_FULL;
+    }
+    if (index < 0) {
+        index = evict_near(shard, entry->ip, entry->public_port);
+    }
+    registry_record_t* record = &shard->slots[index].record;
+    registry_record_t replaced = *record;
+
+    // Registrations holding a connection of this process are written with
+    // connections_mutex held, along with taking or freeing the connection,
+    // so that reclaim_connections() never sees the slot and the connection
+    // table disagree
+    bool connected = tcp_socket > 0 || holds_connection(&replaced);
+    if (connected) {
+        pthread_mutex_lock(&connections_mutex);
+    }
+    uint32_t handle = 0;
+    if (tcp_socket > 0 && (handle = connection_add(tcp_socket)) == 0) {
+        pthread_mutex_unlock(&connections_mutex);
+        unlock(shard);
+        return REGISTRY_FULL;
+    }
+    if (flags & REGISTRY_RELIABLE) {
+        handle |= REGISTRY_HANDLE_RELIABLE;
+    }
+    if (flags & REGISTRY_TCP_GO) {
+        handle |= REGISTRY_HANDLE_TCP_GO;
+    }
+
+    if (found && is_live(record, now)) {
+        result = REGISTRY_REFRESHED;
+    }
+    if (!found) {
+        key_added(shard, entry->ip, entry->public_port);
+    }
+    // A server that keeps refreshing its registration is in use too, while
+    // new ones are the first to go
+    shard->slots[index].referenced.store(found, memory_order_relaxed);
+    write_begin(shard, index);
+    record->entry = *entry;
+    record->expiry = tick(now) + REGISTRY_TIMEOUT_TICKS;
+    record->handle = handle;
+    write_end(shard, index);
+    if (is_taken(&replaced)) {
+        if (!found) {
+            key_removed(shard, replaced.entry.ip, replaced.entry.public_port);
+        }
+        if (connected) {
+            connection_remove(replaced.handle);
+        }
+    }
+    if (connected) {
+        pthread_mutex_unlock(&connections_mutex);
+    }
+
+    sweep(shard, now);
+    unlock(shard);
+    return result;
+}
+
+int registry_take(unsigned int ip, unsigned short public_port) {
+    registry_shard_t* shard = shard_of(ip);
+    int tcp_socket = 0;
+    lock(shard);
+    bool found;
+    int index = find_slot(shard, ip, public_port, 0, &found);
+    if (found && holds_connection(&shard->slots[index].record)) {
+        registry_record_t* record = &shard->slots[index].record;
+        pthread_mutex_lock(&connections_mutex);
+        tcp_socket =
+            connections[record->handle & REGISTRY_HANDLE_CONNECTION_MASK].load(
+                memory_order_relaxed);
+        if (tcp_socket > 0) {
+            hold_socket(tcp_socket, true);
+        } else {
+            tcp_socket = 0;
+        }
+        pthread_mutex_unlock(&connections_mutex);
+        wipe(shard, index);
+    }
+    unlock(shard);
+    return tcp_socket;
+}
+
+void registry_hang_up(int tcp_socket) {
+    if (tcp_socket <= 0 || (uint32_t)tcp_socket >= num_sockets) {
+        return;
+    }
+    pthread_mutex_lock(&connections_mutex);
+    uint32_t entry = socket_connections[tcp_socket];
+    if (entry > 0) {
+        // Its registrations are wiped as the CLOCK hand passes them, and
+        // no longer found until then
+        socket_connections[tcp_socket] = 0;
+        connections[entry - 1].store(REGISTRY_HUNG_UP, memory_order_relaxed);
+        hold_socket(tcp_socket, false);
+    }
+    pthread_mutex_unlock(&connections_mutex);
+}
@@ -0,0 +1,238 @@
+#ifndef STUN_SERVER_REGISTRY_H
+#define STUN_SERVER_REGISTRY_H
+/**
+ * Copyright Fractal Computers, Inc. 2021
+ * @file registry.h
+ * @brief The table of servers that have POST_INFO'd, looked up by ASK_INFO
+============================
+Usage
+============================
+
+Call registry_init() once at startup. The registry is an open addressing hash
+table keyed by IP and public port, with one registration per slot, so that a
+host can register hundreds of ports and every operation still only probes a
+few slots. It has a fixed layout and can live in a POSIX shared memory object
+that several stun processes map at the same time.
+
+Registrations are stored inline in 16 bytes: the IP and ports, an expiry
+time in ticks of 100ms, and a handle to the server's TCP socket. Sockets are
+parked in a table of the process that accepted them, indexed by the handle,
+so that the registry never holds file descriptors that mean nothing to the
+other processes. The registry holds a reference to every socket it parks,
+through the callback given to registry_init(), until no registration refers
+to it anymore or registry_hang_up() is called for it. A client is handed a
+parked socket with registry_take(), which uses up the registration.
+
+Lookups never take a lock, nor execute any atomic read-modify-write, so that
+ASK_INFOs scale with the workers: every slot is protected by a sequence
+counter, which writers publish their changes with, and readers simply retry if
+a writer modified the slot while it was being copied. Records are copied out
+rather than pointed to, so nothing a reader may still be looking at is ever
+freed, and readers count their lookups in counters of their own thread.
+Writers serialize on a lock that records the thread holding it, so that if a
+process dies in the middle of a write, the next writer notices, wipes the
+half-written slot and carries on.
+
+The table can be split into shards, one per worker, each holding the IPs
+steering_worker() hands that worker, with its own writer lock, CLOCK hand,
+filter and per-IP counts. A worker that only handles the requests of its own
+shard, see shard.h, then never shares a cache line with the others, while
+requests handled elsewhere, e.g. over TCP, still take the shard's lock.
+
+A counting Bloom filter over the registered IPs and IP:ports, kept next to the
+table, lets registry_may_contain() and registry_lookup() turn most ASK_INFOs
+for unregistered servers away without probing it.
+
+The table never grows, so its memory is fixed at startup, e.g. from a budget
+with registry_capacity_for(). Every POST_INFO moves a CLOCK hand over a few
+slots, which wipes dead registrations and, once 90% of the slots are taken,
+evicts the live ones that were neither found by an ASK_INFO nor refreshed
+since its last pass. A new registration whose slots are all taken evicts one
+of them the same way. Once 75% of the slots are taken, an IP may only add
+registrations up to its quota, which grows with how often its registrations
+are found, so that the IP of a carrier-grade NAT can hold as many as its
+users need but a single host can't crowd everyone else out.
+*/
+
+/*
+============================
+Includes
+============================
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stun.h"
+
+/*
+============================
+Defines
+============================
+*/
+
+#define REGISTRY_MAX_CAPACITY (1 << 26)
+
+/*
+============================
+Custom Types
+============================
+*/
+
+// A live registration, as found by registry_lookup()
+typedef struct {
+    stun_entry_t entry;
+    // The server's parked TCP socket, or 0 if it registered over UDP
+    int tcp_socket;
+    // registry_flags_t
+    uint32_t flags;
+} registry_entry_t;
+
+typedef enum registry_flags {
+    // The server acknowledges its notifications, see STUN_V2_POST_RELIABLE
+    REGISTRY_RELIABLE = 1 << 0,
+    // The server registered with version 2 over TCP, and its notifications
+    // are followed by a stun_tcp_go_t
+    REGISTRY_TCP_GO = 1 << 1,
+} registry_flags_t;
+
+typedef enum registry_post_result {
+    // The registration is new, or replaces an expired one
+    REGISTRY_NEW,
+    // A live registration was refreshed
+    REGISTRY_REFRESHED,
+    // The registry is filling up and the registration's IP is over its quota
+    REGISTRY_FULL,
+} registry_post_result_t;
+
+/*
+============================
+Public Functions
+============================
+*/
+
+/**
+ * @brief                          Compute the largest capacity of a registry
+ *                                 fitting in a memory budget
+ *
+ * @param bytes                    The budget
+ * @param shards                   Number of shards of the registry
+ *
+ * @returns                        The capacity, shards times a power of two,
+ *                                 or 0 if the budget is too small for any
+ *                                 registry
+ */
+unsigned int registry_capacity_for(size_t bytes, unsigned int shards);
+
+/**
+ * @brief                          Create the registry, or attach to the one
+ *                                 in the given shared memory object
+ *
+ * @param shm_name                 Name of the POSIX shared memory object, or
+ *                                 NULL for a registry private to this process
+ * @param capacity                 Number of registrations the registry can
+ *                                 hold, rounded up to shards times a power of
+ *                                 two. Ignored when attaching to an existing
+ *                                 shared memory object
+ * @param ip_quota                 Registrations an IP may add once the
+ *                                 registry is filling up, on top of one
+ *                                 per recent lookup of its registrations
+ * @param shards                   Number of shards, the number of workers
+ *                                 when they each own one, 1 otherwise.
+ *                                 Ignored when attaching to an existing
+ *                                 shared memory object
+ * @param hold                     Called with true to take a reference to a
+ *                                 TCP socket, and with false to let go of
+ *                                 one, with the registry's locks held. NULL
+ *                                 if no server registers over TCP
+ *
+ * @returns                        0 on success, -1 on failure
+ */
+int registry_init(const char* shm_name, unsigned int capacity,
+                  unsigned int ip_quota, unsigned int shards,
+                  void (*hold)(int tcp_socket, bool held));
+
+/**
+ * @brief                          Get the memory of a shard's slots, filter
+ *                                 and per-IP counts, e.g. to place it on the
+ *                                 NUMA node of the worker owning the shard
+ *
+ * @param shard                    Index of the shard
+ * @param mem                      Set to the start of the shard's memory
+ * @param size                     Set to its size
+ *
+ * @returns                        0 on success, -1 if there is no such shard
+ */
+int registry_shard_memory(unsigned int shard, void** mem, size_t* size);
+
+/**
+ * @brief                          Find the live registration of ip:public_port
+ *
+ * @param ip                       Public IP of the server, network byte order
+ * @param public_port              Public port of the server, network byte
+ *                                 order
+ * @param now                      The current time()
+ * @param out                      Filled with the registration if found
+ *
+ * @returns                        True if a live registration was found. Its
+ *                                 TCP socket may only be used once taken
+ *                                 with registry_take()
+ */
+bool registry_lookup(unsigned int ip, unsigned short public_port, double now,
+                     registry_entry_t* out);
+
+/**
+ * @brief                          Check whether ip:public_port may have a
+ *                                 registration, without probing the table
+ *
+ * @param ip                       Public IP of the server, network byte order
+ * @param public_port              Public port of the server, network byte
+ *                                 order
+ *
+ * @returns                        False if ip:public_port is definitely not
+ *                                 registered
+ */
+bool registry_may_contain(unsigned int ip, unsigned short public_port);
+
+/**
+ * @brief                          Register or refresh a server
+ *
+ * @param entry                    The server's IP, private and public port
+ * @param tcp_socket               The server's TCP socket, or 0 over UDP.
+ *                                 Held while the registration refers to it
+ * @param flags                    registry_flags_t of the registration
+ * @param now                      The current time()
+ *
+ * @returns                        Whether the registration is new or was
+ *                                 refreshed, or REGISTRY_FULL if it could not
+ *                                 be stored
+ */
+registry_post_result_t registry_post(const stun_entry_t* entry, int tcp_socket,
+                                     uint32_t flags, double now);
+
+/**
+ * @brief                          Use up the registration of ip:public_port,
+ *                                 if it parks a TCP socket, handing the
+ *                                 socket to the caller
+ *
+ * @param ip                       Public IP of the server, network byte order
+ * @param public_port              Public port of the server, network byte
+ *                                 order
+ *
+ * @returns                        The socket, with a reference taken for the
+ *                                 caller to let go of, or 0 if the
+ *                                 registration is gone, e.g. as another
+ *                                 client took it first
+ */
+int registry_take(unsigned int ip, unsigned short public_port);
+
+/**
+ * @brief                          Let go of a parked TCP socket whose peer
+ *                                 hung up, whose registrations are no longer
+ *                                 found
+ *
+ * @param tcp_socket               The socket
+ */
+void registry_hang_up(int tcp_socket);
+
+#endif  // STUN_SERVER_REGISTRY_H
@@ -0,0 +1,192 @@
+/**
+ * Copyright Fractal Computers, Inc. 2021
+ * @file shard.cpp
+ * @brief Rings carrying requests from the worker that received them to the
+ *        worker owning the registrations they touch
+ */
+
+#include "shard.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <atomic>
+
+#include "log.h"
+#include "metrics.h"
+#include "stun.h"
+
+using namespace std;
+
+typedef struct {
+    struct sockaddr_in client;
+    uint32_t size;
+    uint8_t data[STUN_MAX_DATAGRAM];
+} shard_message_t;
+
+// The producer only writes tail and the consumer only writes head, each on a
+// cache line of its own along with its copy of the other's index
+typedef struct {
+    alignas(64) atomic<uint32_t> head;
+    uint32_t cached_tail;
+    alignas(64) atomic<uint32_t> tail;
+    uint32_t cached_head;
+    alignas(64) shard_message_t messages[SHARD_RING_SIZE];
+} shard_ring_t;
+
+typedef struct alignas(64) {
+    int wakeup_fd;
+    // Set by the worker while it sleeps, or is about to
+    atomic<uint32_t> sleeping;
+    // Written by the worker alone: the workers it forwarded to since its
+    // last flush, and its counts as a producer
+    bool* pending;
+    atomic<uint64_t> forwarded;
+    atomic<uint64_t> ring_full;
+    atomic<uint64_t> wakeups;
+} shard_worker_t;
+
+static unsigned int num_workers;
+static shard_worker_t* workers;
+// The ring from worker i to worker j is rings[i * num_workers + j]
+static shard_ring_t* rings;
+
+static shard_ring_t* ring(unsigned int from, unsigned int to) {
+    return &rings[from * num_workers + to];
+}
+
+static void write_shard_metrics(FILE* f) {
+    uint64_t forwarded = 0, ring_full = 0, wakeups = 0;
+    for (unsigned int i = 0; i < num_workers; i++) {
+        forwarded += workers[i].forwarded.load(memory_order_relaxed);
+        ring_full += workers[i].ring_full.load(memory_order_relaxed);
+        wakeups += workers[i].wakeups.load(memory_order_relaxed);
+    }
+    metrics_write_counter(f, "stun_shard_forwarded_total",
+                          "Requests forwarded to the worker owning their "
+                          "shard of the registry",
+                          forwarded);
+    metrics_write_counter(f, "stun_shard_ring_full_total",
+                          "Requests handled by the worker that received "
+                          "them as the ring to their owner was full",
+                          ring_full);
+    metrics_write_counter(f, "stun_shard_wakeups_total",
+                          "Sleeping workers woken to handle forwarded "
+                          "requests",
+                          wakeups);
+}
+
+int shard_init(unsigned int num_shards) {
+    num_workers = num_shards;
+    workers = new shard_worker_t[num_shards]();
+    // Mapped lazily, only the messages a ring ever held get touched
+    size_t bytes = (size_t)num_shards * num_shards * sizeof(shard_ring_t);
+    void* memory = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        log("Failed to allocate the shard rings: %s\n", strerror(errno));
+        return -1;
+    }
+    rings = (shard_ring_t*)memory;
+    for (unsigned int i = 0; i < num_shards; i++) {
+        workers[i].pending = new bool[num_shards]();
+        workers[i].wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (workers[i].wakeup_fd < 0) {
+            log("Failed to create an eventfd: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+    metrics_register(write_shard_metrics);
+    return 0;
+}
+
+bool shard_forward(unsigned int from, unsigned int to, const void* data,
+                   int size, const struct sockaddr_in* client) {
+    shard_ring_t* r = ring(from, to);
+    uint32_t tail = r->tail.load(memory_order_relaxed);
+    if (tail - r->cached_head == SHARD_RING_SIZE) {
+        r->cached_head = r->head.load(memory_order_acquire);
+        if (tail - r->cached_head == SHARD_RING_SIZE) {
+            metrics_add(&workers[from].ring_full, 1);
+            return false;
+        }
+    }
+    shard_message_t* message = &r->messages[tail % SHARD_RING_SIZE];
+    message->client = *client;
+    message->size = size;
+    memcpy(message->data, data, size);
+    r->tail.store(tail + 1, memory_order_release);
+    workers[from].pending[to] = true;
+    metrics_add(&workers[from].forwarded, 1);
+    return true;
+}
+
+void shard_flush(unsigned int from) {
+    shard_worker_t* producer = &workers[from];
+    // Pairs with the fence in shard_sleep(): either the worker sees the
+    // messages before sleeping, or we see that it sleeps
+    atomic_thread_fence(memory_order_seq_cst);
+    for (unsigned int to = 0; to < num_workers; to++) {
+        if (!producer->pending[to]) {
+            continue;
+        }
+        producer->pending[to] = false;
+        if (workers[to].sleeping.load(memory_order_relaxed)) {
+            uint64_t one = 1;
+            if (write(workers[to].wakeup_fd, &one, sizeof(one)) ==
+                sizeof(one)) {
+                metrics_add(&producer->wakeups, 1);
+            }
+        }
+    }
+}
+
+int shard_drain(unsigned int shard, shard_handler_t handler, void* context) {
+    int handled = 0;
+    for (unsigned int from = 0; from < num_workers; from++) {
+        if (from == shard) {
+            continue;
+        }
+        shard_ring_t* r = ring(from, shard);
+        uint32_t head = r->head.load(memory_order_relaxed);
+        if (head == r->cached_tail) {
+            r->cached_tail = r->tail.load(memory_order_acquire);
+        }
+        // At most a ring's worth at a time, so that a busy producer can't
+        // starve the others or the worker's own socket
+        for (; head != r->cached_tail; head++, handled++) {
+            shard_message_t* message = &r->messages[head % SHARD_RING_SIZE];
+            handler(message->data, message->size, &message->client, context);
+            r->head.store(head + 1, memory_order_release);
+        }
+    }
+    return handled;
+}
+
+bool shard_sleep(unsigned int shard) {
+    workers[shard].sleeping.store(1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    for (unsigned int from = 0; from < num_workers; from++) {
+        shard_ring_t* r = ring(from, shard);
+        if (from != shard && r->tail.load(memory_order_acquire) !=
+                                 r->head.load(memory_order_relaxed)) {
+            workers[shard].sleeping.store(0, memory_order_relaxed);
+            return false;
+        }
+    }
+    return true;
+}
+
+void shard_woke(unsigned int shard) {
+    workers[shard].sleeping.store(0, memory_order_relaxed);
+    // Nonblocking, and only fails if nobody woke us
+    uint64_t count;
+    ssize_t ignored = read(workers[shard].wakeup_fd, &count, sizeof(count));
+    (void)ignored;
+}
+
+int shard_wakeup_fd(unsigned int shard) { return workers[shard].wakeup_fd; }
@@ -0,0 +1,136 @@
+#ifndef STUN_SERVER_SHARD_H
+#define STUN_SERVER_SHARD_H
+/**
+ * Copyright Fractal Computers, Inc. 2021
+ * @file shard.h
+ * @brief Rings carrying requests from the worker that received them to the
+ *        worker owning the registrations they touch
+============================
+Usage
+============================
+
+With --shard-registry, every worker owns the shard of the registry holding
+the IPs steering_worker() hands it, so POST_INFOs are already received by
+their owner but an ASK_INFO may land on any worker. Call shard_init() once
+with the number of workers. A worker then shard_forward()s the requests of
+other workers' shards, calls shard_flush() after every batch, and
+shard_drain()s what the others forwarded to it, answering the clients from
+its own socket.
+
+Every ordered pair of workers has a single-producer single-consumer ring, so
+that forwarding is a copy and a release store, without any lock or atomic
+read-modify-write. A worker about to sleep announces it with shard_sleep(),
+and only then do the workers forwarding to it write its eventfd, which it
+polls next to its socket. When a ring is full, shard_forward() fails and the
+request is handled where it was received, which the per-shard writer locks
+of the registry keep correct.
+*/
+
+/*
+============================
+Includes
+============================
+*/
+
+#include <netinet/in.h>
+#include <stdbool.h>
+
+/*
+============================
+Defines
+============================
+*/
+
+// Requests a ring holds, a power of two
+#define SHARD_RING_SIZE 64
+
+/*
+============================
+Custom Types
+============================
+*/
+
+typedef void (*shard_handler_t)(const void* data, int size,
+                                const struct sockaddr_in* client,
+                                void* context);
+
+/*
+============================
+Public Functions
+============================
+*/
+
+/**
+ * @brief                          Create the rings between every pair of
+ *                                 workers
+ *
+ * @param num_shards               Number of workers, each owning a shard
+ *
+ * @returns                        0 on success, -1 on failure
+ */
+int shard_init(unsigned int num_shards);
+
+/**
+ * @brief                          Queue a request for the worker owning its
+ *                                 shard
+ *
+ * @param from                     The worker that received it
+ * @param to                       The worker owning the shard
+ * @param data                     The request
+ * @param size                     Its size, at most STUN_MAX_DATAGRAM
+ * @param client                   Address the request came from
+ *
+ * @returns                        False if the ring is full, in which case
+ *                                 the caller handles the request itself
+ */
+bool shard_forward(unsigned int from, unsigned int to, const void* data,
+                   int size, const struct sockaddr_in* client);
+
+/**
+ * @brief                          Wake the sleeping workers that requests
+ *                                 were forwarded to since the last flush
+ *
+ * @param from                     The worker that forwarded them
+ */
+void shard_flush(unsigned int from);
+
+/**
+ * @brief                          Handle the requests other workers
+ *                                 forwarded
+ *
+ * @param shard                    The worker they were forwarded to
+ * @param handler                  Called with every request
+ * @param context                  Passed to handler
+ *
+ * @returns                        Number of requests handled
+ */
+int shard_drain(unsigned int shard, shard_handler_t handler, void* context);
+
+/**
+ * @brief                          Announce that a worker is about to sleep
+ *
+ * @param shard                    The worker
+ *
+ * @returns                        False if requests were forwarded to it in
+ *                                 the meantime, and it shouldn't sleep
+ */
+bool shard_sleep(unsigned int shard);
+
+/**
+ * @brief                          Announce that a worker woke up
+ *
+ * @param shard                    The worker
+ */
+void shard_woke(unsigned int shard);
+
+/**
+ * @brief                          The eventfd a sleeping worker is woken
+ *                                 through, to poll next to its socket
+ *
+ * @param shard                    The worker
+ *
+ * @returns                        The eventfd
+ */
+int shard_wakeup_fd(unsigned int shard);
+
+#endif  // STUN_SERVER_SHARD_H
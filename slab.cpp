@@ -0,0 +1,218 @@
+/**
+ * Copyright Fractal Computers, Inc. 2021
+ * @file slab.cpp
+ * @brief Fixed-size object pools for the records created and freed per request
+ */
+
+#include "slab.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <atomic>
+
+#include "config.h"
+#include "log.h"
+#include "metrics.h"
+
+using namespace std;
+
+#define SLAB_HUGE_PAGE_SIZE (2 << 20)
+
+// A free object holds the next one of its free list
+typedef struct slab_free_object {
+    struct slab_free_object* next;
+} slab_free_object_t;
+
+struct slab_pool {
+    const char* name;
+    // Index of the pool in every thread's caches
+    int id;
+    size_t object_size;
+    unsigned int capacity;
+    uint8_t* memory;
+    size_t bytes;
+    pthread_mutex_t mutex;
+    // Objects freed back to the pool, and objects never handed out yet, so
+    // that the pages of a pool only get touched as it fills up
+    slab_free_object_t* free_list;
+    unsigned int never_used;
+    // Updated from every thread
+    atomic<uint32_t> in_use;
+    atomic<uint64_t> failures;
+};
+
+typedef struct {
+    slab_free_object_t* head;
+    unsigned int count;
+} slab_cache_t;
+
+// The free objects a thread keeps, handed back to their pools when it exits
+struct slab_thread_caches {
+    slab_cache_t caches[SLAB_MAX_POOLS];
+    ~slab_thread_caches();
+};
+
+static slab_pool_t pools[SLAB_MAX_POOLS];
+static int num_pools;
+static thread_local slab_thread_caches thread_caches;
+
+// Moves up to count objects from the pool to the cache
+static void refill(slab_pool_t* pool, slab_cache_t* cache,
+                   unsigned int count) {
+    pthread_mutex_lock(&pool->mutex);
+    for (; count > 0; count--) {
+        slab_free_object_t* object = pool->free_list;
+        if (object) {
+            pool->free_list = object->next;
+        } else if (pool->never_used > 0) {
+            pool->never_used--;
+            object = (slab_free_object_t*)(pool->memory +
+                                           pool->never_used *
+                                               pool->object_size);
+        } else {
+            break;
+        }
+        object->next = cache->head;
+        cache->head = object;
+        cache->count++;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+// Moves count objects from the cache to the pool
+static void drain(slab_pool_t* pool, slab_cache_t* cache,
+                  unsigned int count) {
+    pthread_mutex_lock(&pool->mutex);
+    for (; count > 0 && cache->head; count--) {
+        slab_free_object_t* object = cache->head;
+        cache->head = object->next;
+        cache->count--;
+        object->next = pool->free_list;
+        pool->free_list = object;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+slab_thread_caches::~slab_thread_caches() {
+    for (int i = 0; i < num_pools; i++) {
+        drain(&pools[i], &caches[i], caches[i].count);
+    }
+}
+
+static void write_slab_metrics(FILE* f) {
+    for (int i = 0; i < num_pools; i++) {
+        slab_pool_t* pool = &pools[i];
+        char name[128], help[128];
+        snprintf(name, sizeof(name), "stun_slab_%s_in_use", pool->name);
+        snprintf(help, sizeof(help), "Objects of the %s pool in use",
+                 pool->name);
+        metrics_write_gauge(f, name, help,
+                            pool->in_use.load(memory_order_relaxed));
+        snprintf(name, sizeof(name), "stun_slab_%s_capacity", pool->name);
+        snprintf(help, sizeof(help), "Objects the %s pool can hand out",
+                 pool->name);
+        metrics_write_gauge(f, name, help, pool->capacity);
+        snprintf(name, sizeof(name), "stun_slab_%s_bytes", pool->name);
+        snprintf(help, sizeof(help), "Memory reserved by the %s pool",
+                 pool->name);
+        metrics_write_gauge(f, name, help, pool->bytes);
+        snprintf(name, sizeof(name), "stun_slab_%s_failures_total",
+                 pool->name);
+        snprintf(help, sizeof(help),
+                 "Allocations that found the %s pool exhausted", pool->name);
+        metrics_write_counter(f, name, help,
+                              pool->failures.load(memory_order_relaxed));
+    }
+}
+
+// Maps the memory of a pool, from huge pages if asked to
+static uint8_t* map_pool(size_t* bytes) {
+    void* memory = MAP_FAILED;
+    if (config.hugepages) {
+        *bytes = (*bytes + SLAB_HUGE_PAGE_SIZE - 1) &
+                 ~(size_t)(SLAB_HUGE_PAGE_SIZE - 1);
+        memory = mmap(NULL, *bytes, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+    if (memory == MAP_FAILED) {
+        memory = mmap(NULL, *bytes, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            log("Failed to mmap(2) %zu bytes: %s\n", *bytes, strerror(errno));
+            return NULL;
+        }
+        // No huge pages are reserved, transparent ones will do
+        if (config.hugepages) {
+            madvise(memory, *bytes, MADV_HUGEPAGE);
+        }
+    }
+    return (uint8_t*)memory;
+}
+
+slab_pool_t* slab_create(const char* name, size_t object_size,
+                         unsigned int capacity) {
+    if (num_pools == SLAB_MAX_POOLS) {
+        log("Too many slab pools, can't create %s\n", name);
+        return NULL;
+    }
+    // Objects stay aligned like malloc(3)'s, and hold a free list link
+    size_t align = alignof(max_align_t);
+    if (object_size < sizeof(slab_free_object_t)) {
+        object_size = sizeof(slab_free_object_t);
+    }
+    object_size = (object_size + align - 1) & ~(align - 1);
+
+    size_t bytes = object_size * (capacity + SLAB_HEADROOM);
+    uint8_t* memory = map_pool(&bytes);
+    if (!memory) {
+        return NULL;
+    }
+
+    slab_pool_t* pool = &pools[num_pools];
+    pool->name = name;
+    pool->id = num_pools;
+    pool->object_size = object_size;
+    pool->capacity = capacity;
+    pool->memory = memory;
+    pool->bytes = bytes;
+    pthread_mutex_init(&pool->mutex, NULL);
+    pool->free_list = NULL;
+    pool->never_used = capacity + SLAB_HEADROOM;
+    if (num_pools++ == 0) {
+        metrics_register(write_slab_metrics);
+    }
+    return pool;
+}
+
+void* slab_alloc(slab_pool_t* pool) {
+    slab_cache_t* cache = &thread_caches.caches[pool->id];
+    if (!cache->head) {
+        refill(pool, cache, SLAB_BATCH);
+        if (!cache->head) {
+            pool->failures.fetch_add(1, memory_order_relaxed);
+            return NULL;
+        }
+    }
+    slab_free_object_t* object = cache->head;
+    cache->head = object->next;
+    cache->count--;
+    pool->in_use.fetch_add(1, memory_order_relaxed);
+    return object;
+}
+
+void slab_free(slab_pool_t* pool, void* object) {
+    slab_cache_t* cache = &thread_caches.caches[pool->id];
+    slab_free_object_t* freed = (slab_free_object_t*)object;
+    freed->next = cache->head;
+    cache->head = freed;
+    cache->count++;
+    pool->in_use.fetch_sub(1, memory_order_relaxed);
+    if (cache->count > SLAB_CACHE_SIZE) {
+        drain(pool, cache, SLAB_BATCH);
+    }
+}
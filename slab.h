@@ -0,0 +1,97 @@
+#ifndef STUN_SERVER_SLAB_H
+#define STUN_SERVER_SLAB_H
+/**
+ * Copyright Fractal Computers, Inc. 2021
+ * @file slab.h
+ * @brief Fixed-size object pools for the records created and freed per request
+============================
+Usage
+============================
+
+Call slab_create() once at startup for every kind of record, with the most
+records that can be alive at once. slab_alloc() and slab_free() then never
+call malloc(3): a pool is a single mapping carved into equal objects, so
+churn can't fragment the heap, and its memory is bounded.
+
+Every thread keeps a few free objects of each pool to itself, and only takes
+the pool's lock to move SLAB_BATCH of them at a time, so that threads
+allocating and freeing the same kind of record rarely contend. A thread's
+objects go back to the pool when it exits. Pools hold SLAB_HEADROOM objects
+more than their capacity for the threads to keep, but callers that need a
+hard limit should still count their objects themselves.
+
+With --hugepages, pools are backed by huge pages, falling back to
+transparent huge pages if none are reserved. The objects in use, capacity and
+size of every pool are exported as metrics.
+*/
+
+/*
+============================
+Includes
+============================
+*/
+
+#include <stddef.h>
+
+/*
+============================
+Defines
+============================
+*/
+
+// Most pools a process can create
+#define SLAB_MAX_POOLS 8
+// Free objects a thread keeps of each pool, and how many move between the
+// thread and the pool at once
+#define SLAB_CACHE_SIZE 32
+#define SLAB_BATCH 16
+// Objects a pool holds on top of its capacity, enough for 64 threads to
+// keep a batch each
+#define SLAB_HEADROOM (64 * SLAB_BATCH)
+
+/*
+============================
+Custom Types
+============================
+*/
+
+typedef struct slab_pool slab_pool_t;
+
+/*
+============================
+Public Functions
+============================
+*/
+
+/**
+ * @brief                          Create a pool of objects
+ *
+ * @param name                     Name of the pool in the metrics, e.g.
+ *                                 "waiters"
+ * @param object_size              Size of an object
+ * @param capacity                 Most objects in use at once
+ *
+ * @returns                        The pool, or NULL on failure
+ */
+slab_pool_t* slab_create(const char* name, size_t object_size,
+                         unsigned int capacity);
+
+/**
+ * @brief                          Allocate an object
+ *
+ * @param pool                     The pool
+ *
+ * @returns                        The object, uninitialized, or NULL if the
+ *                                 pool ran out
+ */
+void* slab_alloc(slab_pool_t* pool);
+
+/**
+ * @brief                          Free an object, from any thread
+ *
+ * @param pool                     The pool it was allocated from
+ * @param object                   The object
+ */
+void slab_free(slab_pool_t* pool, void* object);
+
+#endif  // STUN_SERVER_SLAB_H
@@ -0,0 +1,205 @@
+#ifndef STUN_SERVER_STUN_H
+#define STUN_SERVER_STUN_H
+/**
+ * Copyright Fractal Computers, Inc. 2021
+ * @file stun.h
+ * @brief Wire format of the Fractal hole punching protocol, shared by every
+ *        part of the STUN server
+============================
+Usage
+============================
+
+Servers send a POST_INFO stun_request_t to register the public port they can
+be reached on, clients send an ASK_INFO stun_request_t to find out the private
+port behind a server's public port. Every field is copied verbatim from and to
+the network, so ports and IPs are in network byte order.
+
+Version 2 of the protocol wraps requests in a stun_v2_header_t followed by
+num_records stun_v2_record_t, every field of which is in network byte order.
+The response echoes the header's txid and carries one record per request
+record, in the same order, with its status filled in. Version 1 datagrams are
+exactly sizeof(stun_request_t) bytes, which no version 2 datagram is, so both
+are served on the same port.
+*/
+
+/*
+============================
+Includes
+============================
+*/
+
+#include <stdint.h>
+
+/*
+============================
+Defines
+============================
+*/
+
+#define HOLEPUNCH_PORT 48800  // Fractal default holepunch port
+#define STUN_ENTRY_TIMEOUT 30000
+
+#define STUN_TCP_GO_MAGIC 0x474f2121  // "GO!!"
+// Time both ends of a TCP hole punch get, on top of the difference between
+// their one-way delays, to set up their sockets before calling connect()
+#define STUN_TCP_GO_MARGIN_US 10000
+
+#define STUN_V2_MAGIC 0x4653  // "FS"
+#define STUN_V2_VERSION 2
+#define STUN_V2_MAX_RECORDS 32
+#define STUN_V2_MAX_RANGE 1024
+#define STUN_V2_MAX_WAIT_MS 30000
+// Largest datagram of either version, request or response
+#define STUN_MAX_DATAGRAM \
+    (sizeof(stun_v2_header_t) + STUN_V2_MAX_RECORDS * sizeof(stun_v2_record_t))
+
+/*
+============================
+Custom Types
+============================
+*/
+
+// A small struct to maintain pending STUN pairs
+// private_port is the port that the client wants to connect to,
+// and public_port is what the client must actually connect to in order to
+// access the underlying private_port
+typedef struct {
+    unsigned int ip;
+    unsigned short private_port;
+    unsigned short public_port;
+} stun_entry_t;
+
+// Servers will post info about themselves, clients will ask info about servers
+typedef enum stun_request_type { ASK_INFO, POST_INFO } stun_request_type_t;
+
+typedef struct {
+    // Ask or Post
+    stun_request_type_t type;
+    // IP / priv / public
+    stun_entry_t entry;
+} stun_request_t;
+
+// Sent to a server that registered with a version 2 STUN_V2_POST over TCP,
+// right after the stun_entry_t telling it about a client. It calls connect()
+// delay_us after receiving it, and a client that asked with a version 2
+// STUN_V2_ASK over TCP waits the arg of its response, so that both SYNs cross
+// at about the same time. Version 1 requests never get one, so that their
+// responses and notifications keep their size
+typedef struct {
+    // htonl(STUN_TCP_GO_MAGIC)
+    uint32_t magic;
+    // Network byte order
+    uint32_t delay_us;
+} stun_tcp_go_t;
+
+typedef struct {
+    // htons(STUN_V2_MAGIC)
+    uint16_t magic;
+    // STUN_V2_VERSION
+    uint8_t version;
+    // Number of records that follow, 1 to STUN_V2_MAX_RECORDS
+    uint8_t num_records;
+    // Chosen by the client and echoed in the response, so that responses can
+    // be matched to retransmitted requests
+    uint32_t txid;
+} stun_v2_header_t;
+
+typedef enum stun_v2_record_type {
+    // Find the private port behind ip:public_port, and tell the server at
+    // ip:private_port about the client. With STUN_V2_ASK_WAIT, if the server
+    // hasn't registered yet, wait for it for up to arg milliseconds. Over TCP,
+    // for a server that registered with STUN_V2_POST over TCP, the response's
+    // arg is how many microseconds the client waits before connecting, see
+    // stun_tcp_go_t
+    STUN_V2_ASK = 1,
+    // Register public_port for the sender's IP, with private_port as its
+    // private port, or the sender's source port if private_port is 0. The
+    // response's arg is the number of ports registered
+    STUN_V2_POST = 2,
+    // Sent by the STUN server to a server registered with
+    // STUN_V2_POST_RELIABLE: the client at ip:private_port wants
+    // public_port. arg is 0, then the number of the retransmission
+    STUN_V2_NOTIFY = 3,
+    // Sent by a server to acknowledge the notification whose txid is arg.
+    // Datagrams made only of ACK records are not answered
+    STUN_V2_ACK = 4,
+    // Predict the next ports the NAT in front of ip will allocate, from the
+    // source ports of its recent UDP requests. The response's public_port
+    // is the last one seen and its arg is stride << 16 | count, stride being
+    // signed: try public_port + i * stride for i in 1..count. Lets a client
+    // reach a server behind a symmetric NAT by spraying those ports at once
+    STUN_V2_PREDICT = 5,
+    // NAT behavior discovery, as in RFC 5780. The response's ip and
+    // public_port are the sender's address as seen by the STUN server
+    // (MAPPED-ADDRESS), its private_port the STUN server's secondary port and
+    // its arg its secondary IP, 0 when there is none (OTHER-ADDRESS). With
+    // STUN_V2_PROBE_CHANGE_* flags, the record must be alone in its datagram
+    // and is answered from the other IP and/or port (CHANGE-REQUEST)
+    STUN_V2_PROBE = 6,
+    // Carries in arg the cookie a STUN server started with --ask-cookies
+    // answered an ASK with, proving that the sender owns its source address.
+    // One such record lets every ASK of its datagram through. Answered
+    // STUN_V2_OK, or STUN_V2_COOKIE_REQUIRED if the cookie is stale
+    STUN_V2_COOKIE = 7,
+} stun_v2_record_type_t;
+
+// Flags of STUN_V2_ASK records
+enum {
+    // Rather than answering STUN_V2_NOT_FOUND, answer STUN_V2_PENDING and
+    // wait for the server to register, for up to arg milliseconds (at most
+    // STUN_V2_MAX_WAIT_MS). The record is then answered again in a datagram
+    // of its own, with the same txid
+    STUN_V2_ASK_WAIT = 1 << 0,
+};
+
+// Flags of STUN_V2_POST records, registering several ports at once. Port
+// public_port + i gets private port private_port + i, or the sender's source
+// port if private_port is 0
+enum {
+    // Register the arg consecutive ports from public_port on, at most
+    // STUN_V2_MAX_RANGE
+    STUN_V2_POST_RANGE = 1 << 0,
+    // Register public_port + i for every bit i set in arg
+    STUN_V2_POST_BITMAP = 1 << 1,
+    // Notify the server with STUN_V2_NOTIFY records, retransmitted until it
+    // answers them with STUN_V2_ACK, rather than with a single stun_entry_t.
+    // Can be combined with either of the above
+    STUN_V2_POST_RELIABLE = 1 << 2,
+};
+
+// Flags of STUN_V2_PROBE records. A change the STUN server can't make is
+// answered STUN_V2_INVALID from the address the probe was sent to
+enum {
+    STUN_V2_PROBE_CHANGE_PORT = 1 << 0,
+    STUN_V2_PROBE_CHANGE_IP = 1 << 1,
+};
+
+typedef enum stun_v2_status {
+    STUN_V2_OK = 0,
+    STUN_V2_NOT_FOUND = 1,
+    // The registry has no room for the entry
+    STUN_V2_FULL = 2,
+    // Unknown record type or flags, or ports out of range
+    STUN_V2_INVALID = 3,
+    // The record waits for its server, see STUN_V2_ASK_WAIT
+    STUN_V2_PENDING = 4,
+    // The ASK was not looked up, resend it along with a STUN_V2_COOKIE record
+    // carrying the arg of this response
+    STUN_V2_COOKIE_REQUIRED = 5,
+} stun_v2_status_t;
+
+typedef struct {
+    // A stun_v2_record_type_t
+    uint8_t type;
+    // Options of the record, 0 for none
+    uint8_t flags;
+    // A stun_v2_status_t in responses, 0 in requests
+    uint16_t status;
+    uint32_t ip;
+    uint16_t public_port;
+    uint16_t private_port;
+    // Argument of the record, depending on its type and flags
+    uint32_t arg;
+} stun_v2_record_t;
+
+#endif  // STUN_SERVER_STUN_H
@@ -27,6 +27,7 @@ Includes
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/time.h>
@@ -138,7 +139,12 @@ int sendp(SocketContext* context, void* buf, int len) {
 
 int Ack(SocketContext* context) { return sendp(context, NULL, 0); }
 
-int CreateUDPClientContextStun(SocketContext* context, char* destination,
+const char* env_or(const char* name, const char* fallback) {
+    const char* value = getenv(name);
+    return value && *value ? value : fallback;
+}
+
+int CreateUDPClientContextStun(SocketContext* context, const char* destination,
                                int port, int recvfrom_timeout_ms,
                                int stun_timeout_ms) {
     context->is_tcp = false;
@@ -243,6 +249,103 @@ int CreateUDPServerContextStun(SocketContext* context, int port,
     return 0;
 }
 
+/**
+ * @brief           Receive exactly len bytes from the STUN server over TCP
+ *
+ * @param context   The context connected to the STUN server
+ * @param buf       Filled with the bytes received
+ * @param len       Number of bytes to receive
+ * @param timeout_ms
+ *                  How long to wait for them
+ *
+ * @return          0 on success, -1 on failure
+ */
+static int recv_tcp_stun(SocketContext* context, void* buf, int len,
+                         int timeout_ms) {
+    fractal_clock_t t;
+    FractalStartTimer(&t);
+
+    int recv_size = 0;
+    while (recv_size < len && FractalGetTimer(t) * 1000.0 < timeout_ms) {
+        int single_recv_size;
+        if ((single_recv_size = recvp(context, (char*)buf + recv_size,
+                                      len - recv_size)) <= 0) {
+            flog("Did not receive STUN response %d\n", GetLastNetworkError());
+            return -1;
+        }
+        recv_size += single_recv_size;
+    }
+
+    if (recv_size != len) {
+        flog("TCP STUN Response packet of wrong size! %d\n", recv_size);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief           Send a version 2 request of one record to the STUN server
+ *                  over TCP, and receive its response
+ *
+ * @param context   The context connected to the STUN server
+ * @param record    The record, replaced by that of the response
+ * @param timeout_ms
+ *                  How long to wait for the response
+ *
+ * @return          0 on success, -1 on failure
+ */
+static int tcp_v2_request_stun(SocketContext* context,
+                               stun_v2_record_t* record, int timeout_ms) {
+    stun_v2_header_t header = {0};
+    header.magic = htons(STUN_V2_MAGIC);
+    header.version = STUN_V2_VERSION;
+    header.num_records = 1;
+    uint8_t datagram[sizeof(header) + sizeof(*record)];
+    memcpy(datagram, &header, sizeof(header));
+    memcpy(datagram + sizeof(header), record, sizeof(*record));
+    if (sendp(context, datagram, sizeof(datagram)) < 0) {
+        flog("Could not send STUN request to connected STUN server!\n");
+        return -1;
+    }
+    if (recv_tcp_stun(context, datagram, sizeof(datagram), timeout_ms) < 0) {
+        return -1;
+    }
+    memcpy(record, datagram + sizeof(header), sizeof(*record));
+    return 0;
+}
+
+/**
+ * @brief           Receive the go signal that follows the STUN notification
+ *                  of a TCP hole punch
+ *
+ * @param context   The context connected to the STUN server
+ * @param timeout_ms
+ *                  How long to wait for it
+ * @param go_time   Set to when the go signal was received
+ *
+ * @return          How many microseconds to wait from go_time before
+ *                  connecting, 0 if the STUN server sent no go signal
+ */
+static uint32_t recv_tcp_go(SocketContext* context, int timeout_ms,
+                            fractal_clock_t* go_time) {
+    stun_tcp_go_t go = {0};
+    int ret = recv_tcp_stun(context, &go, sizeof(go), timeout_ms);
+    FractalStartTimer(go_time);
+    if (ret < 0 || go.magic != htonl(STUN_TCP_GO_MAGIC)) {
+        flog("No go signal from the STUN server, connecting right away\n");
+        return 0;
+    }
+    return ntohl(go.delay_us);
+}
+
+// Sleeps until delay_us have passed since go_time
+static void wait_for_go(fractal_clock_t go_time, uint32_t delay_us) {
+    double remaining_us = delay_us - FractalGetTimer(go_time) * 1000000.0;
+    if (remaining_us > 0) {
+        usleep((useconds_t)remaining_us);
+    }
+}
+
 bool tcp_connect(SOCKET s, struct sockaddr_in addr, int timeout_ms) {
     // Connect to TCP server
     int ret;
@@ -280,7 +383,44 @@ bool tcp_connect(SOCKET s, struct sockaddr_in addr, int timeout_ms) {
     return true;
 }
 
-int CreateTCPClientContextStun(SocketContext* context, char* destination,
+/**
+ * @brief           Connect a TCP socket to the STUN server and send it a
+ *                  request
+ *
+ * @param s         The socket
+ * @param addr      Address of the STUN server
+ * @param request   The request
+ * @param len       Its size
+ * @param fastopen  Whether to send it in the SYN, with TCP Fast Open
+ * @param timeout_ms
+ *                  How long to wait for the connection, and then for
+ *                  every recv
+ *
+ * @return          True if the request was sent
+ */
+bool tcp_request_stun(SOCKET s, struct sockaddr_in addr, const void* request,
+                      int len, bool fastopen, int timeout_ms) {
+    if (!fastopen) {
+        return tcp_connect(s, addr, timeout_ms) &&
+               send(s, request, len, 0) == len;
+    }
+
+    // Connects and sends the request in the SYN if a cookie from an earlier
+    // connection is cached, or asks for one and sends it once connected
+    set_timeout(s, timeout_ms);
+    fractal_clock_t send_timeout = FractalCreateClock(timeout_ms);
+    setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, (const char*)&send_timeout,
+               sizeof(send_timeout));
+    if (sendto(s, request, len, MSG_FASTOPEN, (struct sockaddr*)&addr,
+               sizeof(addr)) != len) {
+        flog("Could not send a TCP Fast Open request: Error Code %d\n",
+             GetLastNetworkError());
+        return false;
+    }
+    return true;
+}
+
+int CreateTCPClientContextStun(SocketContext* context, const char* destination,
                                int port, int recvfrom_timeout_ms,
                                int stun_timeout_ms) {
     if (context == NULL) {
@@ -338,43 +478,22 @@ int CreateTCPClientContextStun(SocketContext* context, char* destination,
         return -1;
     }
 
-    // Make STUN request
-    stun_request_t stun_request;
-    stun_request.type = ASK_INFO;
-    stun_request.entry.ip = inet_addr(destination);
-    stun_request.entry.public_port = htons((unsigned short)port);
-
-    if (sendp(context, &stun_request, sizeof(stun_request)) < 0) {
-        flog("Could not send STUN request to connected STUN server!");
+    // Make a version 2 STUN request, whose response carries the delay of the
+    // go signal
+    stun_v2_record_t record = {0};
+    record.type = STUN_V2_ASK;
+    record.ip = inet_addr(destination);
+    record.public_port = htons((unsigned short)port);
+    if (tcp_v2_request_stun(context, &record, stun_timeout_ms) < 0) {
         closesocket(context->s);
         return -1;
     }
-
-    // Receive STUN response
-    fractal_clock_t t;
-    FractalStartTimer(&t);
-
-    int recv_size = 0;
+    fractal_clock_t go_time;
+    FractalStartTimer(&go_time);
+    uint32_t go_delay_us = ntohl(record.arg);
     stun_entry_t entry = {0};
-
-    while (recv_size < (int)sizeof(entry) &&
-           FractalGetTimer(t) < stun_timeout_ms) {
-        int single_recv_size;
-        if ((single_recv_size = recvp(context, ((char*)&entry) + recv_size,
-                                      max(0, (int)sizeof(entry) - recv_size))) <
-            0) {
-            flog("Did not receive STUN response %d\n", GetLastNetworkError());
-            closesocket(context->s);
-            return -1;
-        }
-        recv_size += single_recv_size;
-    }
-
-    if (recv_size != sizeof(entry)) {
-        flog("TCP STUN Response packet of wrong size! %d\n", recv_size);
-        closesocket(context->s);
-        return -1;
-    }
+    entry.ip = record.ip;
+    entry.private_port = record.private_port;
 
     // Print STUN response
     struct in_addr a;
@@ -412,8 +531,7 @@ int CreateTCPClientContextStun(SocketContext* context, char* destination,
     context->addr.sin_port = entry.private_port;
 
     flog("Connecting to server...\n");
-
-    sleep(0.200);
+    wait_for_go(go_time, go_delay_us);
 
     // Connect to TCP server
     if (!tcp_connect(context->s, context->addr, stun_timeout_ms)) {
@@ -480,43 +598,24 @@ int CreateTCPServerContextStun(SocketContext* context, int port,
         return -1;
     }
 
-    // Send STUN request
-    stun_request_t stun_request;
-    stun_request.type = POST_INFO;
-    stun_request.entry.public_port = htons((unsigned short)port);
-
-    if (sendp(context, &stun_request, sizeof(stun_request)) < 0) {
-        flog("Could not send STUN request to connected STUN server!\n");
+    // Register with version 2, so that the notification is followed by a go
+    // signal
+    stun_v2_record_t record = {0};
+    record.type = STUN_V2_POST;
+    record.public_port = htons((unsigned short)port);
+    if (tcp_v2_request_stun(context, &record, stun_timeout_ms) < 0) {
         closesocket(context->s);
         return -1;
     }
 
-    sleep(1);
-    // Receive STUN response
-    fractal_clock_t t;
-    FractalStartTimer(&t);
-
-    int recv_size = 0;
+    // Receive STUN notification
     stun_entry_t entry = {0};
-
-    while (recv_size < (int)sizeof(entry) &&
-           FractalGetTimer(t) < stun_timeout_ms) {
-        int single_recv_size;
-        if ((single_recv_size = recvp(context, ((char*)&entry) + recv_size,
-                                      max(0, (int)sizeof(entry) - recv_size))) <
-            0) {
-            flog("Did not receive STUN response %d\n", GetLastNetworkError());
-            closesocket(context->s);
-            return -1;
-        }
-        recv_size += single_recv_size;
-    }
-
-    if (recv_size != sizeof(entry)) {
-        flog("TCP STUN Response packet of wrong size! %d\n", recv_size);
+    if (recv_tcp_stun(context, &entry, sizeof(entry), stun_timeout_ms) < 0) {
         closesocket(context->s);
         return -1;
     }
+    fractal_clock_t go_time;
+    uint32_t go_delay_us = recv_tcp_go(context, stun_timeout_ms, &go_time);
 
     // Print STUN response
     struct sockaddr_in client_addr;
@@ -550,7 +649,7 @@ int CreateTCPServerContextStun(SocketContext* context, int port,
         return -1;
     }
 
-    flog("WAIT");
+    wait_for_go(go_time, go_delay_us);
 
     // Connect to client
     if (!tcp_connect(context->s, client_addr, stun_timeout_ms)) {
@@ -23,6 +23,7 @@ Includes
 #include <netinet/in.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/socket.h>
 
 /*
@@ -40,7 +41,11 @@ Defines
 #define FRACTAL_EAGAIN EAGAIN
 #define FRACTAL_EINPROGRESS EINPROGRESS
 
-#define STUN_IP "127.0.0.1"
+// Address of the STUN server, and address of this machine as seen by the STUN
+// server. The STUN_IP and LOCAL_IP environment variables override them, e.g.
+// to test a server on the other side of a veth pair
+#define STUN_IP env_or("STUN_IP", "127.0.0.1")
+#define LOCAL_IP env_or("LOCAL_IP", "127.0.0.1")
 #define STUN_PORT 48800
 
 /*
@@ -62,6 +67,67 @@ typedef struct {
     stun_entry_t entry;
 } stun_request_t;
 
+#define STUN_TCP_GO_MAGIC 0x474f2121
+
+typedef struct {
+    uint32_t magic;
+    uint32_t delay_us;
+} stun_tcp_go_t;
+
+#define STUN_V2_MAGIC 0x4653
+#define STUN_V2_VERSION 2
+
+typedef struct {
+    uint16_t magic;
+    uint8_t version;
+    uint8_t num_records;
+    uint32_t txid;
+} stun_v2_header_t;
+
+typedef enum stun_v2_record_type {
+    STUN_V2_ASK = 1,
+    STUN_V2_POST = 2,
+    STUN_V2_NOTIFY = 3,
+    STUN_V2_ACK = 4,
+    STUN_V2_PREDICT = 5,
+    STUN_V2_PROBE = 6,
+    STUN_V2_COOKIE = 7,
+} stun_v2_record_type_t;
+
+enum {
+    STUN_V2_ASK_WAIT = 1 << 0,
+};
+
+enum {
+    STUN_V2_POST_RANGE = 1 << 0,
+    STUN_V2_POST_BITMAP = 1 << 1,
+    STUN_V2_POST_RELIABLE = 1 << 2,
+};
+
+enum {
+    STUN_V2_PROBE_CHANGE_PORT = 1 << 0,
+    STUN_V2_PROBE_CHANGE_IP = 1 << 1,
+};
+
+typedef enum stun_v2_status {
+    STUN_V2_OK = 0,
+    STUN_V2_NOT_FOUND = 1,
+    STUN_V2_FULL = 2,
+    STUN_V2_INVALID = 3,
+    STUN_V2_PENDING = 4,
+    STUN_V2_COOKIE_REQUIRED = 5,
+} stun_v2_status_t;
+
+typedef struct {
+    uint8_t type;
+    uint8_t flags;
+    uint16_t status;
+    uint32_t ip;
+    uint16_t public_port;
+    uint16_t private_port;
+    uint32_t arg;
+} stun_v2_record_t;
+
 typedef struct SocketContext {
     bool is_server;
     bool is_tcp;
@@ -76,14 +142,16 @@ Public Functions
 ============================
 */
 
-int CreateUDPClientContextStun(SocketContext* context, char* destination,
+const char* env_or(const char* name, const char* fallback);
+
+int CreateUDPClientContextStun(SocketContext* context, const char* destination,
                                int port, int recvfrom_timeout_ms,
                                int stun_timeout_ms);
 
 int CreateUDPServerContextStun(SocketContext* context, int port,
                                int recvfrom_timeout_ms, int stun_timeout_ms);
 
-int CreateTCPClientContextStun(SocketContext* context, char* destination,
+int CreateTCPClientContextStun(SocketContext* context, const char* destination,
                                int port, int recvfrom_timeout_ms,
                                int stun_timeout_ms);
 
@@ -92,4 +160,7 @@ int CreateTCPServerContextStun(SocketContext* context, int port,
 
 int Ack(SocketContext* context);
 
+bool tcp_request_stun(SOCKET s, struct sockaddr_in addr, const void* request,
+                      int len, bool fastopen, int timeout_ms);
+
 #endif  // STUN_SERVER_TEST_NETWORK_H
@@ -3,7 +3,7 @@
  * @file test_stun.c
  * @brief A set of tests to be run on github actions or locally. These tests
  *        assume a stun server running on the same machine accessible at
- *        127.0.0.1
+ *        127.0.0.1, or at STUN_IP if set
  **/
 
 /*
@@ -12,7 +12,13 @@ Includes
 ============================
 */
 
+#include <errno.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <unistd.h>
 
 #include "network.h"
@@ -28,6 +34,49 @@ Defines
 #define PORT_SERVER_TO_CLIENT 32263
 #define PORT_CLIENT_TO_SERVER 32262
 #define TCP_PORT 32264
+#define PORT_SHARED_REGISTRY 32265
+#define PORT_V2_FIRST 32266
+#define PORT_V2_SECOND 32267
+#define PORT_V2_MISSING 32268
+#define PORT_LONG_POLL 32269
+#define PORT_RELIABLE 32270
+#define PORT_COOKIE 32271
+#define PORT_OTHER_SHARD 32272
+#define PORT_TCP_FIRST 32273
+#define PORT_TCP_SECOND 32274
+#define PORT_SLOW_PEER 32275
+#define PORT_TCP_HUNG_UP 32276
+#define PORT_STALLED_PEER 32277
+#define PORT_TCP_V1 32278
+// Requests sent by a TCP peer that never reads their responses
+#define SLOW_PEER_REQUESTS 4000
+// How long such a peer waits to be shut down, with room past
+// OUTBOUND_TIMEOUT_MS for the STUN server to go through its requests
+#define STALLED_PEER_WAIT_MS 8000
+// Ports registered in bulk, to private ports from PORT_BULK_PRIVATE on
+#define PORT_BULK_FIRST 33000
+#define PORT_BULK_COUNT 300
+#define PORT_BULK_BITMAP 34000
+#define PORT_BULK_PRIVATE 40000
+// Source ports of the requests a symmetric NAT is pretended to allocate
+#define PORT_PREDICT_FIRST 36000
+#define PORT_PREDICT_STRIDE 7
+#define PORT_PREDICT_COUNT 5
+
+// A second STUN process sharing its registry with the one on STUN_PORT
+#define STUN_SHARED_PORT 48801
+// A third one, started with --ask-cookies and --tcp-max-per-ip=2
+#define STUN_COOKIE_PORT 48803
+#define STUN_COOKIE_MAX_PER_IP 2
+// TCP exchanges timed with and without TCP Fast Open
+#define TCP_FASTOPEN_ROUNDS 20
+
+// A loopback IP that two workers steer to the other one than LOCAL_IP
+#define OTHER_SHARD_IP "127.0.0.5"
+// An IP no server ever registers from, and the log the STUN servers append to
+// in the working directory they share with the tests
+#define UNREGISTERED_IP "192.0.2.1"
+#define STUN_LOG "log.txt"
 
 // Unity basics
 void setUp(void) { int b = 2; }
@@ -45,7 +94,7 @@ Public Functions
  *                   the stun
  */
 void test_UDP_server_context(void) {
-    char destination[] = "127.0.0.1";
+    const char* destination = LOCAL_IP;
     SocketContext context;
     int result =
         CreateUDPServerContextStun(&context, PORT_SERVER_TO_CLIENT, 10, 500);
@@ -58,7 +107,7 @@ void test_UDP_server_context(void) {
  *                   test_UDP_server_context to pass
  */
 void test_UDP_client_context(void) {
-    char destination[] = "127.0.0.1";
+    const char* destination = LOCAL_IP;
     SocketContext context;
     int result = CreateUDPClientContextStun(&context, destination,
                                             PORT_CLIENT_TO_SERVER, 10, 500);
@@ -87,8 +136,8 @@ void test_TCP_server_context_no_client(void) {
 void *server_TCP_loop(void *args) {
     SocketContext context;
     while (1) {
-        int result = CreateTCPServerContextStun(&context, TCP_PORT, 500, 500);
-        sleep(2);
+        // The STUN timeout covers the wait for the client's ASK_INFO
+        int result = CreateTCPServerContextStun(&context, TCP_PORT, 500, 2000);
 
         if (result >= 0) {
             Ack(&context);
@@ -105,20 +154,1076 @@ void test_TCP_client_context(void) {
     pthread_t thread_id;
     pthread_create(&thread_id, NULL, server_TCP_loop, NULL);
     SocketContext context;
-    char destination[] = "127.0.0.1";
-    sleep(1);
+    const char* destination = LOCAL_IP;
+    // Give the server time to POST_INFO
+    usleep(100000);
     CreateTCPClientContextStun(&context, destination, TCP_PORT, 500, 500);
     pthread_join(thread_id, NULL);
 }
 
+/**
+ * @brief           Create a UDP socket that gives up on recv after timeout_ms
+ *
+ * @param timeout_ms The receive timeout
+ *
+ * @return          The socket
+ */
+SOCKET udp_socket_with_timeout(int timeout_ms) {
+    SOCKET s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    struct timeval timeout;
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_usec = (timeout_ms % 1000) * 1000;
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    return s;
+}
+
+/**
+ * @brief           Register a server with one STUN process and look it up
+ *                  through another one sharing the same registry. Requires
+ *                  both to run with the same --shm-registry
+ */
+void test_shared_registry(void) {
+    struct sockaddr_in stun_addr;
+    stun_addr.sin_family = AF_INET;
+    stun_addr.sin_addr.s_addr = inet_addr(STUN_IP);
+
+    // POST_INFO to the first STUN process
+    SOCKET server = udp_socket_with_timeout(500);
+    stun_request_t post_request = {0};
+    post_request.type = POST_INFO;
+    post_request.entry.public_port = htons(PORT_SHARED_REGISTRY);
+    stun_addr.sin_port = htons(STUN_PORT);
+    TEST_ASSERT_EQUAL_INT(
+        sizeof(post_request),
+        sendto(server, &post_request, sizeof(post_request), 0,
+               (struct sockaddr*)&stun_addr, sizeof(stun_addr)));
+    struct sockaddr_in server_addr;
+    socklen_t slen = sizeof(server_addr);
+    getsockname(server, (struct sockaddr*)&server_addr, &slen);
+    usleep(100 * 1000);
+
+    // ASK_INFO from the second one
+    SOCKET client = udp_socket_with_timeout(500);
+    stun_request_t ask_request = {0};
+    ask_request.type = ASK_INFO;
+    ask_request.entry.ip = inet_addr(LOCAL_IP);
+    ask_request.entry.public_port = htons(PORT_SHARED_REGISTRY);
+    stun_addr.sin_port = htons(STUN_SHARED_PORT);
+    TEST_ASSERT_EQUAL_INT(
+        sizeof(ask_request),
+        sendto(client, &ask_request, sizeof(ask_request), 0,
+               (struct sockaddr*)&stun_addr, sizeof(stun_addr)));
+
+    stun_entry_t entry = {0};
+    TEST_ASSERT_EQUAL_INT(sizeof(entry),
+                          recv(client, &entry, sizeof(entry), 0));
+    TEST_ASSERT_EQUAL_INT(server_addr.sin_port, entry.private_port);
+
+    // The server is told about the client by the second process
+    struct sockaddr_in client_addr;
+    slen = sizeof(client_addr);
+    getsockname(client, (struct sockaddr*)&client_addr, &slen);
+    TEST_ASSERT_EQUAL_INT(sizeof(entry),
+                          recv(server, &entry, sizeof(entry), 0));
+    TEST_ASSERT_EQUAL_INT(client_addr.sin_port, entry.private_port);
+
+    closesocket(server);
+    closesocket(client);
+}
+
+/**
+ * @brief           Send datagrams that aren't requests, which the server must
+ *                  drop, then check that it still answers a real request
+ */
+void test_malformed_requests_dropped(void) {
+    struct sockaddr_in stun_addr;
+    stun_addr.sin_family = AF_INET;
+    stun_addr.sin_addr.s_addr = inet_addr(STUN_IP);
+    stun_addr.sin_port = htons(STUN_PORT);
+    SOCKET client = udp_socket_with_timeout(500);
+
+    // Empty, too short, too long and of an unknown type
+    char junk[sizeof(stun_request_t) + 1] = {0};
+    int lengths[] = {0, sizeof(stun_request_t) - 1, sizeof(stun_request_t) + 1,
+                     sizeof(stun_request_t)};
+    *(int*)junk = 7;
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+        TEST_ASSERT_EQUAL_INT(
+            lengths[i], sendto(client, junk, lengths[i], 0,
+                               (struct sockaddr*)&stun_addr,
+                               sizeof(stun_addr)));
+    }
+
+    stun_request_t ask_request = {0};
+    ask_request.type = ASK_INFO;
+    ask_request.entry.ip = inet_addr(LOCAL_IP);
+    ask_request.entry.public_port = htons(1);
+    TEST_ASSERT_EQUAL_INT(
+        sizeof(ask_request),
+        sendto(client, &ask_request, sizeof(ask_request), 0,
+               (struct sockaddr*)&stun_addr, sizeof(stun_addr)));
+    stun_entry_t entry;
+    TEST_ASSERT_EQUAL_INT(sizeof(entry),
+                          recv(client, &entry, sizeof(entry), 0));
+    TEST_ASSERT_EQUAL_INT(htons(1), entry.public_port);
+    TEST_ASSERT_EQUAL_INT(0, entry.private_port);
+
+    closesocket(client);
+}
+
+// Size of a version 2 datagram of n records
+#define V2_SIZE(n) (sizeof(stun_v2_header_t) + (n) * sizeof(stun_v2_record_t))
+
+// A version 2 datagram
+typedef struct {
+    stun_v2_header_t header;
+    stun_v2_record_t records[4];
+} v2_datagram_t;
+
+/**
+ * @brief           Send a version 2 request and receive its response
+ *
+ * @param s         The socket
+ * @param request   The request, with num_records records
+ * @param response  Filled with the response
+ *
+ * @return          The size of the response
+ */
+int v2_exchange(SOCKET s, v2_datagram_t* request, v2_datagram_t* response) {
+    struct sockaddr_in stun_addr;
+    stun_addr.sin_family = AF_INET;
+    stun_addr.sin_addr.s_addr = inet_addr(STUN_IP);
+    stun_addr.sin_port = htons(STUN_PORT);
+    request->header.magic = htons(STUN_V2_MAGIC);
+    request->header.version = STUN_V2_VERSION;
+    int size = V2_SIZE(request->header.num_records);
+    TEST_ASSERT_EQUAL_INT(size, sendto(s, request, size, 0,
+                                       (struct sockaddr*)&stun_addr,
+                                       sizeof(stun_addr)));
+    return recv(s, response, sizeof(*response), 0);
+}
+
+/**
+ * @brief           Register two ports in one version 2 datagram, then look
+ *                  them up along with a missing one in another
+ */
+void test_v2_batch(void) {
+    v2_datagram_t request, response;
+    SOCKET server = udp_socket_with_timeout(500);
+    memset(&request, 0, sizeof(request));
+    request.header.num_records = 2;
+    request.header.txid = htonl(1234);
+    request.records[0].type = STUN_V2_POST;
+    request.records[0].public_port = htons(PORT_V2_FIRST);
+    request.records[1].type = STUN_V2_POST;
+    request.records[1].public_port = htons(PORT_V2_SECOND);
+    TEST_ASSERT_EQUAL_INT(V2_SIZE(2), v2_exchange(server, &request, &response));
+    TEST_ASSERT_EQUAL_INT(htonl(1234), response.header.txid);
+    TEST_ASSERT_EQUAL_INT(STUN_V2_OK, ntohs(response.records[0].status));
+    TEST_ASSERT_EQUAL_INT(STUN_V2_OK, ntohs(response.records[1].status));
+    struct sockaddr_in server_addr;
+    socklen_t slen = sizeof(server_addr);
+    getsockname(server, (struct sockaddr*)&server_addr, &slen);
+
+    SOCKET client = udp_socket_with_timeout(500);
+    memset(&request, 0, sizeof(request));
+    request.header.num_records = 4;
+    request.header.txid = htonl(5678);
+    uint16_t ports[] = {PORT_V2_FIRST, PORT_V2_SECOND, PORT_V2_MISSING};
+    for (int i = 0; i < 3; i++) {
+        request.records[i].type = STUN_V2_ASK;
+        request.records[i].ip = inet_addr(LOCAL_IP);
+        request.records[i].public_port = htons(ports[i]);
+    }
+    request.records[3].type = 42;
+    TEST_ASSERT_EQUAL_INT(V2_SIZE(4), v2_exchange(client, &request, &response));
+    TEST_ASSERT_EQUAL_INT(htonl(5678), response.header.txid);
+    TEST_ASSERT_EQUAL_INT(4, response.header.num_records);
+    TEST_ASSERT_EQUAL_INT(STUN_V2_OK, ntohs(response.records[0].status));
+    TEST_ASSERT_EQUAL_INT(server_addr.sin_port,
+                          response.records[0].private_port);
+    TEST_ASSERT_EQUAL_INT(STUN_V2_OK, ntohs(response.records[1].status));
+    TEST_ASSERT_EQUAL_INT(server_addr.sin_port,
+                          response.records[1].private_port);
+    TEST_ASSERT_EQUAL_INT(STUN_V2_NOT_FOUND, ntohs(response.records[2].status));
+    TEST_ASSERT_EQUAL_INT(0, response.records[2].private_port);
+    TEST_ASSERT_EQUAL_INT(STUN_V2_INVALID, ntohs(response.records[3].status));
+
+    // The server is told about the client once per port found
+    struct sockaddr_in client_addr;
+    slen = sizeof(client_addr);
+    getsockname(client, (struct sockaddr*)&client_addr, &slen);
+    for (int i = 0; i < 2; i++) {
+        stun_entry_t entry = {0};
+        TEST_ASSERT_EQUAL_INT(sizeof(entry),
+                              recv(server, &entry, sizeof(entry), 0));
+        TEST_ASSERT_EQUAL_INT(client_addr.sin_port, entry.private_port);
+    }
+
+    closesocket(server);
+    closesocket(client);
+}
+
+/**
+ * @brief           Ask for servers that never registered, which the filter
+ *                  must answer before the server logs anything
+ */
+void test_filtered_asks_not_logged(void) {
+    struct stat before, after;
+    if (stat(STUN_LOG, &before) < 0) {
+        TEST_IGNORE_MESSAGE("The servers' log isn't in the working directory");
+    }
+    struct sockaddr_in stun_addr;
+    stun_addr.sin_family = AF_INET;
+    stun_addr.sin_addr.s_addr = inet_addr(STUN_IP);
+    stun_addr.sin_port = htons(STUN_PORT);
+    SOCKET client = udp_socket_with_timeout(500);
+
+    stun_request_t ask_request = {0};
+    ask_request.type = ASK_INFO;
+    ask_request.entry.ip = inet_addr(UNREGISTERED_IP);
+    ask_request.entry.public_port = htons(PORT_V2_MISSING);
+    TEST_ASSERT_EQUAL_INT(
+        sizeof(ask_request),
+        sendto(client, &ask_request, sizeof(ask_request), 0,
+               (struct sockaddr*)&stun_addr, sizeof(stun_addr)));
+    stun_entry_t entry;
+    TEST_ASSERT_EQUAL_INT(sizeof(entry),
+                          recv(client, &entry, sizeof(entry), 0));
+    TEST_ASSERT_EQUAL_INT(0, entry.private_port);
+
+    v2_datagram_t request, response;
+    memset(&request, 0, sizeof(request));
+    request.header.num_records = 2;
+    for (int i = 0; i < 2; i++) {
+        request.records[i].type = STUN_V2_ASK;
+        request.records[i].ip = inet_addr(UNREGISTERED_IP);
+        request.records[i].public_port = htons(PORT_V2_MISSING + i);
+    }
+    TEST_ASSERT_EQUAL_INT(V2_SIZE(2), v2_exchange(client, &request, &response));
+    TEST_ASSERT_EQUAL_INT(STUN_V2_NOT_FOUND, ntohs(response.records[0].status));
+    TEST_ASSERT_EQUAL_INT(STUN_V2_NOT_FOUND, ntohs(response.records[1].status));
+
+    // Anything logged would have been before the responses were sent
+    TEST_ASSERT_EQUAL_INT(0, stat(STUN_LOG, &after));
+    TEST_ASSERT_EQUAL_INT(before.st_size, after.st_size);
+
+    closesocket(client);
+}
+
+/**
+ * @brief           Register hundreds of ports of one IP with a range and a
+ *                  bitmap record, then look some of them up
+ */
+void test_v2_bulk_post(void) {
+    v2_datagram_t request, response;
+    SOCKET server = udp_socket_with_timeout(500);
+    memset(&request, 0, sizeof(request));
+    request.header.num_records = 2;
+    request.records[0].type = STUN_V2_POST;
+    request.records[0].flags = STUN_V2_POST_RANGE;
+    request.records[0].public_port = htons(PORT_BULK_FIRST);
+    request.records[0].private_port = htons(PORT_BULK_PRIVATE);
+    request.records[0].arg = htonl(PORT_BULK_COUNT);
+    // Ports PORT_BULK_BITMAP + 0, 2 and 31, to the POST's source port
+    request.records[1].type = STUN_V2_POST;
+    request.records[1].flags = STUN_V2_POST_BITMAP;
+    request.records[1].public_port = htons(PORT_BULK_BITMAP);
+    request.records[1].arg = htonl(0x80000005);
+    TEST_ASSERT_EQUAL_INT(V2_SIZE(2), v2_exchange(server, &request, &response));
+    TEST_ASSERT_EQUAL_INT(STUN_V2_OK, ntohs(response.records[0].status));
+    TEST_ASSERT_EQUAL_INT(PORT_BULK_COUNT, ntohl(response.records[0].arg));
+    TEST_ASSERT_EQUAL_INT(STUN_V2_OK, ntohs(response.records[1].status));
+    TEST_ASSERT_EQUAL_INT(3, ntohl(response.records[1].arg));
+    struct sockaddr_in server_addr;
+    socklen_t slen = sizeof(server_addr);
+    getsockname(server, (struct sockaddr*)&server_addr, &slen);
+
+    SOCKET client = udp_socket_with_timeout(500);
+    uint16_t ports[] = {PORT_BULK_FIRST + PORT_BULK_COUNT - 1,
+                        PORT_BULK_FIRST + PORT_BULK_COUNT,
+                        PORT_BULK_BITMAP + 31, PORT_BULK_BITMAP + 1};
+    memset(&request, 0, sizeof(request));
+    request.header.num_records = 4;
+    for (int i = 0; i < 4; i++) {
+        request.records[i].type = STUN_V2_ASK;
+        request.records[i].ip = inet_addr(LOCAL_IP);
+        request.records[i].public_port = htons(ports[i]);
+    }
+    TEST_ASSERT_EQUAL_INT(V2_SIZE(4), v2_exchange(client, &request, &response));
+    TEST_ASSERT_EQUAL_INT(STUN_V2_OK, ntohs(response.records[0].status));
+    TEST_ASSERT_EQUAL_INT(htons(PORT_BULK_PRIVATE + PORT_BULK_COUNT - 1),
+                          response.records[0].private_port);
+    TEST_ASSERT_EQUAL_INT(STUN_V2_NOT_FOUND, ntohs(response.records[1].status));
+    TEST_ASSERT_EQUAL_INT(STUN_V2_OK, ntohs(response.records[2].status));
+    TEST_ASSERT_EQUAL_INT(server_addr.sin_port,
+                          response.records[2].private_port);
+    TEST_ASSERT_EQUAL_INT(STUN_V2_NOT_FOUND, ntohs(response.records[3].status));
+
+    closesocket(server);
+    closesocket(client);
+}
+
 /**
  * @brief          Run the Unity tests
  */
+/**
+ * @brief           Long-poll for a server that registers after the ASK, and
+ *                  for one that never does
+ */
+void test_v2_long_poll(void) {
+    v2_datagram_t request, response;
+    SOCKET client = udp_socket_with_timeout(2000);
+    memset(&request, 0, sizeof(request));
+    request.header.num_records = 1;
+    request.header.txid = htonl(4321);
+    request.records[0].type = STUN_V2_ASK;
+    request.records[0].flags = STUN_V2_ASK_WAIT;
+    request.records[0].ip = inet_addr(LOCAL_IP);
+    request.records[0].public_port = htons(PORT_LONG_POLL);
+    request.records[0].arg = htonl(5000);
+    TEST_ASSERT_EQUAL_INT(V2_SIZE(1), v2_exchange(client, &request, &response));
+    TEST_ASSERT_EQUAL_INT(STUN_V2_PENDING, ntohs(response.records[0].status));
+
+    // The POST answers the waiting ASK right away, and the server is told
+    // about the client, possibly before its POST is answered
+    v2_datagram_t post, post_response;
+    SOCKET server = udp_socket_with_timeout(2000);
+    memset(&post, 0, sizeof(post));
+    post.header.num_records = 1;
+    post.records[0].type = STUN_V2_POST;
+    post.records[0].public_port = htons(PORT_LONG_POLL);
+    int sizes = v2_exchange(server, &post, &post_response);
+    sizes += recv(server, &post_response, sizeof(post_response), 0);
+    TEST_ASSERT_EQUAL_INT(V2_SIZE(1) + sizeof(stun_entry_t), sizes);
+    struct sockaddr_in server_addr;
+    socklen_t slen = sizeof(server_addr);
+    getsockname(server, (struct sockaddr*)&server_addr, &slen);
+
+    TEST_ASSERT_EQUAL_INT(V2_SIZE(1),
+                          recv(client, &response, sizeof(response), 0));
+    TEST_ASSERT_EQUAL_INT(htonl(4321), response.header.txid);
+    TEST_ASSERT_EQUAL_INT(STUN_V2_OK, ntohs(response.records[0].status));
+    TEST_ASSERT_EQUAL_INT(server_addr.sin_port,
+                          response.records[0].private_port);
+
+    // A server that never registers times the ASK out
+    request.header.txid = htonl(8765);
+    request.records[0].public_port = htons(PORT_V2_MISSING);
+    request.records[0].arg = htonl(100);
+    TEST_ASSERT_EQUAL_INT(V2_SIZE(1), v2_exchange(client, &request, &response));
+    TEST_ASSERT_EQUAL_INT(STUN_V2_PENDING, ntohs(response.records[0].status));
+    TEST_ASSERT_EQUAL_INT(V2_SIZE(1),
+                          recv(client, &response, sizeof(response), 0));
+    TEST_ASSERT_EQUAL_INT(htonl(8765), response.header.txid);
+    TEST_ASSERT_EQUAL_INT(STUN_V2_NOT_FOUND, ntohs(response.records[0].status));
+
+    closesocket(server);
+    closesocket(client);
+}
+
+/**
+ * @brief           Have a server that registered with STUN_V2_POST_RELIABLE
+ *                  get its notification again until it acknowledges it
+ */
+void test_v2_reliable_notification(void) {
+    v2_datagram_t request, response;
+    SOCKET server = udp_socket_with_timeout(500);
+    memset(&request, 0, sizeof(request));
+    request.header.num_records = 1;
+    request.records[0].type = STUN_V2_POST;
+    request.records[0].flags = STUN_V2_POST_RELIABLE;
+    request.records[0].public_port = htons(PORT_RELIABLE);
+    TEST_ASSERT_EQUAL_INT(V2_SIZE(1), v2_exchange(server, &request, &response));
+    TEST_ASSERT_EQUAL_INT(STUN_V2_OK, ntohs(response.records[0].status));
+
+    SOCKET client = udp_socket_with_timeout(500);
+    request.records[0].type = STUN_V2_ASK;
+    request.records[0].flags = 0;
+    request.records[0].ip = inet_addr(LOCAL_IP);
+    TEST_ASSERT_EQUAL_INT(V2_SIZE(1), v2_exchange(client, &request, &response));
+    TEST_ASSERT_EQUAL_INT(STUN_V2_OK, ntohs(response.records[0].status));
+    struct sockaddr_in client_addr;
+    socklen_t slen = sizeof(client_addr);
+    getsockname(client, (struct sockaddr*)&client_addr, &slen);
+
+    // The first transmission is left unacknowledged, so it comes again
+    v2_datagram_t notification, retransmission;
+    TEST_ASSERT_EQUAL_INT(V2_SIZE(1), recv(server, &notification,
+                                           sizeof(notification), 0));
+    TEST_ASSERT_EQUAL_INT(STUN_V2_NOTIFY, notification.records[0].type);
+    TEST_ASSERT_EQUAL_INT(client_addr.sin_port,
+                          notification.records[0].private_port);
+    TEST_ASSERT_EQUAL_INT(htons(PORT_RELIABLE),
+                          notification.records[0].public_port);
+    TEST_ASSERT_EQUAL_INT(0, notification.records[0].arg);
+    TEST_ASSERT_EQUAL_INT(V2_SIZE(1), recv(server, &retransmission,
+                                           sizeof(retransmission), 0));
+    TEST_ASSERT_EQUAL_INT(notification.header.txid,
+                          retransmission.header.txid);
+    TEST_ASSERT_EQUAL_INT(htonl(1), retransmission.records[0].arg);
+
+    // Once acknowledged, it stops, and the ACK itself isn't answered
+    struct sockaddr_in stun_addr;
+    stun_addr.sin_family = AF_INET;
+    stun_addr.sin_addr.s_addr = inet_addr(STUN_IP);
+    stun_addr.sin_port = htons(STUN_PORT);
+    memset(&request, 0, sizeof(request));
+    request.header.magic = htons(STUN_V2_MAGIC);
+    request.header.version = STUN_V2_VERSION;
+    request.header.num_records = 1;
+    request.records[0].type = STUN_V2_ACK;
+    request.records[0].arg = notification.header.txid;
+    TEST_ASSERT_EQUAL_INT(V2_SIZE(1), sendto(server, &request, V2_SIZE(1), 0,
+                                             (struct sockaddr*)&stun_addr,
+                                             sizeof(stun_addr)));
+    TEST_ASSERT_EQUAL_INT(-1, recv(server, &response, sizeof(response), 0));
+
+    closesocket(server);
+    closesocket(client);
+}
+
+/**
+ * @brief           Connect a TCP socket to the STUN server, giving up on recv
+ *                  after timeout_ms
+ */
+static SOCKET tcp_socket_to_stun(int timeout_ms) {
+    SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    struct timeval timeout = {0, timeout_ms * 1000};
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    struct sockaddr_in stun_addr = {0};
+    stun_addr.sin_family = AF_INET;
+    stun_addr.sin_addr.s_addr = inet_addr(STUN_IP);
+    stun_addr.sin_port = htons(STUN_PORT);
+    TEST_ASSERT_EQUAL_INT(
+        0, connect(s, (struct sockaddr*)&stun_addr, sizeof(stun_addr)));
+    return s;
+}
+
+/**
+ * @brief           Register and look up a server with version 1 over TCP,
+ *                  and check that both ends get a bare stun_entry_t, with no
+ *                  go signal after it
+ */
+void test_TCP_v1_unchanged(void) {
+    SOCKET server = tcp_socket_to_stun(100);
+    stun_request_t request = {0};
+    request.type = POST_INFO;
+    request.entry.public_port = htons(PORT_TCP_V1);
+    TEST_ASSERT_EQUAL_INT(sizeof(request),
+                          send(server, &request, sizeof(request), 0));
+    usleep(50000);
+
+    SOCKET client = tcp_socket_to_stun(100);
+    request.type = ASK_INFO;
+    request.entry.ip = inet_addr(LOCAL_IP);
+    TEST_ASSERT_EQUAL_INT(sizeof(request),
+                          send(client, &request, sizeof(request), 0));
+    stun_entry_t entry;
+    TEST_ASSERT_EQUAL_INT(sizeof(entry),
+                          recv(client, &entry, sizeof(entry), MSG_WAITALL));
+    TEST_ASSERT_NOT_EQUAL(0, entry.private_port);
+    TEST_ASSERT_EQUAL_INT(sizeof(entry),
+                          recv(server, &entry, sizeof(entry), MSG_WAITALL));
+
+    uint8_t extra;
+    TEST_ASSERT_EQUAL_INT(-1, recv(client, &extra, 1, 0));
+    TEST_ASSERT_EQUAL_INT(-1, recv(server, &extra, 1, 0));
+    closesocket(client);
+    closesocket(server);
+}
+
+/**
+ * @brief           Send requests from ports PORT_PREDICT_STRIDE apart, as a
+ *                  symmetric NAT would allocate them, and have the next ones
+ *                  predicted
+ */
+void test_v2_port_prediction(void) {
+    v2_datagram_t request, response;
+    memset(&request, 0, sizeof(request));
+    request.header.num_records = 1;
+    request.records[0].type = STUN_V2_PREDICT;
+    SOCKET sockets[PORT_PREDICT_COUNT];
+    for (int i = 0; i < PORT_PREDICT_COUNT; i++) {
+        sockets[i] = udp_socket_with_timeout(500);
+        struct sockaddr_in addr = {0};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(PORT_PREDICT_FIRST + i * PORT_PREDICT_STRIDE);
+        TEST_ASSERT_EQUAL_INT(
+            0, bind(sockets[i], (struct sockaddr*)&addr, sizeof(addr)));
+        // Nothing was ever seen from this IP
+        request.records[0].ip = inet_addr("192.0.2.1");
+        TEST_ASSERT_EQUAL_INT(V2_SIZE(1),
+                              v2_exchange(sockets[i], &request, &response));
+        TEST_ASSERT_EQUAL_INT(STUN_V2_NOT_FOUND,
+                              ntohs(response.records[0].status));
+    }
+    SOCKET s = sockets[PORT_PREDICT_COUNT - 1];
+
+    request.records[0].ip = inet_addr(LOCAL_IP);
+    TEST_ASSERT_EQUAL_INT(V2_SIZE(1), v2_exchange(s, &request, &response));
+    TEST_ASSERT_EQUAL_INT(STUN_V2_OK, ntohs(response.records[0].status));
+    TEST_ASSERT_EQUAL_INT(
+        PORT_PREDICT_FIRST + (PORT_PREDICT_COUNT - 1) * PORT_PREDICT_STRIDE,
+        ntohs(response.records[0].public_port));
+    uint32_t arg = ntohl(response.records[0].arg);
+    TEST_ASSERT_EQUAL_INT(PORT_PREDICT_STRIDE, (int16_t)(arg >> 16));
+    TEST_ASSERT_GREATER_THAN_INT(1, arg & 0xff);
+    for (int i = 0; i < PORT_PREDICT_COUNT; i++) {
+        closesocket(sockets[i]);
+    }
+}
+
+/**
+ * @brief           Receive a version 2 response, and check where it came from
+ *
+ * @param s         The socket
+ * @param response  Filled with the response
+ * @param ip        IP the response must come from
+ * @param port      Port the response must come from, network byte order
+ */
+void v2_recv_from(SOCKET s, v2_datagram_t* response, uint32_t ip,
+                  uint16_t port) {
+    struct sockaddr_in from;
+    socklen_t slen = sizeof(from);
+    TEST_ASSERT_EQUAL_INT(V2_SIZE(1),
+                          recvfrom(s, response, sizeof(*response), 0,
+                                   (struct sockaddr*)&from, &slen));
+    TEST_ASSERT_EQUAL_INT(ip, from.sin_addr.s_addr);
+    TEST_ASSERT_EQUAL_INT(port, from.sin_port);
+    TEST_ASSERT_EQUAL_INT(STUN_V2_OK, ntohs(response->records[0].status));
+}
+
+/**
+ * @brief           Probe the STUN server as an RFC 5780 client would, from
+ *                  its primary address and, if it has them, its secondary
+ *                  port and IP. The first STUN process should run with
+ *                  --alt-port and --alt-ip
+ */
+void test_v2_behavior_discovery(void) {
+    v2_datagram_t request, response;
+    SOCKET s = udp_socket_with_timeout(500);
+    memset(&request, 0, sizeof(request));
+    request.header.num_records = 2;
+    request.records[0].type = STUN_V2_PROBE;
+    request.records[1].type = STUN_V2_PROBE;
+    request.records[1].flags = STUN_V2_PROBE_CHANGE_PORT;
+    TEST_ASSERT_EQUAL_INT(V2_SIZE(2), v2_exchange(s, &request, &response));
+    TEST_ASSERT_EQUAL_INT(STUN_V2_OK, ntohs(response.records[0].status));
+    // Changes can't be batched
+    TEST_ASSERT_EQUAL_INT(STUN_V2_INVALID, ntohs(response.records[1].status));
+
+    struct sockaddr_in local;
+    socklen_t slen = sizeof(local);
+    getsockname(s, (struct sockaddr*)&local, &slen);
+    TEST_ASSERT_EQUAL_INT(inet_addr(LOCAL_IP), response.records[0].ip);
+    TEST_ASSERT_EQUAL_INT(local.sin_port, response.records[0].public_port);
+    uint16_t other_port = response.records[0].private_port;
+    uint32_t other_ip = response.records[0].arg;
+    if (other_port == 0) {
+        closesocket(s);
+        TEST_IGNORE_MESSAGE("The STUN server has no --alt-port");
+    }
+
+    // Answered from the secondary port
+    uint32_t stun_ip = inet_addr(STUN_IP);
+    request.header.num_records = 1;
+    request.records[0].flags = STUN_V2_PROBE_CHANGE_PORT;
+    struct sockaddr_in stun_addr;
+    stun_addr.sin_family = AF_INET;
+    stun_addr.sin_addr.s_addr = stun_ip;
+    stun_addr.sin_port = htons(STUN_PORT);
+    sendto(s, &request, V2_SIZE(1), 0, (struct sockaddr*)&stun_addr,
+           sizeof(stun_addr));
+    v2_recv_from(s, &response, stun_ip, other_port);
+
+    // Sent to the secondary port, the mapping stays the same on loopback
+    request.records[0].flags = 0;
+    stun_addr.sin_port = other_port;
+    sendto(s, &request, V2_SIZE(1), 0, (struct sockaddr*)&stun_addr,
+           sizeof(stun_addr));
+    v2_recv_from(s, &response, stun_ip, other_port);
+    TEST_ASSERT_EQUAL_INT(local.sin_port, response.records[0].public_port);
+
+    if (other_ip != 0) {
+        // Answered from the secondary IP and port
+        request.records[0].flags =
+            STUN_V2_PROBE_CHANGE_IP | STUN_V2_PROBE_CHANGE_PORT;
+        stun_addr.sin_port = htons(STUN_PORT);
+        sendto(s, &request, V2_SIZE(1), 0, (struct sockaddr*)&stun_addr,
+               sizeof(stun_addr));
+        v2_recv_from(s, &response, other_ip, other_port);
+
+        // And from the primary IP's secondary port when sent there
+        request.records[0].flags = STUN_V2_PROBE_CHANGE_IP;
+        stun_addr.sin_addr.s_addr = other_ip;
+        stun_addr.sin_port = other_port;
+        sendto(s, &request, V2_SIZE(1), 0, (struct sockaddr*)&stun_addr,
+               sizeof(stun_addr));
+        v2_recv_from(s, &response, stun_ip, other_port);
+    }
+    closesocket(s);
+}
+
+/**
+ * @brief           Have a STUN process started with --ask-cookies look an ASK
+ *                  up only once its cookie is echoed
+ */
+void test_v2_ask_cookie(void) {
+    v2_datagram_t request, response;
+    SOCKET server = udp_socket_with_timeout(500);
+    memset(&request, 0, sizeof(request));
+    request.header.num_records = 1;
+    request.records[0].type = STUN_V2_POST;
+    request.records[0].public_port = htons(PORT_COOKIE);
+    TEST_ASSERT_EQUAL_INT(V2_SIZE(1), v2_exchange(server, &request, &response));
+
+    struct sockaddr_in stun_addr;
+    stun_addr.sin_family = AF_INET;
+    stun_addr.sin_addr.s_addr = inet_addr(STUN_IP);
+    stun_addr.sin_port = htons(STUN_COOKIE_PORT);
+    SOCKET client = udp_socket_with_timeout(500);
+    memset(&request, 0, sizeof(request));
+    request.header.magic = htons(STUN_V2_MAGIC);
+    request.header.version = STUN_V2_VERSION;
+    request.header.num_records = 1;
+    request.records[0].type = STUN_V2_ASK;
+    request.records[0].ip = inet_addr(LOCAL_IP);
+    request.records[0].public_port = htons(PORT_COOKIE);
+    sendto(client, &request, V2_SIZE(1), 0, (struct sockaddr*)&stun_addr,
+           sizeof(stun_addr));
+    if (recv(client, &response, sizeof(response), 0) < 0) {
+        closesocket(server);
+        closesocket(client);
+        TEST_IGNORE_MESSAGE("No STUN process with --ask-cookies");
+    }
+    TEST_ASSERT_EQUAL_INT(STUN_V2_COOKIE_REQUIRED,
+                          ntohs(response.records[0].status));
+    TEST_ASSERT_EQUAL_INT(0, response.records[0].private_port);
+    uint32_t cookie = response.records[0].arg;
+
+    // A forged cookie gets nowhere either, and the server hears of neither
+    request.header.num_records = 2;
+    request.records[1] = request.records[0];
+    request.records[0].type = STUN_V2_COOKIE;
+    request.records[0].arg = cookie ^ htonl(1);
+    sendto(client, &request, V2_SIZE(2), 0, (struct sockaddr*)&stun_addr,
+           sizeof(stun_addr));
+    TEST_ASSERT_EQUAL_INT(V2_SIZE(2),
+                          recv(client, &response, sizeof(response), 0));
+    TEST_ASSERT_EQUAL_INT(STUN_V2_COOKIE_REQUIRED,
+                          ntohs(response.records[1].status));
+    stun_entry_t entry;
+    TEST_ASSERT_EQUAL_INT(-1, recv(server, &entry, sizeof(entry), 0));
+
+    request.records[0].arg = cookie;
+    sendto(client, &request, V2_SIZE(2), 0, (struct sockaddr*)&stun_addr,
+           sizeof(stun_addr));
+    TEST_ASSERT_EQUAL_INT(V2_SIZE(2),
+                          recv(client, &response, sizeof(response), 0));
+    TEST_ASSERT_EQUAL_INT(STUN_V2_OK, ntohs(response.records[0].status));
+    TEST_ASSERT_EQUAL_INT(STUN_V2_OK, ntohs(response.records[1].status));
+    TEST_ASSERT_EQUAL_INT(sizeof(entry),
+                          recv(server, &entry, sizeof(entry), 0));
+
+    closesocket(server);
+    closesocket(client);
+}
+
+/**
+ * @brief           Register a port from an IP steered to another worker than
+ *                  the client's, so that with --shard-registry the client's
+ *                  ASK is forwarded to the worker owning it
+ */
+void test_v2_other_shard(void) {
+    if (strcmp(LOCAL_IP, "127.0.0.1") != 0) {
+        TEST_IGNORE_MESSAGE("Other loopback IPs can't reach STUN_IP");
+    }
+    v2_datagram_t request, response;
+    SOCKET server = udp_socket_with_timeout(500);
+    struct sockaddr_in server_addr = {0};
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = inet_addr(OTHER_SHARD_IP);
+    TEST_ASSERT_EQUAL_INT(0, bind(server, (struct sockaddr*)&server_addr,
+                                  sizeof(server_addr)));
+    memset(&request, 0, sizeof(request));
+    request.header.num_records = 1;
+    request.records[0].type = STUN_V2_POST;
+    request.records[0].public_port = htons(PORT_OTHER_SHARD);
+    TEST_ASSERT_EQUAL_INT(V2_SIZE(1), v2_exchange(server, &request, &response));
+    TEST_ASSERT_EQUAL_INT(STUN_V2_OK, ntohs(response.records[0].status));
+    socklen_t slen = sizeof(server_addr);
+    getsockname(server, (struct sockaddr*)&server_addr, &slen);
+
+    SOCKET client = udp_socket_with_timeout(500);
+    memset(&request, 0, sizeof(request));
+    request.header.num_records = 1;
+    request.header.txid = htonl(4321);
+    request.records[0].type = STUN_V2_ASK;
+    request.records[0].ip = inet_addr(OTHER_SHARD_IP);
+    request.records[0].public_port = htons(PORT_OTHER_SHARD);
+    TEST_ASSERT_EQUAL_INT(V2_SIZE(1), v2_exchange(client, &request, &response));
+    TEST_ASSERT_EQUAL_INT(htonl(4321), response.header.txid);
+    TEST_ASSERT_EQUAL_INT(STUN_V2_OK, ntohs(response.records[0].status));
+    TEST_ASSERT_EQUAL_INT(server_addr.sin_port,
+                          response.records[0].private_port);
+
+    struct sockaddr_in client_addr;
+    slen = sizeof(client_addr);
+    getsockname(client, (struct sockaddr*)&client_addr, &slen);
+    stun_entry_t entry = {0};
+    TEST_ASSERT_EQUAL_INT(sizeof(entry),
+                          recv(server, &entry, sizeof(entry), 0));
+    TEST_ASSERT_EQUAL_INT(client_addr.sin_port, entry.private_port);
+
+    closesocket(server);
+    closesocket(client);
+}
+
+/**
+ * @brief           Register two ports over one TCP connection, the first
+ *                  request sent in two pieces and the next two at once, then
+ *                  look the second one up over UDP
+ */
+void test_TCP_pipelined_requests(void) {
+    SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    struct timeval timeout = {0, 500 * 1000};
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    struct sockaddr_in stun_addr = {0};
+    stun_addr.sin_family = AF_INET;
+    stun_addr.sin_addr.s_addr = inet_addr(STUN_IP);
+    stun_addr.sin_port = htons(STUN_PORT);
+    TEST_ASSERT_EQUAL_INT(
+        0, connect(s, (struct sockaddr*)&stun_addr, sizeof(stun_addr)));
+
+    v2_datagram_t requests[3];
+    uint16_t ports[] = {PORT_TCP_FIRST, PORT_TCP_FIRST, PORT_TCP_SECOND};
+    for (int i = 0; i < 3; i++) {
+        memset(&requests[i], 0, sizeof(requests[i]));
+        requests[i].header.magic = htons(STUN_V2_MAGIC);
+        requests[i].header.version = STUN_V2_VERSION;
+        requests[i].header.num_records = 1;
+        requests[i].header.txid = htonl(i);
+        requests[i].records[0].type = STUN_V2_POST;
+        requests[i].records[0].public_port = htons(ports[i]);
+    }
+    uint8_t stream[3 * V2_SIZE(1)];
+    for (int i = 0; i < 3; i++) {
+        memcpy(stream + i * V2_SIZE(1), &requests[i], V2_SIZE(1));
+    }
+    TEST_ASSERT_EQUAL_INT(5, send(s, stream, 5, 0));
+    usleep(50000);
+    TEST_ASSERT_EQUAL_INT(V2_SIZE(1) - 5,
+                          send(s, stream + 5, V2_SIZE(1) - 5, 0));
+    usleep(50000);
+    TEST_ASSERT_EQUAL_INT(2 * V2_SIZE(1),
+                          send(s, stream + V2_SIZE(1), 2 * V2_SIZE(1), 0));
+
+    for (int i = 0; i < 3; i++) {
+        v2_datagram_t response;
+        TEST_ASSERT_EQUAL_INT(V2_SIZE(1),
+                              recv(s, &response, V2_SIZE(1), MSG_WAITALL));
+        TEST_ASSERT_EQUAL_INT(htonl(i), response.header.txid);
+        TEST_ASSERT_EQUAL_INT(STUN_V2_OK, ntohs(response.records[0].status));
+    }
+
+    struct sockaddr_in server_addr;
+    socklen_t slen = sizeof(server_addr);
+    getsockname(s, (struct sockaddr*)&server_addr, &slen);
+    v2_datagram_t request, response;
+    memset(&request, 0, sizeof(request));
+    request.header.num_records = 1;
+    request.records[0].type = STUN_V2_ASK;
+    request.records[0].ip = inet_addr(LOCAL_IP);
+    request.records[0].public_port = htons(PORT_TCP_SECOND);
+    SOCKET client = udp_socket_with_timeout(500);
+    TEST_ASSERT_EQUAL_INT(V2_SIZE(1), v2_exchange(client, &request, &response));
+    TEST_ASSERT_EQUAL_INT(STUN_V2_OK, ntohs(response.records[0].status));
+    TEST_ASSERT_EQUAL_INT(server_addr.sin_port,
+                          response.records[0].private_port);
+
+    closesocket(client);
+    closesocket(s);
+}
+
+/**
+ * @brief           Time one-request TCP exchanges with the STUN server with
+ *                  and without TCP Fast Open. The SYNs only carry the
+ *                  request if net.ipv4.tcp_fastopen enables it on both ends
+ */
+void test_TCP_fastopen_latency(void) {
+    struct sockaddr_in stun_addr = {0};
+    stun_addr.sin_family = AF_INET;
+    stun_addr.sin_addr.s_addr = inet_addr(STUN_IP);
+    stun_addr.sin_port = htons(STUN_PORT);
+    v2_datagram_t request;
+    memset(&request, 0, sizeof(request));
+    request.header.magic = htons(STUN_V2_MAGIC);
+    request.header.version = STUN_V2_VERSION;
+    request.header.num_records = 1;
+    request.records[0].type = STUN_V2_PROBE;
+
+    double average_us[2];
+    int syn_data = 0;
+    for (int fastopen = 0; fastopen < 2; fastopen++) {
+        struct timeval start, end;
+        // The first exchange gets the Fast Open cookie
+        for (int i = -1; i < TCP_FASTOPEN_ROUNDS; i++) {
+            if (i == 0) {
+                gettimeofday(&start, NULL);
+            }
+            SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+            TEST_ASSERT_TRUE(tcp_request_stun(s, stun_addr, &request,
+                                              V2_SIZE(1), fastopen, 500));
+            v2_datagram_t response;
+            TEST_ASSERT_EQUAL_INT(V2_SIZE(1),
+                                  recv(s, &response, V2_SIZE(1), MSG_WAITALL));
+            TEST_ASSERT_EQUAL_INT(STUN_V2_OK,
+                                  ntohs(response.records[0].status));
+            struct tcp_info info;
+            socklen_t len = sizeof(info);
+            if (fastopen && i >= 0 &&
+                getsockopt(s, IPPROTO_TCP, TCP_INFO, &info, &len) == 0 &&
+                (info.tcpi_options & TCPI_OPT_SYN_DATA)) {
+                syn_data++;
+            }
+            closesocket(s);
+        }
+        gettimeofday(&end, NULL);
+        average_us[fastopen] = ((end.tv_sec - start.tv_sec) * 1e6 +
+                                (end.tv_usec - start.tv_usec)) /
+                               TCP_FASTOPEN_ROUNDS;
+    }
+    printf("TCP exchange: %.0fus, with TCP Fast Open: %.0fus (%d of %d "
+           "requests in the SYN)\n",
+           average_us[0], average_us[1], syn_data, TCP_FASTOPEN_ROUNDS);
+}
+
+/**
+ * @brief           Open more TCP connections to the STUN process started with
+ *                  --tcp-max-per-ip than it lets an IP have, and have the
+ *                  extra one reset
+ */
+void test_TCP_per_ip_limit(void) {
+    struct sockaddr_in stun_addr = {0};
+    stun_addr.sin_family = AF_INET;
+    stun_addr.sin_addr.s_addr = inet_addr(STUN_IP);
+    stun_addr.sin_port = htons(STUN_COOKIE_PORT);
+    v2_datagram_t request;
+    memset(&request, 0, sizeof(request));
+    request.header.magic = htons(STUN_V2_MAGIC);
+    request.header.version = STUN_V2_VERSION;
+    request.header.num_records = 1;
+    request.records[0].type = STUN_V2_PROBE;
+
+    // Held open with half a request, so that the server keeps reading them
+    SOCKET held[STUN_COOKIE_MAX_PER_IP];
+    for (int i = 0; i < STUN_COOKIE_MAX_PER_IP; i++) {
+        held[i] = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (!tcp_request_stun(held[i], stun_addr, &request, V2_SIZE(1) / 2,
+                              false, 500)) {
+            for (int j = 0; j <= i; j++) {
+                closesocket(held[j]);
+            }
+            TEST_IGNORE_MESSAGE("No STUN process with --tcp-max-per-ip");
+        }
+    }
+    usleep(100000);
+
+    SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    TEST_ASSERT_TRUE(
+        tcp_request_stun(s, stun_addr, &request, V2_SIZE(1), false, 500));
+    v2_datagram_t response;
+    TEST_ASSERT_EQUAL_INT(-1, recv(s, &response, V2_SIZE(1), MSG_WAITALL));
+    TEST_ASSERT_EQUAL_INT(ECONNRESET, errno);
+    closesocket(s);
+
+    // Once one of them is done, the IP may connect again
+    TEST_ASSERT_EQUAL_INT(
+        V2_SIZE(1) - V2_SIZE(1) / 2,
+        send(held[0], (uint8_t*)&request + V2_SIZE(1) / 2,
+             V2_SIZE(1) - V2_SIZE(1) / 2, 0));
+    TEST_ASSERT_EQUAL_INT(V2_SIZE(1),
+                          recv(held[0], &response, V2_SIZE(1), MSG_WAITALL));
+    closesocket(held[0]);
+    usleep(100000);
+    s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    TEST_ASSERT_TRUE(
+        tcp_request_stun(s, stun_addr, &request, V2_SIZE(1), false, 500));
+    TEST_ASSERT_EQUAL_INT(V2_SIZE(1),
+                          recv(s, &response, V2_SIZE(1), MSG_WAITALL));
+    closesocket(s);
+    for (int i = 1; i < STUN_COOKIE_MAX_PER_IP; i++) {
+        closesocket(held[i]);
+    }
+}
+
+/**
+ * @brief           Register a port over TCP, then keep refreshing it without
+ *                  ever reading the responses, and check that the STUN
+ *                  server still reads the requests and answers a lookup over
+ *                  UDP, which notifies the stalled connection
+ */
+void test_TCP_slow_peer(void) {
+    SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    int rcvbuf = 1024;
+    setsockopt(s, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    struct timeval timeout = {2, 0};
+    setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    struct sockaddr_in stun_addr = {0};
+    stun_addr.sin_family = AF_INET;
+    stun_addr.sin_addr.s_addr = inet_addr(STUN_IP);
+    stun_addr.sin_port = htons(STUN_PORT);
+    TEST_ASSERT_EQUAL_INT(
+        0, connect(s, (struct sockaddr*)&stun_addr, sizeof(stun_addr)));
+
+    v2_datagram_t request;
+    memset(&request, 0, sizeof(request));
+    request.header.magic = htons(STUN_V2_MAGIC);
+    request.header.version = STUN_V2_VERSION;
+    request.header.num_records = 1;
+    request.records[0].type = STUN_V2_POST;
+    request.records[0].public_port = htons(PORT_SLOW_PEER);
+    for (int i = 0; i < SLOW_PEER_REQUESTS; i++) {
+        TEST_ASSERT_EQUAL_INT(V2_SIZE(1), send(s, &request, V2_SIZE(1), 0));
+    }
+    usleep(100000);
+
+    v2_datagram_t response;
+    memset(&request, 0, sizeof(request));
+    request.header.num_records = 1;
+    request.records[0].type = STUN_V2_ASK;
+    request.records[0].ip = inet_addr(LOCAL_IP);
+    request.records[0].public_port = htons(PORT_SLOW_PEER);
+    SOCKET client = udp_socket_with_timeout(500);
+    TEST_ASSERT_EQUAL_INT(V2_SIZE(1), v2_exchange(client, &request, &response));
+    TEST_ASSERT_EQUAL_INT(STUN_V2_OK, ntohs(response.records[0].status));
+
+    closesocket(client);
+    closesocket(s);
+}
+
+/**
+ * @brief           Register a port over TCP and hang up, after which the STUN
+ *                  server must close its end too and forget the port
+ */
+void test_TCP_hang_up(void) {
+    SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    struct timeval timeout = {0, 500 * 1000};
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    struct sockaddr_in stun_addr = {0};
+    stun_addr.sin_family = AF_INET;
+    stun_addr.sin_addr.s_addr = inet_addr(STUN_IP);
+    stun_addr.sin_port = htons(STUN_PORT);
+    TEST_ASSERT_EQUAL_INT(
+        0, connect(s, (struct sockaddr*)&stun_addr, sizeof(stun_addr)));
+
+    v2_datagram_t request, response;
+    memset(&request, 0, sizeof(request));
+    request.header.magic = htons(STUN_V2_MAGIC);
+    request.header.version = STUN_V2_VERSION;
+    request.header.num_records = 1;
+    request.records[0].type = STUN_V2_POST;
+    request.records[0].public_port = htons(PORT_TCP_HUNG_UP);
+    TEST_ASSERT_EQUAL_INT(V2_SIZE(1), send(s, &request, V2_SIZE(1), 0));
+    TEST_ASSERT_EQUAL_INT(V2_SIZE(1),
+                          recv(s, &response, V2_SIZE(1), MSG_WAITALL));
+    TEST_ASSERT_EQUAL_INT(STUN_V2_OK, ntohs(response.records[0].status));
+
+    TEST_ASSERT_EQUAL_INT(0, shutdown(s, SHUT_WR));
+    char byte;
+    TEST_ASSERT_EQUAL_INT(0, recv(s, &byte, 1, 0));
+
+    memset(&request, 0, sizeof(request));
+    request.header.num_records = 1;
+    request.records[0].type = STUN_V2_ASK;
+    request.records[0].ip = inet_addr(LOCAL_IP);
+    request.records[0].public_port = htons(PORT_TCP_HUNG_UP);
+    SOCKET client = udp_socket_with_timeout(500);
+    TEST_ASSERT_EQUAL_INT(V2_SIZE(1), v2_exchange(client, &request, &response));
+    TEST_ASSERT_EQUAL_INT(STUN_V2_NOT_FOUND, ntohs(response.records[0].status));
+
+    closesocket(client);
+    closesocket(s);
+}
+
+/**
+ * @brief           Register a port over TCP and never read the responses
+ *                  again, until the STUN server gives up on the connection,
+ *                  closes it and forgets the port
+ */
+void test_TCP_stalled_peer_closed(void) {
+    SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    int rcvbuf = 1024;
+    setsockopt(s, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    struct timeval timeout = {2, 0};
+    setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    struct sockaddr_in stun_addr = {0};
+    stun_addr.sin_family = AF_INET;
+    stun_addr.sin_addr.s_addr = inet_addr(STUN_IP);
+    stun_addr.sin_port = htons(STUN_PORT);
+    TEST_ASSERT_EQUAL_INT(
+        0, connect(s, (struct sockaddr*)&stun_addr, sizeof(stun_addr)));
+
+    v2_datagram_t request;
+    memset(&request, 0, sizeof(request));
+    request.header.magic = htons(STUN_V2_MAGIC);
+    request.header.version = STUN_V2_VERSION;
+    request.header.num_records = 1;
+    request.records[0].type = STUN_V2_POST;
+    request.records[0].public_port = htons(PORT_STALLED_PEER);
+    for (int i = 0; i < SLOW_PEER_REQUESTS; i++) {
+        TEST_ASSERT_EQUAL_INT(V2_SIZE(1), send(s, &request, V2_SIZE(1), 0));
+    }
+    usleep(STALLED_PEER_WAIT_MS * 1000);
+
+    // What was sent before the connection was shut down, then its end
+    struct timeval read_timeout = {0, 500 * 1000};
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &read_timeout,
+               sizeof(read_timeout));
+    uint8_t stream[4096];
+    ssize_t received;
+    while ((received = recv(s, stream, sizeof(stream), 0)) > 0) {
+    }
+    TEST_ASSERT_TRUE(received == 0 || errno == ECONNRESET);
+
+    v2_datagram_t response;
+    memset(&request, 0, sizeof(request));
+    request.header.num_records = 1;
+    request.records[0].type = STUN_V2_ASK;
+    request.records[0].ip = inet_addr(LOCAL_IP);
+    request.records[0].public_port = htons(PORT_STALLED_PEER);
+    SOCKET client = udp_socket_with_timeout(500);
+    TEST_ASSERT_EQUAL_INT(V2_SIZE(1), v2_exchange(client, &request, &response));
+    TEST_ASSERT_EQUAL_INT(STUN_V2_NOT_FOUND, ntohs(response.records[0].status));
+
+    closesocket(client);
+    closesocket(s);
+}
+
 int main(void) {
     UNITY_BEGIN();
     RUN_TEST(test_UDP_server_context);
     RUN_TEST(test_UDP_client_context);
     RUN_TEST(test_TCP_server_context_no_client);
     RUN_TEST(test_TCP_client_context);
+    RUN_TEST(test_shared_registry);
+    RUN_TEST(test_malformed_requests_dropped);
+    RUN_TEST(test_v2_batch);
+    RUN_TEST(test_filtered_asks_not_logged);
+    RUN_TEST(test_v2_bulk_post);
+    RUN_TEST(test_v2_long_poll);
+    RUN_TEST(test_v2_reliable_notification);
+    RUN_TEST(test_TCP_v1_unchanged);
+    RUN_TEST(test_v2_port_prediction);
+    RUN_TEST(test_v2_behavior_discovery);
+    RUN_TEST(test_v2_ask_cookie);
+    RUN_TEST(test_v2_other_shard);
+    RUN_TEST(test_TCP_pipelined_requests);
+    RUN_TEST(test_TCP_fastopen_latency);
+    RUN_TEST(test_TCP_per_ip_limit);
+    RUN_TEST(test_TCP_slow_peer);
+    RUN_TEST(test_TCP_hang_up);
+    RUN_TEST(test_TCP_stalled_peer_closed);
     return UNITY_END();
 }
@@ -0,0 +1,54 @@
+#!/bin/bash
+
+# Runs the integration tests against a STUN server serving its UDP requests
+# over AF_XDP. The tests run in their own network namespace and reach the
+# server through a veth pair, whose server end has the XDP program attached
+# in generic mode. Needs root, and ./stun and ./tests/test_stun to be built.
+
+set -euo pipefail
+cd "$(dirname "$0")/.."
+
+NETNS=stun-xdp-test
+SERVER_IF=stun-xdp0
+CLIENT_IF=stun-xdp1
+SERVER_IP=10.200.0.1
+CLIENT_IP=10.200.0.2
+METRICS=$(mktemp)
+
+cleanup() {
+    kill $(jobs -p) 2>/dev/null || true
+    wait 2>/dev/null || true
+    ip link del "$SERVER_IF" 2>/dev/null || true
+    ip netns del "$NETNS" 2>/dev/null || true
+    rm -f /dev/shm/stun-xdp-test "$METRICS"
+}
+trap cleanup EXIT
+
+ip netns add "$NETNS"
+ip link add "$SERVER_IF" type veth peer name "$CLIENT_IF"
+ip link set "$CLIENT_IF" netns "$NETNS"
+ip addr add "$SERVER_IP/24" dev "$SERVER_IF"
+ip link set "$SERVER_IF" up
+ip -n "$NETNS" addr add "$CLIENT_IP/24" dev "$CLIENT_IF"
+ip -n "$NETNS" link set "$CLIENT_IF" up
+ip -n "$NETNS" link set lo up
+
+./stun --xdp="$SERVER_IF" --xdp-generic --shm-registry=/stun-xdp-test \
+    --metrics-file="$METRICS" --metrics-interval=1 &
+./stun --port=48801 --shm-registry=/stun-xdp-test --metrics-file= &
+./stun --port=48803 --shm-registry=/stun-xdp-test --metrics-file= \
+    --ask-cookies --tcp-max-per-ip=2 &
+sleep 1
+
+ip netns exec "$NETNS" env STUN_IP="$SERVER_IP" LOCAL_IP="$CLIENT_IP" \
+    ./tests/test_stun
+
+# The UDP requests must have gone through AF_XDP rather than the UDP workers
+sleep 2
+packets=$(awk '$1 == "stun_xdp_packets_total" { print $2 }' "$METRICS")
+responses=$(awk '$1 == "stun_xdp_responses_total" { print $2 }' "$METRICS")
+echo "AF_XDP packets: ${packets:-0}, responses: ${responses:-0}"
+if [ "${packets:-0}" -eq 0 ] || [ "${responses:-0}" -eq 0 ]; then
+    echo "No request was served over AF_XDP"
+    exit 1
+fi
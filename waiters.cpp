@@ -0,0 +1,226 @@
+/**
+ * Copyright Fractal Computers, Inc. 2021
+ * @file waiters.cpp
+ * @brief Long-polling ASK_INFOs waiting for their server to POST_INFO
+ */
+
+#include "waiters.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <vector>
+
+#include "clock.h"
+#include "log.h"
+#include "metrics.h"
+#include "registry.h"
+#include "slab.h"
+
+using namespace std;
+
+// How often the timer looks for timed out waiters, and for registrations
+// that didn't wake their waiters
+#define WAITERS_TICK_MS 20
+
+// Linked both in the chain of its bucket and in the list of every waiter,
+// each through the pointer to it, so that it's unlinked from either without
+// walking the other
+typedef struct waiter_node {
+    waiter_t waiter;
+    struct waiter_node* next;
+    struct waiter_node** pprev;
+    struct waiter_node* live_next;
+    struct waiter_node** live_pprev;
+} waiter_node_t;
+
+static pthread_mutex_t waiters_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Chained hash table keyed by waiter_key(), with at least one bucket per
+// waiter. Its nodes come from a slab pool
+static waiter_node_t** buckets;
+static uint32_t bucket_mask;
+// Every waiter, so that the timer only walks those
+static waiter_node_t* live;
+static slab_pool_t* pool;
+// Number of waiters, readable without the mutex so that registrations don't
+// take it when nobody waits
+static atomic<uint32_t> num_waiters;
+static unsigned int capacity;
+static waiter_callback_t answer;
+
+// Updated from every worker
+static atomic<uint64_t> parked;
+static atomic<uint64_t> woken;
+static atomic<uint64_t> timed_out;
+static atomic<uint64_t> rejected;
+
+static uint64_t waiter_key(uint32_t ip, uint16_t public_port) {
+    return (uint64_t)ip << 16 | public_port;
+}
+
+static waiter_node_t** bucket_of(uint32_t ip, uint16_t public_port) {
+    uint64_t h = waiter_key(ip, public_port) * 0x9e3779b97f4a7c15ULL;
+    return &buckets[(h >> 32) & bucket_mask];
+}
+
+// Unlinks a node and appends its waiter to out. Must hold waiters_mutex
+static void take(waiter_node_t* node, vector<waiter_t>* out) {
+    *node->pprev = node->next;
+    if (node->next) {
+        node->next->pprev = node->pprev;
+    }
+    *node->live_pprev = node->live_next;
+    if (node->live_next) {
+        node->live_next->live_pprev = node->live_pprev;
+    }
+    out->push_back(node->waiter);
+    slab_free(pool, node);
+    num_waiters.fetch_sub(1, memory_order_relaxed);
+}
+
+static void* waiters_timer(void* vargp) {
+    (void)vargp;
+    vector<waiter_t> expired;
+    vector<uint64_t> keys;
+    while (true) {
+        usleep(WAITERS_TICK_MS * 1000);
+        if (num_waiters.load(memory_order_relaxed) == 0) {
+            continue;
+        }
+
+        // Only the timed out waiters are taken with the mutex held, the keys
+        // of the others are looked up once it's released, as every worker
+        // parking or waking a waiter takes it
+        uint64_t now_ns = monotonic_ns();
+        pthread_mutex_lock(&waiters_mutex);
+        for (waiter_node_t* node = live; node;) {
+            waiter_node_t* next = node->live_next;
+            if (node->waiter.deadline_ns <= now_ns) {
+                take(node, &expired);
+            } else {
+                keys.push_back(waiter_key(node->waiter.record.ip,
+                                          node->waiter.record.public_port));
+            }
+            node = next;
+        }
+        pthread_mutex_unlock(&waiters_mutex);
+
+        for (const waiter_t& waiter : expired) {
+            answer(&waiter, true);
+        }
+        timed_out.fetch_add(expired.size(), memory_order_relaxed);
+        expired.clear();
+
+        double now = time();
+        for (uint64_t key : keys) {
+            registry_entry_t map_entry;
+            if (registry_lookup(key >> 16, key & 0xffff, now, &map_entry)) {
+                waiters_wake(key >> 16, key & 0xffff);
+            }
+        }
+        keys.clear();
+    }
+    return NULL;
+}
+
+static void write_waiters_metrics(FILE* f) {
+    metrics_write_gauge(f, "stun_waiters", "ASK_INFOs currently waiting",
+                        num_waiters.load(memory_order_relaxed));
+    metrics_write_counter(f, "stun_waiters_parked_total",
+                          "ASK_INFOs that waited for their server",
+                          parked.load(memory_order_relaxed));
+    metrics_write_counter(f, "stun_waiters_woken_total",
+                          "Waiting ASK_INFOs answered once their server "
+                          "registered",
+                          woken.load(memory_order_relaxed));
+    metrics_write_counter(f, "stun_waiters_timed_out_total",
+                          "Waiting ASK_INFOs whose server never registered",
+                          timed_out.load(memory_order_relaxed));
+    metrics_write_counter(f, "stun_waiters_rejected_total",
+                          "ASK_INFOs that couldn't wait as too many were "
+                          "waiting already",
+                          rejected.load(memory_order_relaxed));
+}
+
+int waiters_init(unsigned int max_waiters, waiter_callback_t callback) {
+    capacity = max_waiters;
+    answer = callback;
+    if (capacity == 0) {
+        return 0;
+    }
+    uint32_t num_buckets = 1;
+    while (num_buckets < capacity) {
+        num_buckets *= 2;
+    }
+    buckets = new waiter_node_t*[num_buckets]();
+    bucket_mask = num_buckets - 1;
+    pool = slab_create("waiters", sizeof(waiter_node_t), capacity);
+    if (!pool) {
+        return -1;
+    }
+
+    pthread_t thread_id;
+    if (pthread_create(&thread_id, NULL, waiters_timer, NULL) != 0) {
+        log("Failed to start the waiters timer\n");
+        return -1;
+    }
+    metrics_register(write_waiters_metrics);
+    return 0;
+}
+
+bool waiters_add(const waiter_t* waiter) {
+    waiter_node_t* node = NULL;
+    if (capacity > 0) {
+        pthread_mutex_lock(&waiters_mutex);
+        if (num_waiters.load(memory_order_relaxed) < capacity) {
+            node = (waiter_node_t*)slab_alloc(pool);
+        }
+        if (node) {
+            waiter_node_t** bucket =
+                bucket_of(waiter->record.ip, waiter->record.public_port);
+            node->waiter = *waiter;
+            node->next = *bucket;
+            node->pprev = bucket;
+            if (*bucket) {
+                (*bucket)->pprev = &node->next;
+            }
+            *bucket = node;
+            node->live_next = live;
+            node->live_pprev = &live;
+            if (live) {
+                live->live_pprev = &node->live_next;
+            }
+            live = node;
+            num_waiters.fetch_add(1, memory_order_relaxed);
+        }
+        pthread_mutex_unlock(&waiters_mutex);
+    }
+    bool added = node != NULL;
+
+    (added ? parked : rejected).fetch_add(1, memory_order_relaxed);
+    return added;
+}
+
+void waiters_wake(unsigned int ip, unsigned short public_port) {
+    if (num_waiters.load(memory_order_relaxed) == 0) {
+        return;
+    }
+
+    vector<waiter_t> ready;
+    pthread_mutex_lock(&waiters_mutex);
+    for (waiter_node_t* node = *bucket_of(ip, public_port); node;) {
+        waiter_node_t* next = node->next;
+        if (node->waiter.record.ip == ip &&
+            node->waiter.record.public_port == public_port) {
+            take(node, &ready);
+        }
+        node = next;
+    }
+    pthread_mutex_unlock(&waiters_mutex);
+
+    for (const waiter_t& waiter : ready) {
+        answer(&waiter, false);
+    }
+    woken.fetch_add(ready.size(), memory_order_relaxed);
+}
@@ -0,0 +1,91 @@
+#ifndef STUN_SERVER_WAITERS_H
+#define STUN_SERVER_WAITERS_H
+/**
+ * Copyright Fractal Computers, Inc. 2021
+ * @file waiters.h
+ * @brief Long-polling ASK_INFOs waiting for their server to POST_INFO
+============================
+Usage
+============================
+
+Call waiters_init() once at startup with the function that answers a waiter.
+When a waiting ASK finds nothing, park it with waiters_add(); every
+registration then calls waiters_wake(), which answers the waiters of that
+IP:port right away. A timer answers the waiters whose registration was made
+by another process sharing the registry, or that raced their own parking, and
+reclaims the ones that timed out.
+
+The table is bounded, waiters_add() fails once it is full.
+*/
+
+/*
+============================
+Includes
+============================
+*/
+
+#include <netinet/in.h>
+#include <stdint.h>
+
+#include "stun.h"
+
+/*
+============================
+Custom Types
+============================
+*/
+
+typedef struct {
+    // The ASK record, to be answered with a datagram of its own
+    stun_v2_record_t record;
+    // txid of the datagram the record came in
+    uint32_t txid;
+    struct sockaddr_in client;
+    // UDP socket to answer the client and notify the server with
+    int s;
+    // monotonic_ns() after which the waiter is answered with
+    // STUN_V2_NOT_FOUND
+    uint64_t deadline_ns;
+} waiter_t;
+
+// Answers a waiter once its registration showed up, or once it timed out
+typedef void (*waiter_callback_t)(const waiter_t* waiter, bool timed_out);
+
+/*
+============================
+Public Functions
+============================
+*/
+
+/**
+ * @brief                          Set up the table and start its timer
+ *
+ * @param max_waiters              Most waiters parked at once, 0 to disable
+ *                                 waiting
+ * @param callback                 Answers the waiters
+ *
+ * @returns                        0 on success, -1 on failure
+ */
+int waiters_init(unsigned int max_waiters, waiter_callback_t callback);
+
+/**
+ * @brief                          Park a waiter until its IP:port registers
+ *                                 or its deadline passes
+ *
+ * @param waiter                   The waiter, copied into the table
+ *
+ * @returns                        True if it was parked, false if the table
+ *                                 is full
+ */
+bool waiters_add(const waiter_t* waiter);
+
+/**
+ * @brief                          Answer every waiter of ip:public_port, once
+ *                                 it has been registered
+ *
+ * @param ip                       The registered IP, network byte order
+ * @param public_port              The registered port, network byte order
+ */
+void waiters_wake(unsigned int ip, unsigned short public_port);
+
+#endif  // STUN_SERVER_WAITERS_H
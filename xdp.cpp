@@ -0,0 +1,533 @@
+/**
+ * Copyright Fractal Computers, Inc. 2021
+ * @file xdp.cpp
+ * @brief AF_XDP fast path for UDP requests
+ */
+
+#include "xdp.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/if_ether.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include "bpf.h"
+#include "config.h"
+#include "handler.h"
+#include "log.h"
+#include "metrics.h"
+#include "stun.h"
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+using namespace std;
+
+// UMEM frames of every queue. Requests are answered in place, so a frame goes
+// from the fill ring to the RX ring, then either straight back to the fill
+// ring or through the TX and completion rings first. The fill ring can hold
+// every frame, so giving one back never fails
+#define XDP_FRAMES 4096
+#define XDP_FRAME_SIZE 2048
+#define XDP_RING_SIZE 2048
+// Descriptors handled per pass over the RX ring
+#define XDP_BATCH 64
+
+// A request in a frame: Ethernet, IPv4 without options, UDP, then either a
+// stun_request_t or a version 2 request, which is longer
+#define XDP_IP_OFFSET ETH_HLEN
+#define XDP_UDP_OFFSET (XDP_IP_OFFSET + sizeof(struct iphdr))
+#define XDP_PAYLOAD_OFFSET (XDP_UDP_OFFSET + sizeof(struct udphdr))
+#define XDP_MIN_LEN (XDP_PAYLOAD_OFFSET + sizeof(stun_request_t))
+
+// A ring shared with the kernel, see Documentation/networking/af_xdp.rst
+typedef struct {
+    uint32_t* producer;
+    uint32_t* consumer;
+    uint32_t* flags;
+    // uint64_t UMEM addresses for the fill and completion rings,
+    // struct xdp_desc for the RX and TX rings
+    void* descs;
+    uint32_t mask;
+} xdp_ring_t;
+
+typedef struct {
+    int queue;
+    int fd;
+    uint8_t* umem;
+    xdp_ring_t fill;
+    xdp_ring_t completion;
+    xdp_ring_t rx;
+    xdp_ring_t tx;
+    // Frames handed to the TX ring whose completion hasn't been seen yet
+    uint32_t tx_outstanding;
+    // Only ever updated by the queue's thread
+    atomic<uint64_t> packets;
+    atomic<uint64_t> responses;
+    // Responses dropped because the TX ring was full
+    atomic<uint64_t> tx_full;
+} xdp_queue_t;
+
+static int xdp_notify_socket;
+static int xdp_link = -1;
+static vector<xdp_queue_t*> xdp_queues;
+
+// The kernel reads and writes the other end of every ring concurrently
+static uint32_t ring_load(const uint32_t* index) {
+    return __atomic_load_n(index, __ATOMIC_ACQUIRE);
+}
+
+static void ring_store(uint32_t* index, uint32_t value) {
+    __atomic_store_n(index, value, __ATOMIC_RELEASE);
+}
+
+static struct xdp_desc* ring_desc(xdp_ring_t* ring, uint32_t index) {
+    return &((struct xdp_desc*)ring->descs)[index & ring->mask];
+}
+
+static uint64_t* ring_addr(xdp_ring_t* ring, uint32_t index) {
+    return &((uint64_t*)ring->descs)[index & ring->mask];
+}
+
+static int map_ring(int fd, const struct xdp_ring_offset* offsets,
+                    uint32_t size, size_t desc_size, off_t pgoff,
+                    xdp_ring_t* ring) {
+    size_t len = offsets->desc + size * desc_size;
+    uint8_t* map = (uint8_t*)mmap(NULL, len, PROT_READ | PROT_WRITE,
+                                  MAP_SHARED | MAP_POPULATE, fd, pgoff);
+    if (map == MAP_FAILED) {
+        log("Failed to mmap(2) AF_XDP ring: %s\n", strerror(errno));
+        return -1;
+    }
+    ring->producer = (uint32_t*)(map + offsets->producer);
+    ring->consumer = (uint32_t*)(map + offsets->consumer);
+    ring->flags = (uint32_t*)(map + offsets->flags);
+    ring->descs = map + offsets->desc;
+    ring->mask = size - 1;
+    return 0;
+}
+
+// Gives frames back to the kernel for receiving
+static void fill_frames(xdp_queue_t* q, const uint64_t* addrs, uint32_t n) {
+    uint32_t producer = *q->fill.producer;
+    for (uint32_t i = 0; i < n; i++) {
+        *ring_addr(&q->fill, producer + i) = addrs[i];
+    }
+    ring_store(q->fill.producer, producer + n);
+}
+
+// Moves sent frames from the completion ring back to the fill ring
+static void reclaim_completions(xdp_queue_t* q) {
+    uint32_t consumer = *q->completion.consumer;
+    uint32_t n = ring_load(q->completion.producer) - consumer;
+    if (n == 0) {
+        return;
+    }
+    uint64_t addrs[XDP_RING_SIZE];
+    for (uint32_t i = 0; i < n; i++) {
+        addrs[i] = *ring_addr(&q->completion, consumer + i);
+    }
+    ring_store(q->completion.consumer, consumer + n);
+    fill_frames(q, addrs, n);
+    q->tx_outstanding -= n;
+}
+
+// Adds a buffer to a ones' complement sum of big-endian 16-bit words
+static uint32_t checksum_add(uint32_t sum, const void* data, size_t len) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    for (size_t i = 0; i + 1 < len; i += 2) {
+        sum += (bytes[i] << 8) | bytes[i + 1];
+    }
+    if (len % 2) {
+        sum += bytes[len - 1] << 8;
+    }
+    return sum;
+}
+
+static uint16_t checksum_fold(uint32_t sum) {
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return htons((uint16_t)~sum);
+}
+
+// Handles the request in a frame redirected by the XDP program, then rewrites
+// the frame into the response to the client. Returns whether there is a
+// response to send, of response_len bytes
+static bool answer(uint8_t* frame, uint32_t len, uint32_t* response_len) {
+    if (len < XDP_MIN_LEN) {
+        return false;
+    }
+    struct ethhdr* eth = (struct ethhdr*)frame;
+    struct iphdr* ip = (struct iphdr*)(frame + XDP_IP_OFFSET);
+    struct udphdr* udp = (struct udphdr*)(frame + XDP_UDP_OFFSET);
+    uint8_t* payload = frame + XDP_PAYLOAD_OFFSET;
+    int payload_len = ntohs(udp->len) - (int)sizeof(struct udphdr);
+    if (payload_len > (int)(len - XDP_PAYLOAD_OFFSET) ||
+        payload_len > (int)STUN_MAX_DATAGRAM) {
+        return false;
+    }
+
+    struct sockaddr_in client;
+    memset(&client, 0, sizeof(client));
+    client.sin_family = AF_INET;
+    client.sin_addr.s_addr = ip->saddr;
+    client.sin_port = udp->source;
+
+    // Responses are never longer than their request, so they always fit
+    uint8_t response[STUN_MAX_DATAGRAM];
+    int response_size = handle_datagram(payload, payload_len, &client,
+                                        xdp_notify_socket, 0, response);
+    if (response_size == 0) {
+        return false;
+    }
+
+    uint8_t mac[ETH_ALEN];
+    memcpy(mac, eth->h_dest, ETH_ALEN);
+    memcpy(eth->h_dest, eth->h_source, ETH_ALEN);
+    memcpy(eth->h_source, mac, ETH_ALEN);
+
+    uint16_t udp_len = sizeof(struct udphdr) + response_size;
+    swap(ip->saddr, ip->daddr);
+    ip->tot_len = htons(sizeof(struct iphdr) + udp_len);
+    ip->ttl = 64;
+    ip->check = 0;
+    ip->check = checksum_fold(checksum_add(0, ip, sizeof(*ip)));
+
+    swap(udp->source, udp->dest);
+    udp->len = htons(udp_len);
+    memcpy(payload, response, response_size);
+    udp->check = 0;
+    uint32_t sum = checksum_add(0, &ip->saddr, 2 * sizeof(ip->saddr));
+    sum += IPPROTO_UDP + udp_len;
+    udp->check = checksum_fold(checksum_add(sum, udp, udp_len));
+    if (udp->check == 0) {
+        // 0 would mean that there is no checksum
+        udp->check = 0xffff;
+    }
+
+    *response_len = XDP_PAYLOAD_OFFSET + response_size;
+    return true;
+}
+
+static void* xdp_worker(void* vargp) {
+    xdp_queue_t* q = (xdp_queue_t*)vargp;
+    struct pollfd pfd;
+    pfd.fd = q->fd;
+    pfd.events = POLLIN;
+
+    while (true) {
+        reclaim_completions(q);
+
+        uint32_t rx_consumer = *q->rx.consumer;
+        uint32_t received = ring_load(q->rx.producer) - rx_consumer;
+        if (received == 0) {
+            // Sleep until the kernel fills the RX ring, which also wakes it
+            // up to use the fill ring when needed. Completions are polled for
+            // as long as responses are in flight
+            int timeout_ms = q->tx_outstanding ? 1 : 1000;
+            if (poll(&pfd, 1, timeout_ms) < 0 && errno != EINTR) {
+                log("Could not poll(2) AF_XDP socket of queue %d: %s\n",
+                    q->queue, strerror(errno));
+                exit(-1);
+            }
+            continue;
+        }
+        received = min<uint32_t>(received, XDP_BATCH);
+
+        uint32_t tx_producer = *q->tx.producer;
+        uint32_t tx_free =
+            XDP_RING_SIZE - (tx_producer - ring_load(q->tx.consumer));
+        uint64_t recycled[XDP_BATCH];
+        uint32_t num_recycled = 0;
+        uint32_t sent = 0;
+        uint64_t tx_full = 0;
+        for (uint32_t i = 0; i < received; i++) {
+            struct xdp_desc* desc = ring_desc(&q->rx, rx_consumer + i);
+            uint32_t response_len;
+            bool respond = answer(q->umem + desc->addr, desc->len,
+                                  &response_len);
+            if (respond && sent < tx_free) {
+                struct xdp_desc* tx = ring_desc(&q->tx, tx_producer + sent);
+                tx->addr = desc->addr;
+                tx->len = response_len;
+                tx->options = 0;
+                sent++;
+            } else {
+                tx_full += respond;
+                recycled[num_recycled++] = desc->addr;
+            }
+        }
+        ring_store(q->rx.consumer, rx_consumer + received);
+        fill_frames(q, recycled, num_recycled);
+
+        if (sent) {
+            ring_store(q->tx.producer, tx_producer + sent);
+            q->tx_outstanding += sent;
+            if (ring_load(q->tx.flags) & XDP_RING_NEED_WAKEUP) {
+                sendto(q->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+            }
+        }
+        metrics_add(&q->packets, received);
+        metrics_add(&q->responses, sent);
+        if (tx_full) {
+            metrics_add(&q->tx_full, tx_full);
+        }
+    }
+    return NULL;
+}
+
+static int load_program(int xsks_map) {
+    enum { LABEL_REDIRECT, LABEL_PASS };
+    bpf_program_t prog;
+
+    // r2 = data, r3 = data_end, and pass anything shorter than a request
+    bpf_mov_reg(&prog, BPF_REG_6, BPF_REG_1);
+    bpf_load(&prog, BPF_W, BPF_REG_2, BPF_REG_1, offsetof(struct xdp_md, data));
+    bpf_load(&prog, BPF_W, BPF_REG_3, BPF_REG_1,
+             offsetof(struct xdp_md, data_end));
+    bpf_mov_reg(&prog, BPF_REG_4, BPF_REG_2);
+    bpf_alu_imm(&prog, BPF_ADD, BPF_REG_4, XDP_MIN_LEN);
+    bpf_jump_reg_to(&prog, BPF_JGT, BPF_REG_4, BPF_REG_3, LABEL_PASS);
+
+    // Loads are in host order, so compare with network order constants
+    bpf_load(&prog, BPF_H, BPF_REG_5, BPF_REG_2,
+             offsetof(struct ethhdr, h_proto));
+    bpf_jump_to(&prog, BPF_JNE, BPF_REG_5, htons(ETH_P_IP), LABEL_PASS);
+    // Version 4 with a 20-byte header
+    bpf_load(&prog, BPF_B, BPF_REG_5, BPF_REG_2, XDP_IP_OFFSET);
+    bpf_jump_to(&prog, BPF_JNE, BPF_REG_5, 0x45, LABEL_PASS);
+    // Neither a fragment nor followed by one
+    bpf_load(&prog, BPF_H, BPF_REG_5, BPF_REG_2,
+             XDP_IP_OFFSET + offsetof(struct iphdr, frag_off));
+    bpf_alu_imm(&prog, BPF_AND, BPF_REG_5, htons(0x3fff));
+    bpf_jump_to(&prog, BPF_JNE, BPF_REG_5, 0, LABEL_PASS);
+    bpf_load(&prog, BPF_B, BPF_REG_5, BPF_REG_2,
+             XDP_IP_OFFSET + offsetof(struct iphdr, protocol));
+    bpf_jump_to(&prog, BPF_JNE, BPF_REG_5, IPPROTO_UDP, LABEL_PASS);
+    bpf_load(&prog, BPF_H, BPF_REG_5, BPF_REG_2,
+             XDP_UDP_OFFSET + offsetof(struct udphdr, dest));
+    bpf_jump_to(&prog, BPF_JNE, BPF_REG_5, htons(config.port), LABEL_PASS);
+    // Version 1 requests have a fixed size, version 2 ones a header, both
+    // are fully validated in userspace
+    bpf_load(&prog, BPF_H, BPF_REG_5, BPF_REG_2,
+             XDP_UDP_OFFSET + offsetof(struct udphdr, len));
+    bpf_jump_to(&prog, BPF_JEQ, BPF_REG_5,
+                htons(sizeof(struct udphdr) + sizeof(stun_request_t)),
+                LABEL_REDIRECT);
+    bpf_load(&prog, BPF_H, BPF_REG_5, BPF_REG_2,
+             XDP_PAYLOAD_OFFSET + offsetof(stun_v2_header_t, magic));
+    bpf_jump_to(&prog, BPF_JNE, BPF_REG_5, htons(STUN_V2_MAGIC), LABEL_PASS);
+    bpf_load(&prog, BPF_B, BPF_REG_5, BPF_REG_2,
+             XDP_PAYLOAD_OFFSET + offsetof(stun_v2_header_t, version));
+    bpf_jump_to(&prog, BPF_JNE, BPF_REG_5, STUN_V2_VERSION, LABEL_PASS);
+
+    bpf_label(&prog, LABEL_REDIRECT);
+    // return bpf_redirect_map(&xsks, ctx->rx_queue_index, XDP_PASS), which
+    // passes the packet on if its queue has no AF_XDP socket
+    bpf_load_map(&prog, BPF_REG_1, xsks_map);
+    bpf_load(&prog, BPF_W, BPF_REG_2, BPF_REG_6,
+             offsetof(struct xdp_md, rx_queue_index));
+    bpf_mov_imm(&prog, BPF_REG_3, XDP_PASS);
+    bpf_call(&prog, BPF_FUNC_redirect_map);
+    bpf_exit(&prog);
+
+    bpf_label(&prog, LABEL_PASS);
+    bpf_mov_imm(&prog, BPF_REG_0, XDP_PASS);
+    bpf_exit(&prog);
+
+    return bpf_prog_load(BPF_PROG_TYPE_XDP, &prog, "stun_xdp");
+}
+
+static xdp_queue_t* open_queue(int ifindex, int queue, uint16_t bind_flags,
+                               int xsks_map) {
+    xdp_queue_t* q = new xdp_queue_t();
+    q->queue = queue;
+    q->fd = socket(AF_XDP, SOCK_RAW, 0);
+    if (q->fd < 0) {
+        log("Could not create AF_XDP socket: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    size_t umem_size = (size_t)XDP_FRAMES * XDP_FRAME_SIZE;
+    q->umem = (uint8_t*)mmap(NULL, umem_size, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (q->umem == MAP_FAILED) {
+        log("Failed to mmap(2) UMEM: %s\n", strerror(errno));
+        return NULL;
+    }
+    struct xdp_umem_reg umem;
+    memset(&umem, 0, sizeof(umem));
+    umem.addr = (uint64_t)(uintptr_t)q->umem;
+    umem.len = umem_size;
+    umem.chunk_size = XDP_FRAME_SIZE;
+    if (setsockopt(q->fd, SOL_XDP, XDP_UMEM_REG, &umem, sizeof(umem)) < 0) {
+        log("Failed to register UMEM: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    int fill_size = XDP_FRAMES;
+    int ring_size = XDP_RING_SIZE;
+    if (setsockopt(q->fd, SOL_XDP, XDP_UMEM_FILL_RING, &fill_size,
+                   sizeof(fill_size)) < 0 ||
+        setsockopt(q->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &ring_size,
+                   sizeof(ring_size)) < 0 ||
+        setsockopt(q->fd, SOL_XDP, XDP_RX_RING, &ring_size,
+                   sizeof(ring_size)) < 0 ||
+        setsockopt(q->fd, SOL_XDP, XDP_TX_RING, &ring_size,
+                   sizeof(ring_size)) < 0) {
+        log("Failed to size AF_XDP rings: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    struct xdp_mmap_offsets offsets;
+    socklen_t optlen = sizeof(offsets);
+    if (getsockopt(q->fd, SOL_XDP, XDP_MMAP_OFFSETS, &offsets, &optlen) < 0) {
+        log("Failed to get AF_XDP ring offsets: %s\n", strerror(errno));
+        return NULL;
+    }
+    if (map_ring(q->fd, &offsets.fr, XDP_FRAMES, sizeof(uint64_t),
+                 XDP_UMEM_PGOFF_FILL_RING, &q->fill) < 0 ||
+        map_ring(q->fd, &offsets.cr, XDP_RING_SIZE, sizeof(uint64_t),
+                 XDP_UMEM_PGOFF_COMPLETION_RING, &q->completion) < 0 ||
+        map_ring(q->fd, &offsets.rx, XDP_RING_SIZE, sizeof(struct xdp_desc),
+                 XDP_PGOFF_RX_RING, &q->rx) < 0 ||
+        map_ring(q->fd, &offsets.tx, XDP_RING_SIZE, sizeof(struct xdp_desc),
+                 XDP_PGOFF_TX_RING, &q->tx) < 0) {
+        return NULL;
+    }
+
+    // Every frame starts out waiting to receive
+    vector<uint64_t> frames(XDP_FRAMES);
+    for (int i = 0; i < XDP_FRAMES; i++) {
+        frames[i] = (uint64_t)i * XDP_FRAME_SIZE;
+    }
+    fill_frames(q, frames.data(), XDP_FRAMES);
+
+    struct sockaddr_xdp addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sxdp_family = AF_XDP;
+    addr.sxdp_flags = bind_flags;
+    addr.sxdp_ifindex = ifindex;
+    addr.sxdp_queue_id = queue;
+    if (bind(q->fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        log("Failed to bind AF_XDP socket to queue %d: %s\n", queue,
+            strerror(errno));
+        return NULL;
+    }
+
+    uint32_t key = queue;
+    if (bpf_map_update(xsks_map, &key, &q->fd) < 0) {
+        log("Failed to add AF_XDP socket of queue %d to the XSKMAP: %s\n",
+            queue, strerror(errno));
+        return NULL;
+    }
+    return q;
+}
+
+static void write_xdp_metrics(FILE* f) {
+    uint64_t packets = 0, responses = 0, tx_full = 0, kernel_drops = 0;
+    for (xdp_queue_t* q : xdp_queues) {
+        packets += q->packets.load(memory_order_relaxed);
+        responses += q->responses.load(memory_order_relaxed);
+        tx_full += q->tx_full.load(memory_order_relaxed);
+
+        struct xdp_statistics stats;
+        socklen_t optlen = sizeof(stats);
+        if (getsockopt(q->fd, SOL_XDP, XDP_STATISTICS, &stats, &optlen) == 0) {
+            kernel_drops += stats.rx_dropped + stats.rx_ring_full;
+        }
+    }
+    metrics_write_counter(f, "stun_xdp_packets_total",
+                          "Requests received over AF_XDP", packets);
+    metrics_write_counter(f, "stun_xdp_responses_total",
+                          "Responses sent over AF_XDP", responses);
+    metrics_write_counter(f, "stun_xdp_tx_ring_full_total",
+                          "Responses dropped because the AF_XDP TX ring was "
+                          "full",
+                          tx_full);
+    metrics_write_counter(f, "stun_xdp_rx_dropped_total",
+                          "Requests the kernel dropped before they reached "
+                          "the AF_XDP RX ring",
+                          kernel_drops);
+}
+
+int xdp_start(const char* ifname, int queues, bool generic,
+              int notify_socket) {
+    int ifindex = if_nametoindex(ifname);
+    if (ifindex == 0) {
+        log("Unknown network interface %s\n", ifname);
+        return -1;
+    }
+    xdp_notify_socket = notify_socket;
+
+    int xsks_map = bpf_map_create(BPF_MAP_TYPE_XSKMAP, sizeof(uint32_t),
+                                  sizeof(int), queues, "stun_xsks");
+    if (xsks_map < 0) {
+        return -1;
+    }
+    int prog = load_program(xsks_map);
+    if (prog < 0) {
+        return -1;
+    }
+
+    // Prefer the driver's native mode, where AF_XDP may even be zero-copy,
+    // but not every driver has one
+    uint16_t bind_flags = XDP_USE_NEED_WAKEUP;
+    if (!generic) {
+        xdp_link = bpf_link_xdp(prog, ifindex, XDP_FLAGS_DRV_MODE);
+        if (xdp_link < 0) {
+            log("Could not attach XDP program to %s in native mode, falling "
+                "back to generic mode: %s\n",
+                ifname, strerror(errno));
+        }
+    }
+    if (xdp_link < 0) {
+        xdp_link = bpf_link_xdp(prog, ifindex, XDP_FLAGS_SKB_MODE);
+        bind_flags |= XDP_COPY;
+    }
+    if (xdp_link < 0) {
+        log("Failed to attach XDP program to %s: %s\n", ifname,
+            strerror(errno));
+        return -1;
+    }
+    close(prog);
+
+    for (int i = 0; i < queues; i++) {
+        xdp_queue_t* q = open_queue(ifindex, i, bind_flags, xsks_map);
+        if (!q) {
+            return -1;
+        }
+        xdp_queues.push_back(q);
+    }
+    metrics_register(write_xdp_metrics);
+
+    for (xdp_queue_t* q : xdp_queues) {
+        pthread_t thread_id;
+        pthread_create(&thread_id, NULL, xdp_worker, q);
+    }
+    log("Serving queues 0 to %d of %s over AF_XDP (%s mode)\n", queues - 1,
+        ifname, (bind_flags & XDP_COPY) ? "generic" : "native");
+    return 0;
+}
@@ -0,0 +1,44 @@
+#ifndef STUN_SERVER_XDP_H
+#define STUN_SERVER_XDP_H
+/**
+ * Copyright Fractal Computers, Inc. 2021
+ * @file xdp.h
+ * @brief AF_XDP fast path for UDP requests
+============================
+Usage
+============================
+
+Call xdp_start() once the UDP sockets are bound. It attaches an XDP program to
+the network interface that redirects every IPv4 datagram for config.port whose
+payload is a stun_request_t or a version 2 request to an AF_XDP socket, one
+per queue, each served by its own thread. Responses are written over the
+request in place and sent back on the same queue without ever entering the
+kernel's network stack.
+
+Everything else (TCP, ARP, other interfaces, malformed datagrams, queues
+without an AF_XDP socket) is passed to the kernel and still reaches the
+regular UDP workers. The XDP program is detached when the process exits.
+*/
+
+/*
+============================
+Public Functions
+============================
+*/
+
+/**
+ * @brief                          Attach the fast path to a network interface
+ *                                 and start serving its queues
+ *
+ * @param ifname                   The network interface, e.g. "eth0"
+ * @param queues                   Number of queues to serve, from queue 0
+ * @param generic                  Attach in generic (skb) mode rather than
+ *                                 trying the driver's native mode first
+ * @param notify_socket            UDP socket bound to config.port, used to
+ *                                 notify servers
+ *
+ * @returns                        0 on success, -1 on failure
+ */
+int xdp_start(const char* ifname, int queues, bool generic, int notify_socket);
+
+#endif  // STUN_SERVER_XDP_H